@@ -0,0 +1,213 @@
+/* File: bench/proptree_bench.cpp
+ *
+ * Times the PropTree paths that every run of switchtool goes through, and
+ * counts the heap allocations each makes, by replacing the global operator
+ * new (so yajl's own malloc()s aren't counted). Run by "make bench"; an
+ * argument multiplies the number of runs. Only PropTree's public interface
+ * is used, so the same file can be built against an older proptree.cpp to
+ * compare.
+ *
+ *   fromjson-op   parsing a boss op with PropTree::FromJson()
+ *   getop-host    main()'s "PropTree phost = boss.GetOp()["host"]"
+ *   phost-copy    Host's copy of the phost into m_phost
+ *   op-loop       main()'s command loop: assigning each op to the same
+ *                 tree and reading its command and args
+ *   send-walk-1k  Boss::SendPropTree()'s walk over a list-ifaces reply of
+ *                 1200 interfaces, minus the JSON generation
+ *   small-lookup  a driver reading the fields of one interface record,
+ *                 where a linear scan of the keys is all there is
+ *   large-lookup  looking interfaces up by name in the 1200-key map
+ *   large-build   a driver's ListIfaces() building that map
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "proptree.hpp"
+
+
+static unsigned long s_allocs = 0;
+
+#if __cplusplus >= 201103L
+#define BENCH_NEW_THROWS
+#define BENCH_NO_THROW noexcept
+#else
+#define BENCH_NEW_THROWS throw(std::bad_alloc)
+#define BENCH_NO_THROW throw()
+#endif
+
+void* operator new(size_t size) BENCH_NEW_THROWS {
+	++s_allocs;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+void* operator new[](size_t size) BENCH_NEW_THROWS {
+	return ::operator new(size);
+}
+void operator delete(void* p) BENCH_NO_THROW {
+	free(p);
+}
+void operator delete[](void* p) BENCH_NO_THROW {
+	free(p);
+}
+
+// Normally main.cpp's; the benchmark links without it.
+std::string fmt(const char* msg, ...) {
+	char buf[1024];
+	va_list ap;
+	va_start(ap, msg);
+	vsnprintf(buf, sizeof(buf), msg, ap);
+	va_end(ap);
+	return std::string(buf);
+}
+
+
+/* Runs fn iterations times and prints its time and allocations per call.
+ * Whatever fn returns is summed and printed, so that the work can't be
+ * optimised away.
+ */
+static void Bench(const char* name, size_t (*fn)(), long iterations) {
+	size_t sink = fn();
+	unsigned long allocs = s_allocs;
+	clock_t start = clock();
+	for (long i = 0; i < iterations; ++i)
+		sink += fn();
+	clock_t end = clock();
+	allocs = s_allocs - allocs;
+	printf("%-24s %9ld %12.1f %12.2f   (%lu)\n", name, iterations,
+	(end - start) * 1e9 / CLOCKS_PER_SEC / iterations,
+	static_cast< double >(allocs) / iterations,
+	static_cast< unsigned long >(sink));
+}
+
+
+static const char* const HOST_OP =
+	"{\"host\": {\"type\": \"junosswitch\", \"hostname\": \"10.1.2.3\","
+	" \"proto-netconfssh\": {\"auth\": \"userpass\", \"username\": \"admin\","
+	" \"password\": \"secret\", \"port\": 22},"
+	" \"proto-snmp2\": \"public\", \"reply-cache-ttl\": 30,"
+	" \"inventory-snapshot\": \"/var/lib/switchtool/10.1.2.3.snap\"}}";
+static const char* const COMMAND_OP =
+	"{\"command\": \"mod-vlans\", \"args\": \"{\\\"10\\\": {\\\"ge-0/0/1\\\":"
+	" \\\"tagged\\\"}, \\\"20\\\": {\\\"ge-0/0/2\\\": \\\"untagged\\\"}}\"}";
+
+static PropTree s_phost;
+
+static size_t FromJsonOp() {
+	PropTree op = PropTree::FromJson(HOST_OP);
+	return op["host"]["hostname"].GetData().length();
+}
+
+static size_t GetOpHost() {
+	PropTree phost = PropTree::FromJson(HOST_OP)["host"];
+	return phost["type"].GetData().length();
+}
+
+static size_t PhostCopy() {
+	PropTree m_phost(s_phost);
+	return (m_phost.ChildExists("reply-cache-ttl") ? 1 : 0);
+}
+
+/* An inventory as list-ifaces reports it; names holds the interface names
+ * in the order they were added.
+ */
+static const long IFACE_COUNT = 1200;
+static std::vector< std::string > s_iface_names;
+static PropTree s_ifaces;
+
+static void BuildIfaces(PropTree& ifaces) {
+	for (size_t i = 0; i < s_iface_names.size(); ++i) {
+		PropTree& iface = ifaces[s_iface_names[i]];
+		iface["description"] = "uplink to distribution";
+		iface["speed"] = (i % 2 ? "1000" : "10000");
+		iface["members"] = "";
+		iface["combiner"] = "";
+	}
+}
+
+// SendPropTreeRecursive(), with a length count in place of the yajl calls.
+static size_t SendWalk(PropTree const& proptree) {
+	size_t len = 0;
+	if (proptree.IsArray()) {
+		for (PropTree::const_iterator it = proptree.Begin();
+		it != proptree.End();
+		++it)
+			len += SendWalk(*it);
+	} else if (!proptree.HasChildren()) {
+		len += proptree.GetData().length();
+	} else {
+		for (PropTree::const_iterator it = proptree.Begin();
+		it != proptree.End();
+		++it) {
+			if (it.GetKey().length() <= 0)
+				continue;
+			len += it.GetKey().length() + SendWalk(*it);
+		}
+	}
+	return len;
+}
+
+static size_t SendWalk1k() {
+	return SendWalk(s_ifaces);
+}
+
+static size_t SmallLookup() {
+	PropTree const& ifaces = s_ifaces;
+	PropTree const& iface = ifaces[s_iface_names[0]];
+	return iface["description"].GetData().length()
+	+ iface["speed"].GetData().length()
+	+ iface["members"].GetData().length()
+	+ iface["combiner"].GetData().length()
+	+ (iface.ChildExists("mtu") ? 1 : 0);
+}
+
+static size_t LargeLookup() {
+	static size_t next = 0;
+	PropTree const& ifaces = s_ifaces;
+	next = (next + 7919) % s_iface_names.size();
+	return ifaces[s_iface_names[next]]["speed"].GetData().length();
+}
+
+static size_t LargeBuild() {
+	PropTree ifaces;
+	BuildIfaces(ifaces);
+	return (ifaces.HasChildren() ? 1 : 0);
+}
+
+static size_t OpLoop() {
+	static PropTree op;
+	op = PropTree::FromJson(COMMAND_OP);
+	if (op.ChildExists("end") || !op.ChildExists("command"))
+		return 0;
+	return op["command"].GetData().length() + op["args"].GetData().length();
+}
+
+
+int main(int argc, char* argv[]) {
+	long scale = (argc > 1 ? atol(argv[1]) : 1);
+	if (scale <= 0)
+		scale = 1;
+	s_phost = PropTree::FromJson(HOST_OP)["host"];
+	for (long i = 0; i < IFACE_COUNT; ++i)
+		s_iface_names.push_back(fmt("ge-%ld/%ld/%ld", i / 480, i / 48 % 10, i % 48));
+	BuildIfaces(s_ifaces);
+
+	printf("%-24s %9s %12s %12s\n", "benchmark", "runs", "ns/run", "allocs/run");
+	Bench("fromjson-op", FromJsonOp, 20000 * scale);
+	Bench("getop-host", GetOpHost, 20000 * scale);
+	Bench("phost-copy", PhostCopy, 1000000 * scale);
+	Bench("op-loop", OpLoop, 20000 * scale);
+	Bench("send-walk-1k", SendWalk1k, 2000 * scale);
+	Bench("small-lookup", SmallLookup, 1000000 * scale);
+	Bench("large-lookup", LargeLookup, 1000000 * scale);
+	Bench("large-build", LargeBuild, 500 * scale);
+	return 0;
+}
@@ -19,6 +19,10 @@ private:
 
 static HostFactoryRegistrant< CalixAEONT > r("calixaeont");
 
+static const PropPath PATH_TELNET_AUTH("proto-telnet.auth");
+static const PropPath PATH_TELNET_USERNAME("proto-telnet.username");
+static const PropPath PATH_TELNET_PASSWORD("proto-telnet.password");
+
 
 struct ONTCommandCB : public DataCallback {
 	const Boss& boss;
@@ -60,14 +64,14 @@ void CalixAEONT::Execute(const std::string& cmd, const std::string& args) {
 void CalixAEONT::GetTerminal() {
 	if (m_term)
 		return;
-	if (m_phost["proto-telnet"]["auth"].GetData() != "userpass")
+	if (PATH_TELNET_AUTH.Get(m_phost).GetData() != "userpass")
 		throw std::string("Must use proto-telnet with auth \"userpass\" for Calix AE ONT");
 	m_term = new Terminal(PROTO_TELNET, m_phost["hostname"].GetData(),
 	m_phost["proto-telnet"], ".?Enter login name:", "--MORE--");
 	m_term->SetPromptRegex("Enter password:");
-	m_term->Execute(m_phost["proto-telnet"]["username"].GetData());
+	m_term->Execute(PATH_TELNET_USERNAME.Get(m_phost).GetData());
 	m_term->SetPromptRegex("Enter <CR> to continue:");
-	m_term->Execute(m_phost["proto-telnet"]["password"].GetData());
+	m_term->Execute(PATH_TELNET_PASSWORD.Get(m_phost).GetData());
 	m_term->SetPromptRegex("[^>]+> ");
 	m_term->Execute("");
 }
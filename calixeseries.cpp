@@ -3,6 +3,8 @@
 
 #include "host.hpp"
 #include "terminal.hpp"
+#include "snmp.hpp"
+#include "snmpfleet.hpp"
 
 class CalixESeries : public Host {
 public:
@@ -12,6 +14,7 @@ public:
 	virtual void Execute(const std::string& cmd, const std::string& args);
 
 private:
+	virtual void ListIfaces(PropTree& ifaces_tree, IfaceDetail detail);
 	void GetTerminal();
 
 	Terminal* m_term;
@@ -19,6 +22,125 @@ private:
 
 static HostFactoryRegistrant< CalixESeries > r("calixeseries");
 
+static const PropPath PATH_USERPASS_USERNAME("auth-userpass.username");
+static const PropPath PATH_USERPASS_PASSWORD("auth-userpass.password");
+
+/* The IF-MIB and IEEE8023-LAG-MIB columns of the SNMP list-ifaces, in one
+ * table walk (dot3adAggPortTable is indexed by ifIndex too), and how many
+ * seconds each may be kept in the walk cache. A terse listing walks only
+ * the columns before COL_IFHIGHSPEED.
+ */
+static const struct {
+	const char* oid;
+	int ttl;
+} IFACE_COLUMNS[] = {
+	{ ".1.3.6.1.2.1.31.1.1.1.1", 600 }, // ifName
+	{ ".1.3.6.1.2.1.31.1.1.1.18", 300 }, // ifAlias
+	{ ".1.3.6.1.2.1.2.2.1.3", 600 }, // ifType
+	{ ".1.2.840.10006.300.43.1.2.1.1.13", 0 }, // dot3adAggPortAttachedAggID
+	{ ".1.3.6.1.2.1.31.1.1.1.15", 0 }, // ifHighSpeed
+	{ ".1.3.6.1.2.1.2.2.1.8", 0 } // ifOperStatus
+};
+enum {
+	COL_IFNAME = 0,
+	COL_IFALIAS,
+	COL_IFTYPE,
+	COL_AGGATTACHED,
+	COL_IFHIGHSPEED,
+	COL_IFOPERSTATUS
+};
+// ifType of a link aggregate
+static const long long IFTYPE_IEEE8023AD_LAG = 161;
+
+
+/* list-ifaces over SNMP, when the phost has "proto-snmp2", giving the same
+ * tree as the CLI: ports by their tid, and LAGs by name with their member
+ * count and the speed of one member.
+ */
+struct CalixIfaceLister : public SNMPIfaceLister {
+	CalixIfaceLister()
+	 : SNMPIfaceLister("calixeseries")
+	{}
+	virtual std::string Community(const PropTree& phost) const {
+		std::string community = phost["proto-snmp2"];
+		if (community.length() <= 0)
+			throw fmt("Must supply an proto-snmp2 community string for Calix E-series");
+		return community;
+	}
+	virtual std::vector< SNMPOid > Columns() const {
+		std::vector< SNMPOid > columns;
+		for (size_t i = 0; i < sizeof(IFACE_COLUMNS) / sizeof(IFACE_COLUMNS[0]); ++i)
+			columns.push_back(SNMPParseOid(IFACE_COLUMNS[i].oid));
+		return columns;
+	}
+	virtual int TTL(size_t column) const {
+		return IFACE_COLUMNS[column].ttl;
+	}
+	virtual size_t ColumnCount(IfaceDetail detail) const {
+		if (detail == IFACE_DETAIL_TERSE)
+			return COL_IFHIGHSPEED;
+		return sizeof(IFACE_COLUMNS) / sizeof(IFACE_COLUMNS[0]);
+	}
+	virtual void BuildIfaces(const SNMPTable& table,
+	PropTree& ifaces_tree) const {
+		const std::vector< SNMPValue >& names = table.columns[COL_IFNAME];
+		const std::vector< SNMPValue >& aliases = table.columns[COL_IFALIAS];
+		const std::vector< SNMPValue >& types = table.columns[COL_IFTYPE];
+		const std::vector< SNMPValue >& attached = table.columns[COL_AGGATTACHED];
+		bool terse = (table.columns.size() <= COL_IFHIGHSPEED);
+		pcrecpp::RE iface1("([0-9]+\\/)*[gx][0-9]+");
+		std::vector< bool > lag(table.rows.size(), false);
+		for (size_t r = 0; r < table.rows.size(); ++r) {
+			const std::string& ifname = names[r].octets;
+			PropTree* editing;
+			if (types[r].Number() == IFTYPE_IEEE8023AD_LAG) {
+				lag[r] = true;
+				editing = &(ifaces_tree[ifname]);
+				(*editing)["description"] = ifname;
+				(*editing)["members"].SetInt(0);
+			} else if (iface1.FullMatch(ifname)) {
+				editing = &(ifaces_tree[ifname]);
+				(*editing)["description"]
+				= (aliases[r].Exists() ? aliases[r].octets : std::string());
+				(*editing)["members"];
+			} else
+				continue;
+			(*editing)["combiner"];
+			if (terse)
+				continue;
+			const SNMPValue& speed = table.columns[COL_IFHIGHSPEED][r];
+			(*editing)["speed"].SetInt(speed.Exists() ? speed.Number() : 0);
+			// ifOperStatus: 1 is up.
+			const SNMPValue& oper = table.columns[COL_IFOPERSTATUS][r];
+			if (oper.Exists() && oper.Number() != 1)
+				(*editing)["speed"].SetInt(0);
+		}
+		// dot3adAggPortAttachedAggID: the LAG each port is bundled into, if any.
+		for (size_t r = 0; r < table.rows.size(); ++r) {
+			long long agg = attached[r].Number();
+			if (lag[r] || !attached[r].Exists() || agg == 0
+			|| !ifaces_tree.ChildExists(names[r].octets))
+				continue;
+			size_t fd = table.Find(static_cast< unsigned int >(agg));
+			if (fd < table.rows.size() && lag[fd]) {
+				PropTree& members = ifaces_tree[names[fd].octets]["members"];
+				members.SetInt(members.GetInt() + 1);
+				ifaces_tree[names[r].octets]["combiner"] = names[fd].octets;
+			}
+		}
+		// As from the CLI, a LAG's speed is that of one of its members.
+		for (size_t r = 0; r < table.rows.size() && !terse; ++r) {
+			if (!lag[r])
+				continue;
+			PropTree& iface = ifaces_tree[names[r].octets];
+			long long members = iface["members"].GetInt();
+			if (members > 0)
+				iface["speed"].SetInt(iface["speed"].GetInt() / members);
+		}
+	}
+};
+static CalixIfaceLister s_iface_lister;
+
 
 struct CalixCommandCB : public DataCallback {
 	PropTree& result;
@@ -43,72 +165,7 @@ CalixESeries::~CalixESeries() {
 }
 
 void CalixESeries::Execute(const std::string& cmd, const std::string& args) {
-	if (cmd == "list-ifaces") {
-		PropTree ifaces_tree;
-		GetTerminal();
-		struct DCB1 : public DataCallback {
-			pcrecpp::RE iface1;
-			pcrecpp::RE speed1;
-			pcrecpp::RE lag1;
-			pcrecpp::RE lagspeed1;
-			PropTree& iftree;
-			PropTree* editing;
-			DCB1(PropTree& t) :
-			iface1("(([0-9]+\\/)*[gx][0-9]+)(.*)(trunk|edge|uplink|peerlink|downlink) *([^ ]+).*"),
-			speed1("([0-9]+)(\\.[0-9]+)?(g|m)"),
-			lag1("LAG Interface *: ([^(]+).*"),
-			lagspeed1("  Current Rate *: ([0-9]*).*"),
-			iftree(t),
-			editing(0)
-			{}
-			virtual void OnData(const std::string& data) {
-				std::string tid;
-				std::string descr;
-				std::string speed;
-				if (iface1.FullMatch(data, &tid, (void*)0, &descr, (void*)0, &speed)) {
-					editing = &(iftree[tid]);
-					while (descr.length() > 0 && descr[0] == ' ')
-						descr.erase(0, 1);
-					while (descr.length() > 0
-					&& (descr[descr.length() - 1] == ' ' || descr[descr.length() - 1] == '+'))
-						descr.erase(descr.length() - 1, 1);
-					(*editing)["description"].SetData(descr);
-					int real_speed = 0;
-					char speed_suffix;
-					if (speed1.FullMatch(speed, &real_speed, (void*)0, &speed_suffix)) {
-						if (speed_suffix == 'g')
-							(*editing)["speed"].SetData(fmt("%d", real_speed * 1000));
-						else
-							(*editing)["speed"].SetData(fmt("%d", real_speed));
-					} else
-						(*editing)["speed"].SetData("0");
-					(*editing)["members"];
-					(*editing)["combiner"];
-				} else if (lag1.FullMatch(data, &tid)) {
-					while (tid.length() > 0 && tid[tid.length() - 1] == ' ')
-						tid.erase(tid.length() - 1, 1);
-					editing = &(iftree[tid]);
-					(*editing)["description"].SetData(tid);
-				} else if (lagspeed1.FullMatch(data, &speed)) {
-					int real_speed = atoi(speed.c_str());
-					int lag_ct = 0;
-					if (real_speed > 0) {
-						int base_speed = pow(10, floor(log10(real_speed)));
-						lag_ct = real_speed / base_speed;
-						real_speed = base_speed;
-					}
-					if (editing) {
-						(*editing)["speed"].SetData(fmt("%d", real_speed * 1000));
-						(*editing)["members"].SetData(fmt("%d", lag_ct));
-						(*editing)["combiner"];
-					}
-				}
-			}
-		} dcb1(ifaces_tree);
-		m_term->Execute("show interface", &dcb1);
-		m_term->Execute("show interface lag detail", &dcb1);
-		m_boss.SendPropTree("interfaces", ifaces_tree);
-	} else if (cmd == "list-iface-details") {
+	if (cmd == "list-iface-details") {
 		if (args.length() <= 0)
 			throw std::string("Must provide a port to show details for");
 		PropTree ifdata;
@@ -211,7 +268,8 @@ void CalixESeries::Execute(const std::string& cmd, const std::string& args) {
 				}
 			}
 		} dcb3(ifdata);
-		m_term->Execute(std::string("show eth-port ") + args + " detail", &dcb3);
+		m_replies.Execute(*m_term, std::string("show eth-port ") + args + " detail",
+		&dcb3);
 		m_boss.SendPropTree("iface-details", ifdata);
 	} else if (cmd == "get-vlan-info") {
 		if (args.length() <= 0)
@@ -240,8 +298,9 @@ void CalixESeries::Execute(const std::string& cmd, const std::string& args) {
 			}
 		} dcb2(vlan_info);
 		GetTerminal();
-		m_term->Execute(std::string("show vlan ") + args, &dcb2);
-		m_term->Execute(std::string("show vlan ") + args + " members", &dcb2);
+		m_replies.Execute(*m_term, std::string("show vlan ") + args, &dcb2);
+		m_replies.Execute(*m_term, std::string("show vlan ") + args + " members",
+		&dcb2);
 		m_boss.SendPropTree("vlan", vlan_info);
 	} else if (cmd == "mod-vlans") {
 		GetTerminal();
@@ -328,13 +387,83 @@ void CalixESeries::Execute(const std::string& cmd, const std::string& args) {
 				}
 			}
 		} dcb4(ifaces_send);
-		m_term->Execute("show eth-port detail", &dcb4);
-		m_term->Execute("show ont-port detail", &dcb4);
+		m_replies.Execute(*m_term, "show eth-port detail", &dcb4);
+		m_replies.Execute(*m_term, "show ont-port detail", &dcb4);
 		m_boss.SendPropTree("interfaces", ifaces_send);
 	} else
 		throw fmt("Not implemented: %s", cmd.c_str());
 }
 
+void CalixESeries::ListIfaces(PropTree& ifaces_tree, IfaceDetail detail) {
+	if (m_phost.ChildExists("proto-snmp2")) {
+		s_iface_lister.ListIfaces(m_phost, ifaces_tree, detail);
+		return;
+	}
+	// The CLI has nothing narrower that still lists the LAGs.
+	GetTerminal();
+	struct DCB1 : public DataCallback {
+		pcrecpp::RE iface1;
+		pcrecpp::RE speed1;
+		pcrecpp::RE lag1;
+		pcrecpp::RE lagspeed1;
+		PropTree& iftree;
+		PropTree* editing;
+		DCB1(PropTree& t) :
+		iface1("(([0-9]+\\/)*[gx][0-9]+)(.*)(trunk|edge|uplink|peerlink|downlink) *([^ ]+).*"),
+		speed1("([0-9]+)(\\.[0-9]+)?(g|m)"),
+		lag1("LAG Interface *: ([^(]+).*"),
+		lagspeed1("  Current Rate *: ([0-9]*).*"),
+		iftree(t),
+		editing(0)
+		{}
+		virtual void OnData(const std::string& data) {
+			std::string tid;
+			std::string descr;
+			std::string speed;
+			if (iface1.FullMatch(data, &tid, (void*)0, &descr, (void*)0, &speed)) {
+				editing = &(iftree[tid]);
+				while (descr.length() > 0 && descr[0] == ' ')
+					descr.erase(0, 1);
+				while (descr.length() > 0
+				&& (descr[descr.length() - 1] == ' ' || descr[descr.length() - 1] == '+'))
+					descr.erase(descr.length() - 1, 1);
+				(*editing)["description"].SetData(descr);
+				int real_speed = 0;
+				char speed_suffix;
+				if (speed1.FullMatch(speed, &real_speed, (void*)0, &speed_suffix)) {
+					if (speed_suffix == 'g')
+						(*editing)["speed"].SetInt(real_speed * 1000);
+					else
+						(*editing)["speed"].SetInt(real_speed);
+				} else
+					(*editing)["speed"].SetInt(0);
+				(*editing)["members"];
+				(*editing)["combiner"];
+			} else if (lag1.FullMatch(data, &tid)) {
+				while (tid.length() > 0 && tid[tid.length() - 1] == ' ')
+					tid.erase(tid.length() - 1, 1);
+				editing = &(iftree[tid]);
+				(*editing)["description"].SetData(tid);
+			} else if (lagspeed1.FullMatch(data, &speed)) {
+				int real_speed = atoi(speed.c_str());
+				int lag_ct = 0;
+				if (real_speed > 0) {
+					int base_speed = pow(10, floor(log10(real_speed)));
+					lag_ct = real_speed / base_speed;
+					real_speed = base_speed;
+				}
+				if (editing) {
+					(*editing)["speed"].SetInt(real_speed * 1000);
+					(*editing)["members"].SetInt(lag_ct);
+					(*editing)["combiner"];
+				}
+			}
+		}
+	} dcb1(ifaces_tree);
+	m_replies.Execute(*m_term, "show interface", &dcb1);
+	m_replies.Execute(*m_term, "show interface lag detail", &dcb1);
+}
+
 void CalixESeries::GetTerminal() {
 	if (m_term)
 		return;
@@ -347,8 +476,8 @@ void CalixESeries::GetTerminal() {
 		m_term = new Terminal(PROTO_TELNET, m_phost["hostname"],
 		m_phost["proto-telnet"], ".?Username: ", "--MORE--");
 		m_term->SetPromptRegex("Password: ");
-		m_term->Execute(m_phost["auth-userpass"]["username"]);
+		m_term->Execute(PATH_USERPASS_USERNAME.Get(m_phost));
 		m_term->SetPromptRegex("[a-zA-Z0-9_-]+>");
-		m_term->Execute(m_phost["auth-userpass"]["password"]);
+		m_term->Execute(PATH_USERPASS_PASSWORD.Get(m_phost));
 	}
 }
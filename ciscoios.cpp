@@ -1,10 +1,22 @@
+extern "C" {
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+}
+
 #include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <map>
 #include <vector>
 #include <sstream>
 
 #include "host.hpp"
 #include "terminal.hpp"
 #include "snmp.hpp"
+#include "snmpfleet.hpp"
 
 
 class CiscoIOS : public Host {
@@ -15,18 +27,118 @@ public:
 	virtual void Execute(const std::string& cmd, const std::string& args);
 
 private:
+	virtual void ListIfaces(PropTree& ifaces_tree, IfaceDetail detail);
 	static const char* REGEX_ROOT;
 	static const char* REGEX_CONFIG;
 	static const char* REGEX_CONFIG_IF;
 	static const char* REGEX_CONFIG_VLAN;
 
 	void GetTerminal();
+	/* get-vlan-info over SNMP: one VLAN's name and member ports, or every
+	 * VLAN's if vlan_id is empty.
+	 */
+	void GetVlanInfoSNMP(const std::string& vlan_id);
+	/* mod-vlans over SNMP, with the "proto-snmp2-write" community: each
+	 * affected trunk's VLAN bitmaps are read once, changed in memory for the
+	 * whole of args and written back with as few SETs as fit, and then the
+	 * running config is copied to startup. Returns false, having done
+	 * nothing, if args asks for more than adding and removing trunk members,
+	 * which is left to the CLI.
+	 */
+	bool ModVlansSNMP(const std::string& args, PropTree& result);
+	// write memory, by CISCO-CONFIG-COPY-MIB.
+	void CopyConfigSNMP(SNMPSession& session, PropTree& result);
 
 	Terminal* m_term;
 };
 
 static HostFactoryRegistrant< CiscoIOS > r("ciscoios");
 
+static const PropPath PATH_TELNET_AUTH("proto-telnet.auth");
+static const PropPath PATH_TELNET_PASSWORD("proto-telnet.password");
+static const PropPath PATH_TELNET_ENABLE("proto-telnet.enable");
+
+/* The IF-MIB and CISCO-PAGP-MIB columns list-ifaces walks, in one table walk,
+ * and how many seconds each may be kept in the walk cache. Names and
+ * descriptions hardly change; link state and bundling are always fresh.
+ * A terse listing walks only the columns before COL_IFHIGHSPEED.
+ */
+static const struct {
+	const char* oid;
+	int ttl;
+} IFACE_COLUMNS[] = {
+	{ ".1.3.6.1.2.1.31.1.1.1.1", 600 }, // ifName
+	{ ".1.3.6.1.2.1.31.1.1.1.18", 300 }, // ifAlias
+	{ ".1.3.6.1.4.1.9.9.98.1.1.1.1.8", 0 }, // pagpGroupIfIndex
+	{ ".1.3.6.1.2.1.31.1.1.1.15", 0 }, // ifHighSpeed
+	{ ".1.3.6.1.2.1.2.2.1.8", 0 } // ifOperStatus
+};
+enum {
+	COL_IFNAME = 0,
+	COL_IFALIAS,
+	COL_PAGPGROUP,
+	COL_IFHIGHSPEED,
+	COL_IFOPERSTATUS
+};
+
+/* The CISCO-VTP-MIB and CISCO-VLAN-MEMBERSHIP-MIB columns behind the SNMP
+ * get-vlan-info, all indexed by ifIndex. The trunk VLAN bitmaps cover 1024
+ * VLANs each.
+ */
+static const char* const VLAN_PORT_COLUMNS[] = {
+	".1.3.6.1.2.1.31.1.1.1.1", // ifName
+	".1.3.6.1.4.1.9.9.46.1.6.1.1.14", // vlanTrunkPortDynamicStatus
+	".1.3.6.1.4.1.9.9.46.1.6.1.1.4", // vlanTrunkPortVlansEnabled
+	".1.3.6.1.4.1.9.9.46.1.6.1.1.17", // vlanTrunkPortVlansEnabled2k
+	".1.3.6.1.4.1.9.9.46.1.6.1.1.18", // vlanTrunkPortVlansEnabled3k
+	".1.3.6.1.4.1.9.9.46.1.6.1.1.19", // vlanTrunkPortVlansEnabled4k
+	".1.3.6.1.4.1.9.9.68.1.2.2.1.2" // vmVlan
+};
+enum {
+	VCOL_IFNAME = 0,
+	VCOL_TRUNKSTATUS,
+	VCOL_VLANS1K,
+	VCOL_VLANS2K,
+	VCOL_VLANS3K,
+	VCOL_VLANS4K,
+	VCOL_VMVLAN
+};
+// vtpVlanName, indexed by management domain and VLAN ID.
+static const char* const OID_VTP_VLAN_NAME = ".1.3.6.1.4.1.9.9.46.1.3.1.1.4";
+static const unsigned int VLANS_PER_BITMAP = 1024;
+static const unsigned int VLAN_ID_MAX = 4095;
+
+// One port added to or removed from a VLAN by the SNMP mod-vlans.
+struct TrunkMemberChange {
+	unsigned int vlan;
+	bool add;
+	std::string iface;
+};
+
+/* ccCopyTable, from CISCO-CONFIG-COPY-MIB, and the columns used to copy
+ * running-config to startup-config with it.
+ */
+static const char* const OID_CC_COPY_ENTRY = ".1.3.6.1.4.1.9.9.96.1.1.1.1";
+enum {
+	CC_SOURCE_FILE_TYPE = 3,
+	CC_DEST_FILE_TYPE = 4,
+	CC_COPY_STATE = 10,
+	CC_COPY_FAIL_CAUSE = 13,
+	CC_COPY_ENTRY_ROW_STATUS = 14
+};
+// ConfigFileType, ConfigCopyState and RowStatus values
+enum {
+	CC_FILE_STARTUP_CONFIG = 3,
+	CC_FILE_RUNNING_CONFIG = 4,
+	CC_STATE_WAITING = 1,
+	CC_STATE_SUCCESSFUL = 3,
+	CC_STATE_FAILED = 4,
+	ROW_STATUS_CREATE_AND_GO = 4,
+	ROW_STATUS_DESTROY = 6
+};
+// How long to wait for the copy to finish, in seconds.
+static const int CC_COPY_TIMEOUT = 60;
+
 
 const char* CiscoIOS::REGEX_ROOT = "[a-zA-Z0-9_-]+\\#";
 const char* CiscoIOS::REGEX_CONFIG = "[a-zA-Z0-9_-]+\\(config\\)\\#";
@@ -34,6 +146,92 @@ const char* CiscoIOS::REGEX_CONFIG_IF = "[a-zA-Z0-9_-]+\\(config-if\\)\\#";
 const char* CiscoIOS::REGEX_CONFIG_VLAN = "[a-zA-Z0-9_-]+\\(config-vlan\\)\\#";
 
 
+struct CiscoIfaceLister : public SNMPIfaceLister {
+	CiscoIfaceLister()
+	 : SNMPIfaceLister("ciscoios")
+	{}
+	virtual std::string Community(const PropTree& phost) const {
+		std::string community = phost["proto-snmp2"];
+		if (community.length() <= 0)
+			throw fmt("Must supply an proto-snmp2 community string for Cisco IOS switch");
+		return community;
+	}
+	virtual std::vector< SNMPOid > Columns() const {
+		std::vector< SNMPOid > columns;
+		for (size_t i = 0; i < sizeof(IFACE_COLUMNS) / sizeof(IFACE_COLUMNS[0]); ++i)
+			columns.push_back(SNMPParseOid(IFACE_COLUMNS[i].oid));
+		return columns;
+	}
+	virtual int TTL(size_t column) const {
+		return IFACE_COLUMNS[column].ttl;
+	}
+	virtual size_t ColumnCount(IfaceDetail detail) const {
+		if (detail == IFACE_DETAIL_TERSE)
+			return COL_IFHIGHSPEED;
+		return sizeof(IFACE_COLUMNS) / sizeof(IFACE_COLUMNS[0]);
+	}
+	virtual void BuildIfaces(const SNMPTable& table,
+	PropTree& ifaces_tree) const {
+		const std::vector< SNMPValue >& names = table.columns[COL_IFNAME];
+		const std::vector< SNMPValue >& aliases = table.columns[COL_IFALIAS];
+		const std::vector< SNMPValue >& groups = table.columns[COL_PAGPGROUP];
+		bool terse = (table.columns.size() <= COL_IFHIGHSPEED);
+		pcrecpp::RE iface1("(Fa|Gi|Po)[0-9]+(\\/[0-9]+)*");
+		std::vector< bool > listed(table.rows.size(), false);
+		for (size_t r = 0; r < table.rows.size(); ++r) {
+			const std::string& ifname = names[r].octets;
+			if (ifname.substr(0, 2) == "Po")
+				ifaces_tree[ifname]["members"].SetInt(0);
+			if (!iface1.FullMatch(ifname))
+				continue;
+			listed[r] = true;
+			PropTree& iface = ifaces_tree[ifname];
+			if (aliases[r].Exists())
+				iface["description"] = aliases[r].octets;
+			if (terse) {
+				iface["members"];
+				iface["combiner"];
+				continue;
+			}
+			const SNMPValue& speed = table.columns[COL_IFHIGHSPEED][r];
+			if (speed.Exists()) {
+				iface["speed"].SetInt(speed.Number());
+				iface["members"];
+				iface["combiner"];
+			}
+			// ifOperStatus: 1 is up.
+			const SNMPValue& oper = table.columns[COL_IFOPERSTATUS][r];
+			if (oper.Exists() && oper.Number() != 1)
+				iface["speed"].SetInt(0);
+		}
+		// pagpGroupIfIndex: the Po each port is bundled into, if any.
+		for (size_t r = 0; r < table.rows.size(); ++r) {
+			long long group = groups[r].Number();
+			if (!groups[r].Exists() || group == 0 || group == table.rows[r].back())
+				continue;
+			size_t fd = table.Find(static_cast< unsigned int >(group));
+			if (fd < table.rows.size() && listed[fd]) {
+				PropTree& members = ifaces_tree[names[fd].octets]["members"];
+				members.SetInt(members.GetInt() + 1);
+			}
+		}
+		for (
+			PropTree::iterator it = ifaces_tree.Begin();
+			it != ifaces_tree.End() && !terse;
+			++it
+		) {
+			long long members = (*it)["members"].GetInt();
+			if (members > 0) {
+				long long speed = (*it)["speed"].GetInt();
+				if (speed > 0)
+					(*it)["speed"].SetInt(speed / members);
+			}
+		}
+	}
+};
+static CiscoIfaceLister s_iface_lister;
+
+
 struct CiscoCommandCB : public DataCallback {
 	PropTree& result;
 	CiscoCommandCB(PropTree& r) :
@@ -66,99 +264,18 @@ CiscoIOS::~CiscoIOS() {
 		delete m_term;
 }
 
-typedef std::map< std::string, std::string > IfaceMap;
 void CiscoIOS::Execute(const std::string& cmd, const std::string& args) {
-	if (cmd == "list-ifaces") {
-		std::string community = m_phost["proto-snmp2"];
-		if (community.length() <= 0)
-			throw fmt("Must supply an proto-snmp2 community string for Cisco IOS switch");
-		std::string ip = m_phost["hostname"];
-		if (ip.length() <= 0)
-			throw fmt("Must supply a hostname or IP address for Cisco IOS switch");
-		PropTree ifaces_tree;
-		struct SCB1 : public SNMPCallback {
-			PropTree& iftree;
-			IfaceMap ifaces;
-			int step;
-			pcrecpp::RE iface1;
-			SCB1(PropTree& t)
-			 : iftree(t),
-			 iface1("(Fa|Gi|Po)[0-9]+(\\/[0-9]+)*")
-			{}
-			virtual void OnData(const std::string& num,
-			const std::string& val) {
-				/* printf("%s\n", val.c_str()); */
-				if (step == 0) {
-					std::string ifname = SNMPUnSTRING(val);
-					if (iface1.FullMatch(ifname))
-						ifaces[num] = ifname;
-					if (ifname[0] == 'P' && ifname[1] == 'o')
-						iftree[ifname]["members"] = "0";
-				} else if (step == 1) {
-					IfaceMap::iterator fd = ifaces.find(num);
-					if (fd != ifaces.end())
-						iftree[fd->second]["description"] = SNMPUnSTRING(val);
-				} else if (step == 2) {
-					IfaceMap::iterator fd = ifaces.find(num);
-					if (fd != ifaces.end()) {
-						iftree[fd->second]["speed"] = val.substr(9);
-						iftree[fd->second]["members"];
-						iftree[fd->second]["combiner"];
-					}
-				} else if (step == 3) {
-					IfaceMap::iterator fd = ifaces.find(num);
-					if (fd != ifaces.end() && SNMPUnSTRING(val) != "up" && val[9] != '1')
-						iftree[fd->second]["speed"] = "0";
-				} else if (step == 4) {
-					if (val.substr(9) != num && val.substr(9) != "0") {
-						IfaceMap::iterator fd = ifaces.find(val.substr(9));
-						if (fd != ifaces.end()) {
-							int members = atoi(
-								iftree[fd->second]["members"].GetData().c_str()
-							);
-							++members;
-							iftree[fd->second]["members"]
-							= dynamic_cast< std::ostringstream& >(
-								std::ostringstream() << std::dec << members
-							).str();
-						}
-					}
-				}
-			}
-		} scb1(ifaces_tree);
-		scb1.step = 0;
-		SNMPWalk(2, community, ip, ".1.3.6.1.2.1.31.1.1.1.1", &scb1);
-		scb1.step = 1;
-		SNMPWalk(2, community, ip, ".1.3.6.1.2.1.31.1.1.1.18", &scb1);
-		scb1.step = 2;
-		SNMPWalk(2, community, ip, ".1.3.6.1.2.1.31.1.1.1.15", &scb1);
-		scb1.step = 3;
-		SNMPWalk(2, community, ip, ".1.3.6.1.2.1.2.2.1.8", &scb1);
-		scb1.step = 4;
-		SNMPWalk(2, community, ip, ".1.3.6.1.4.1.9.9.98.1.1.1.1.8", &scb1);
-		for (
-			PropTree::iterator it = ifaces_tree.Begin();
-			it != ifaces_tree.End();
-			++it
-		) {
-			int members = atoi((*it)["members"].GetData().c_str());
-			if (members > 0) {
-				int speed = atoi((*it)["speed"].GetData().c_str());
-				if (speed > 0) {
-					speed /= members;
-					(*it)["speed"]
-					= dynamic_cast< std::ostringstream& >(
-						std::ostringstream() << std::dec << speed
-					).str();
-				}
-			}
-		}
-		m_boss.SendPropTree("interfaces", ifaces_tree);
+	if (cmd == "poll-counters") {
+		s_iface_lister.PollCounters(m_boss, m_phost, args);
 	} else if (cmd == "get-vlan-info") {
+		if (args.length() > 0 && !pcrecpp::RE("[0-9]{1,4}").FullMatch(args))
+			throw fmt("Invalid vlan ID: %s", args.c_str());
+		if (m_phost.ChildExists("proto-snmp2")) {
+			GetVlanInfoSNMP(args);
+			return;
+		}
 		if (args.length() <= 0)
 			throw std::string("Must provide a VLAN to show");
-		if (!pcrecpp::RE("[0-9]{1,4}").FullMatch(args))
-			throw fmt("Invalid vlan ID: %s", args.c_str());
 		GetTerminal();
 		PropTree vlan_info;
 		struct DCB2 : public DataCallback {
@@ -183,9 +300,18 @@ void CiscoIOS::Execute(const std::string& cmd, const std::string& args) {
 					vinfo["interfaces"].ArrayPushBack(iface);
 			}
 		} dcb2(vlan_info);
-		m_term->Execute(std::string("show vlan id ") + args, &dcb2);
+		m_replies.Execute(*m_term, std::string("show vlan id ") + args, &dcb2);
 		m_boss.SendPropTree("vlan", vlan_info);
 	} else if (cmd == "mod-vlans") {
+		if (m_phost.ChildExists("proto-snmp2-write")) {
+			PropTree result;
+			if (ModVlansSNMP(args, result)) {
+				if (!result.ChildExists("errors"))
+					result["success"] = "1";
+				m_boss.SendPropTree("result", result);
+				return;
+			}
+		}
 		GetTerminal();
 		pcrecpp::StringPiece input(args);
 		pcrecpp::RE create1("create ([0-9]{1,4}) \"([a-zA-Z0-9_-]+)\" *");
@@ -263,6 +389,341 @@ void CiscoIOS::Execute(const std::string& cmd, const std::string& args) {
 		throw fmt("Not implemented: %s", cmd.c_str());
 }
 
+void CiscoIOS::ListIfaces(PropTree& ifaces_tree, IfaceDetail detail) {
+	s_iface_lister.ListIfaces(m_phost, ifaces_tree, detail);
+}
+
+void CiscoIOS::GetVlanInfoSNMP(const std::string& vlan_id) {
+	// Only the one VLAN, if asked for one; otherwise all that exist.
+	bool all = (vlan_id.length() <= 0);
+	unsigned int only = (all ? 0 : atoi(vlan_id.c_str()));
+	if (!all && (only < 1 || only > VLAN_ID_MAX))
+		throw fmt("Invalid vlan ID: %s", vlan_id.c_str());
+	SNMPSession session(2, m_phost["proto-snmp2"], m_phost["hostname"],
+	s_iface_lister.Port(m_phost));
+	SNMPTable names;
+	session.WalkTable(
+		std::vector< SNMPOid >(1, SNMPParseOid(OID_VTP_VLAN_NAME)),
+		names
+	);
+	std::vector< SNMPOid > columns;
+	for (size_t i = 0;
+	i < sizeof(VLAN_PORT_COLUMNS) / sizeof(VLAN_PORT_COLUMNS[0]);
+	++i)
+		columns.push_back(SNMPParseOid(VLAN_PORT_COLUMNS[i]));
+	SNMPTable ports;
+	session.WalkTable(columns, ports);
+
+	std::vector< bool > exists(VLAN_ID_MAX + 1, false);
+	std::vector< std::string > vlan_names(VLAN_ID_MAX + 1);
+	for (size_t r = 0; r < names.rows.size(); ++r) {
+		unsigned int vlan = names.rows[r].back();
+		if (names.rows[r].size() != 2 || vlan > VLAN_ID_MAX
+		|| (!all && vlan != only))
+			continue;
+		exists[vlan] = true;
+		vlan_names[vlan] = names.columns[0][r].octets;
+	}
+
+	// Each VLAN's member ports, as rows of the ports table.
+	std::vector< std::vector< size_t > > members(VLAN_ID_MAX + 1);
+	pcrecpp::RE iface1("(Gi|Fa|Po)[0-9]+(\\/[0-9]+)*");
+	std::vector< unsigned int > vlans;
+	for (size_t r = 0; r < ports.rows.size(); ++r) {
+		if (!iface1.FullMatch(ports.columns[VCOL_IFNAME][r].octets))
+			continue;
+		// vlanTrunkPortDynamicStatus: 1 is trunking.
+		if (ports.columns[VCOL_TRUNKSTATUS][r].Number() == 1) {
+			for (int k = 0; k < 4; ++k) {
+				const std::string& bitmap
+				= ports.columns[VCOL_VLANS1K + k][r].octets;
+				if (!all) {
+					if (only / VLANS_PER_BITMAP == static_cast< unsigned int >(k)
+					&& SNMPBitmapTest(bitmap, only % VLANS_PER_BITMAP))
+						members[only].push_back(r);
+					continue;
+				}
+				vlans.clear();
+				SNMPBitmapBits(bitmap, k * VLANS_PER_BITMAP, vlans);
+				for (size_t v = 0; v < vlans.size(); ++v) {
+					if (vlans[v] <= VLAN_ID_MAX)
+						members[vlans[v]].push_back(r);
+				}
+			}
+		} else if (ports.columns[VCOL_VMVLAN][r].Exists()) {
+			long long vlan = ports.columns[VCOL_VMVLAN][r].Number();
+			if (vlan > 0 && vlan <= VLAN_ID_MAX)
+				members[vlan].push_back(r);
+		}
+	}
+
+	PropTree vlans_tree;
+	for (unsigned int vlan = 1; vlan <= VLAN_ID_MAX; ++vlan) {
+		if (!exists[vlan])
+			continue;
+		PropTree& vlan_info = vlans_tree[fmt("%u", vlan)];
+		vlan_info["name"] = vlan_names[vlan];
+		for (size_t m = 0; m < members[vlan].size(); ++m) {
+			vlan_info["interfaces"].ArrayPushBack(
+				ports.columns[VCOL_IFNAME][members[vlan][m]].octets
+			);
+		}
+	}
+	if (!all)
+		m_boss.SendPropTree("vlan", vlans_tree[fmt("%u", only)]);
+	else
+		m_boss.SendPropTree("vlans", vlans_tree);
+}
+
+bool CiscoIOS::ModVlansSNMP(const std::string& args, PropTree& result) {
+	// Every change asked for, in order.
+	std::vector< TrunkMemberChange > changes;
+	pcrecpp::StringPiece input(args);
+	pcrecpp::RE addmembers1("add-members ([0-9]{1,4}) ");
+	pcrecpp::RE removemembers1("remove-members ([0-9]{1,4}) ");
+	pcrecpp::RE iface1("iface:\"([^\"]+)\" *");
+	pcrecpp::RE rest1(" *");
+	std::string vlan_id;
+	while (true) {
+		TrunkMemberChange change;
+		if (addmembers1.Consume(&input, &vlan_id))
+			change.add = true;
+		else if (removemembers1.Consume(&input, &vlan_id))
+			change.add = false;
+		else
+			break;
+		change.vlan = atoi(vlan_id.c_str());
+		if (change.vlan < 1 || change.vlan > VLAN_ID_MAX)
+			throw fmt("Invalid vlan ID: %s", vlan_id.c_str());
+		while (iface1.Consume(&input, &change.iface))
+			changes.push_back(change);
+	}
+	if (!rest1.FullMatch(input.as_string()))
+		return false;
+
+	SNMPSession session(2, m_phost["proto-snmp2-write"], m_phost["hostname"],
+	s_iface_lister.Port(m_phost));
+	SNMPTable names;
+	session.WalkTable(
+		std::vector< SNMPOid >(1, SNMPParseOid(VLAN_PORT_COLUMNS[VCOL_IFNAME])),
+		names
+	);
+	std::map< std::string, unsigned int > ifindexes;
+	for (size_t r = 0; r < names.rows.size(); ++r) {
+		if (names.rows[r].size() == 1)
+			ifindexes[names.columns[0][r].octets] = names.rows[r][0];
+	}
+
+	// Read only the bitmaps that will change, keyed by their OIDs.
+	std::map< SNMPOid, std::string > bitmaps;
+	std::vector< SNMPOid > oids;
+	for (size_t c = 0; c < changes.size(); ++c) {
+		std::map< std::string, unsigned int >::const_iterator fd
+		= ifindexes.find(changes[c].iface);
+		if (fd == ifindexes.end())
+			continue;
+		SNMPOid oid = SNMPParseOid(
+			VLAN_PORT_COLUMNS[VCOL_VLANS1K + changes[c].vlan / VLANS_PER_BITMAP]
+		);
+		oid.push_back(fd->second);
+		if (bitmaps.insert(std::make_pair(oid, std::string())).second)
+			oids.push_back(oid);
+	}
+	std::vector< SNMPVarBind > vbs;
+	session.Get(oids, vbs);
+	for (size_t i = 0; i < vbs.size(); ++i) {
+		if (vbs[i].type != SNMP_OCTET_STRING)
+			bitmaps.erase(vbs[i].oid);
+		else {
+			std::string& bitmap = bitmaps[vbs[i].oid];
+			bitmap = vbs[i].octets;
+			// Agents may leave off trailing zero octets, but want all of them set.
+			bitmap.resize(VLANS_PER_BITMAP / 8, '\0');
+		}
+	}
+
+	std::map< SNMPOid, std::string > original(bitmaps);
+	for (size_t c = 0; c < changes.size(); ++c) {
+		std::map< std::string, unsigned int >::const_iterator fd
+		= ifindexes.find(changes[c].iface);
+		if (fd == ifindexes.end()) {
+			result["errors"].ArrayPushBack(
+				fmt("No such interface: %s", changes[c].iface.c_str())
+			);
+			continue;
+		}
+		SNMPOid oid = SNMPParseOid(
+			VLAN_PORT_COLUMNS[VCOL_VLANS1K + changes[c].vlan / VLANS_PER_BITMAP]
+		);
+		oid.push_back(fd->second);
+		std::map< SNMPOid, std::string >::iterator bitmap = bitmaps.find(oid);
+		if (bitmap == bitmaps.end()) {
+			result["errors"].ArrayPushBack(
+				fmt("Not a trunk port: %s", changes[c].iface.c_str())
+			);
+			continue;
+		}
+		SNMPBitmapSet(bitmap->second, changes[c].vlan % VLANS_PER_BITMAP,
+		changes[c].add);
+	}
+
+	std::vector< SNMPVarBind > sets;
+	for (std::map< SNMPOid, std::string >::const_iterator it = bitmaps.begin();
+	it != bitmaps.end();
+	++it) {
+		if (it->second == original[it->first])
+			continue;
+		sets.push_back(SNMPVarBind());
+		sets.back().oid = it->first;
+		sets.back().type = SNMP_OCTET_STRING;
+		sets.back().octets = it->second;
+	}
+	if (sets.size() <= 0)
+		return true;
+	/* A long list of bitmaps is set over several PDUs; if a later one fails,
+	 * the earlier ones have still been applied, so say which ports they
+	 * were, and save them all the same.
+	 */
+	size_t set_count = 0;
+	try {
+		session.Set(sets, &set_count);
+	} catch (std::string& e) {
+		result["errors"].ArrayPushBack(e);
+		if (set_count > 0) {
+			std::map< unsigned int, std::string > ifnames;
+			for (std::map< std::string, unsigned int >::const_iterator it
+			= ifindexes.begin();
+			it != ifindexes.end();
+			++it)
+				ifnames[it->second] = it->first;
+			std::map< std::string, bool > changed;
+			for (size_t i = 0; i < set_count; ++i)
+				changed[ifnames[sets[i].oid.back()]] = true;
+			std::string list;
+			for (std::map< std::string, bool >::const_iterator it
+			= changed.begin();
+			it != changed.end();
+			++it)
+				list += (list.length() > 0 ? ", " : "") + it->first;
+			result["errors"].ArrayPushBack(
+				fmt("Changes were applied only to: %s", list.c_str())
+			);
+		}
+	}
+	if (set_count > 0) {
+		try {
+			CopyConfigSNMP(session, result);
+		} catch (std::string& e) {
+			result["errors"].ArrayPushBack(e);
+		}
+	}
+	return true;
+}
+
+/* Reads the state of the ccCopyTable row, appending ccCopyState and
+ * ccCopyFailCause to status.
+ */
+static void GetCopyState(SNMPSession& session, const SNMPOid& entry,
+unsigned int row, std::vector< SNMPVarBind >& status) {
+	std::vector< SNMPOid > state(2, entry);
+	state[0].push_back(CC_COPY_STATE);
+	state[0].push_back(row);
+	state[1].push_back(CC_COPY_FAIL_CAUSE);
+	state[1].push_back(row);
+	session.Get(state, status);
+}
+
+static void DestroyCopyRow(SNMPSession& session, const SNMPOid& entry,
+unsigned int row) {
+	std::vector< SNMPVarBind > vbs(1);
+	vbs[0].oid = entry;
+	vbs[0].oid.push_back(CC_COPY_ENTRY_ROW_STATUS);
+	vbs[0].oid.push_back(row);
+	vbs[0].type = SNMP_INTEGER;
+	vbs[0].integer = ROW_STATUS_DESTROY;
+	session.Set(vbs);
+}
+
+void CiscoIOS::CopyConfigSNMP(SNMPSession& session, PropTree& result) {
+	/* Any row number will do, as long as no one else is using it just now:
+	 * each process starts somewhere random and counts up from there.
+	 */
+	static unsigned int next_row = static_cast< unsigned int >(time(0))
+	* 2654435761U + static_cast< unsigned int >(clock());
+	unsigned int row = (next_row++ & 0x7fffffff) | 1;
+	SNMPOid entry = SNMPParseOid(OID_CC_COPY_ENTRY);
+	std::vector< SNMPVarBind > vbs(3);
+	const int settings[3][2] = {
+		{ CC_SOURCE_FILE_TYPE, CC_FILE_RUNNING_CONFIG },
+		{ CC_DEST_FILE_TYPE, CC_FILE_STARTUP_CONFIG },
+		{ CC_COPY_ENTRY_ROW_STATUS, ROW_STATUS_CREATE_AND_GO }
+	};
+	for (int i = 0; i < 3; ++i) {
+		vbs[i].oid = entry;
+		vbs[i].oid.push_back(settings[i][0]);
+		vbs[i].oid.push_back(row);
+		vbs[i].type = SNMP_INTEGER;
+		vbs[i].integer = settings[i][1];
+	}
+	try {
+		session.Set(vbs);
+	} catch (std::string&) {
+		/* If the createAndGo had to be sent again, the agent may have created
+		 * the row from the first send and refused the second because it
+		 * exists: the copy has started if the row's state can be read.
+		 */
+		if (session.LastAttempts() <= 1)
+			throw;
+		std::vector< SNMPVarBind > status;
+		try {
+			GetCopyState(session, entry, row, status);
+		} catch (std::string&) {
+			status.clear();
+		}
+		long long copy_state = (status.size() > 0 && status[0].Exists()
+		? status[0].Number() : 0);
+		if (copy_state < CC_STATE_WAITING || copy_state > CC_STATE_FAILED)
+			throw;
+	}
+
+	// The row is destroyed however the copy turns out.
+	try {
+		for (int waited = 0; ; ++waited) {
+			std::vector< SNMPVarBind > status;
+			GetCopyState(session, entry, row, status);
+			long long copy_state = status[0].Number();
+			if (copy_state == CC_STATE_SUCCESSFUL)
+				break;
+			if (copy_state == CC_STATE_FAILED) {
+				result["errors"].ArrayPushBack(fmt(
+					"Copying running-config to startup-config failed (ccCopyFailCause %lld)",
+					status[1].Number()
+				));
+				break;
+			}
+			if (waited >= CC_COPY_TIMEOUT) {
+				result["errors"].ArrayPushBack(std::string(
+					"Timed out copying running-config to startup-config"
+				));
+				break;
+			}
+#ifdef WIN32
+			Sleep(1000);
+#else
+			sleep(1);
+#endif
+		}
+	} catch (...) {
+		try {
+			DestroyCopyRow(session, entry, row);
+		} catch (std::string&) {
+			// The first error is the one worth reporting.
+		}
+		throw;
+	}
+	DestroyCopyRow(session, entry, row);
+}
+
 void CiscoIOS::GetTerminal() {
 	if (m_term)
 		return;
@@ -272,14 +733,14 @@ void CiscoIOS::GetTerminal() {
 	} else {
 		if (!m_phost.ChildExists("proto-telnet"))
 			throw fmt("Must use -proto ssh or -proto telnet for a Cisco IOS switch");
-		if (m_phost["proto-telnet"]["auth"] != "console")
+		if (PATH_TELNET_AUTH.Get(m_phost) != "console")
 			throw std::string("Only \"console\" auth type is supported for proto-telnet on Cisco IOS");
 		m_term = new Terminal(PROTO_TELNET, m_phost["hostname"],
 		m_phost["proto-telnet"], ".?Password: ", " --More-- ");
 		m_term->SetPromptRegex("[a-zA-Z0-9_-]+>");
-		m_term->Execute(m_phost["proto-telnet"]["password"]);
+		m_term->Execute(PATH_TELNET_PASSWORD.Get(m_phost));
 	}
-	std::string enable_secret = m_phost["proto-telnet"]["enable"];
+	std::string enable_secret = PATH_TELNET_ENABLE.Get(m_phost);
 	if (enable_secret.length() <= 0)
 		throw std::string("Must use -enable <secret> for Cisco IOS");
 	m_term->SetPromptRegex("Password: ");
@@ -50,12 +50,18 @@ public:
 
 	void SetTCP(int port);
 	PropTree GetOp();
+	/* Waits up to seconds for the boss to send something, returning true if
+	 * an op is waiting to be read with GetOp().
+	 */
+	bool WaitForInput(int seconds) const;
 	void SendReady() const;
 	void SendGoodbye() const;
 	void SendError(std::string const& error) const;
 	void SendLine(std::string const& data) const;
 	void SendOutputFinished() const;
 	void SendPropTree(std::string const& name, const PropTree& proptree) const;
+	// Sends json, a complete JSON object formatted by the caller.
+	void SendMessage(std::string const& json) const;
 	void SendData(std::string const& data) const {
 		this->Send((data + "\n").c_str(), data.length() + 1);
 	}
@@ -64,6 +70,8 @@ private:
 	void Send(const char* snd, size_t len) const;
 
 	int m_sock;
+	// Input read from the boss but not yet returned by GetOp().
+	std::string m_input;
 };
 
 
@@ -3,10 +3,29 @@
 
 
 #include "common.hpp"
+#include "replycache.hpp"
 
 
 struct HostFactory;
 
+// How long a read's reply is reused, in seconds, unless the phost says.
+static const int REPLY_CACHE_TTL = 30;
+
+/* How much list-ifaces asks of the device. Each driver maps these to its
+ * cheapest query that fills in the fields:
+ *   terse: the interfaces, their descriptions and how they are bundled; the
+ *     speed only if it comes for free.
+ *   media: and the speed. The default, and what list-ifaces has always
+ *     reported.
+ *   extensive: the same fields, but from the device's most thorough query,
+ *     for devices where the cheaper ones fall short.
+ */
+enum IfaceDetail {
+	IFACE_DETAIL_TERSE = 0,
+	IFACE_DETAIL_MEDIA,
+	IFACE_DETAIL_EXTENSIVE
+};
+
 
 class Host {
 public:
@@ -16,15 +35,66 @@ public:
 
 	Host(const Boss& boss, const PropTree& phost) :
 	m_boss(boss),
-	m_phost(phost)
+	m_phost(phost),
+	m_replies(phost.ChildExists("reply-cache-ttl")
+	? static_cast< int >(phost["reply-cache-ttl"].GetInt()) : REPLY_CACHE_TTL)
 	{}
 	virtual ~Host() {}
 
+	/* Runs a command from the boss. Commands that work the same way on every
+	 * host type (list-ifaces, watch-ifaces, saved-ifaces, snmp-tuning) are
+	 * handled here; everything else is passed to the driver's Execute(). Any
+	 * command that isn't known to be a read empties m_replies both before and
+	 * after it runs.
+	 */
+	void Dispatch(const std::string& cmd, const std::string& args);
+
 	virtual void Execute(const std::string& cmd, const std::string& args) = 0;
 
 protected:
+	/* Parses list-ifaces' args, a detail level's name ("terse", "media" or
+	 * "extensive"); media if empty.
+	 */
+	static IfaceDetail ParseIfaceDetail(const std::string& args);
+
+	/* Fills ifaces_tree with the interface inventory that list-ifaces
+	 * reports. Drivers that support list-ifaces override this; the default
+	 * throws.
+	 */
+	virtual void ListIfaces(PropTree& ifaces_tree, IfaceDetail detail);
+
+	/* Polls ListIfaces() every interval seconds, sending the full inventory
+	 * once and after that only a PropDiff patch whenever it changes. Args are
+	 * "<interval> [<polls>] [<detail>]"; with no poll limit, watching stops as
+	 * soon as the boss sends its next op.
+	 */
+	void WatchIfaces(const std::string& args);
+
+	/* Writes ifaces_tree to the phost's "inventory-snapshot" file, if it has
+	 * one, so that a later process can send it with saved-ifaces before it
+	 * has polled the device. A failure is reported but doesn't stop the
+	 * command that listed the interfaces.
+	 */
+	void SaveInventory(const PropTree& ifaces_tree);
+	/* Sends the inventory last saved to the "inventory-snapshot" file, as
+	 * "interfaces", without touching the device.
+	 */
+	void SendSavedInventory();
+
+	/* Sends the GETBULK sizing learned so far for each SNMP agent this
+	 * process has walked (see SNMPTuning), keyed by address.
+	 */
+	void SendSNMPTuning();
+
 	const Boss& m_boss;
-	PropTree m_phost;
+	/* Const so that looking up a missing setting can never insert it; see
+	 * PropPath for nested lookups.
+	 */
+	const PropTree m_phost;
+	/* Replies to the reads drivers run through it, for "reply-cache-ttl"
+	 * seconds (0 to turn it off).
+	 */
+	ReplyCache m_replies;
 };
 
 
@@ -0,0 +1,164 @@
+#include <cstdio>
+
+#include "common.hpp"
+#include "ifcounters.hpp"
+
+
+static const char* const OID_SYS_UP_TIME = ".1.3.6.1.2.1.1.3.0";
+static const char* const OID_IF_NAME = ".1.3.6.1.2.1.31.1.1.1.1";
+static const char* const OID_IF_COUNTER_DISCONTINUITY_TIME
+= ".1.3.6.1.2.1.31.1.1.1.19";
+
+static const struct {
+	const char* column;
+	// Counter64 rather than Counter32
+	bool wide;
+	const char* name;
+} COUNTERS[IFCOUNTER_COUNT] = {
+	{ ".1.3.6.1.2.1.31.1.1.1.6", true, "in-bps" },
+	{ ".1.3.6.1.2.1.31.1.1.1.10", true, "out-bps" },
+	{ ".1.3.6.1.2.1.2.2.1.14", false, "in-errors" },
+	{ ".1.3.6.1.2.1.2.2.1.20", false, "out-errors" },
+	{ ".1.3.6.1.2.1.2.2.1.13", false, "in-discards" },
+	{ ".1.3.6.1.2.1.2.2.1.19", false, "out-discards" }
+};
+
+/* A sample is sysUpTime followed by, for each interface, its counters in
+ * IfCounter order and then its ifCounterDiscontinuityTime.
+ */
+static const size_t IFACE_SLOTS = IFCOUNTER_COUNT + 1;
+
+static size_t Slot(size_t iface, size_t counter) {
+	return 1 + iface * IFACE_SLOTS + counter;
+}
+
+// Room for any one formatted number and the comma before it.
+static const size_t FORMAT_NUMBER_MAX = 32;
+
+
+IfCounterPoller::IfCounterPoller(int version, const std::string& community,
+const std::string& ip, int port)
+ : m_session(version, community, ip, port),
+ m_getter(0),
+ m_latest(0),
+ m_primed(false),
+ m_interval(0)
+{
+	SNMPTable table;
+	m_session.WalkTable(std::vector< SNMPOid >(1, SNMPParseOid(OID_IF_NAME)),
+	table);
+	std::vector< SNMPOid > oids(1, SNMPParseOid(OID_SYS_UP_TIME));
+	for (size_t r = 0; r < table.rows.size(); ++r) {
+		if (table.rows[r].size() != 1)
+			continue;
+		m_ifindex.push_back(table.rows[r][0]);
+		m_names.push_back(table.columns[0][r].octets);
+		for (size_t c = 0; c < IFCOUNTER_COUNT; ++c) {
+			oids.push_back(SNMPParseOid(COUNTERS[c].column));
+			oids.back().push_back(m_ifindex.back());
+		}
+		oids.push_back(SNMPParseOid(OID_IF_COUNTER_DISCONTINUITY_TIME));
+		oids.back().push_back(m_ifindex.back());
+	}
+	m_getter = new SNMPGetter(m_session, oids);
+	for (int s = 0; s < 2; ++s) {
+		m_sample[s].resize(oids.size());
+		m_present[s].resize(oids.size());
+		m_sampled[s] = 0;
+	}
+	m_rates.resize(m_ifindex.size() * IFCOUNTER_COUNT);
+	m_known.resize(m_ifindex.size() * IFCOUNTER_COUNT);
+}
+
+IfCounterPoller::~IfCounterPoller() {
+	delete m_getter;
+}
+
+bool IfCounterPoller::Poll() {
+	int prev = m_latest;
+	int cur = (m_latest ^= 1);
+	m_getter->Sample(m_sample[cur], m_present[cur]);
+	m_sampled[cur] = time(0);
+	m_known.assign(m_known.size(), false);
+
+	bool primed = m_primed;
+	m_primed = m_present[cur][0];
+	if (!primed || !m_primed)
+		return false;
+	// sysUpTime is in hundredths of a second, and wraps at 2^32.
+	unsigned long long ticks = (m_sample[cur][0] - m_sample[prev][0])
+	& 0xffffffffULL;
+	/* After a restart the agent's clock seems to have jumped far ahead of
+	 * ours (or not moved at all); either way its counters have been reset.
+	 */
+	unsigned long long wall = m_sampled[cur] - m_sampled[prev];
+	if (ticks == 0 || ticks > (wall + 2) * 100)
+		return false;
+	m_interval = ticks / 100.0;
+
+	for (size_t i = 0; i < m_ifindex.size(); ++i) {
+		size_t disc = Slot(i, IFCOUNTER_COUNT);
+		if (m_present[cur][disc] != m_present[prev][disc]
+		|| (m_present[cur][disc] && m_sample[cur][disc] != m_sample[prev][disc]))
+			continue;
+		for (size_t c = 0; c < IFCOUNTER_COUNT; ++c) {
+			size_t slot = Slot(i, c);
+			if (!m_present[cur][slot] || !m_present[prev][slot])
+				continue;
+			// Unsigned subtraction undoes a wrap in 64 bits, the mask in 32.
+			unsigned long long delta = m_sample[cur][slot] - m_sample[prev][slot];
+			if (!COUNTERS[c].wide)
+				delta &= 0xffffffffULL;
+			double rate = delta / m_interval;
+			if (c == IFCOUNTER_IN_OCTETS || c == IFCOUNTER_OUT_OCTETS)
+				rate *= 8;
+			m_rates[i * IFCOUNTER_COUNT + c] = rate;
+			m_known[i * IFCOUNTER_COUNT + c] = true;
+		}
+	}
+	return true;
+}
+
+bool IfCounterPoller::Rate(size_t i, IfCounter c, double* rate) const {
+	if (!m_known[i * IFCOUNTER_COUNT + c])
+		return false;
+	*rate = m_rates[i * IFCOUNTER_COUNT + c];
+	return true;
+}
+
+void IfCounterPoller::Format(std::string& out) const {
+	char buf[FORMAT_NUMBER_MAX];
+	snprintf(buf, sizeof(buf), "%.2f", m_interval);
+	out += "{\"interval\": ";
+	out += buf;
+	out += ", \"ifindex\": [";
+	for (size_t i = 0; i < m_ifindex.size(); ++i) {
+		snprintf(buf, sizeof(buf), i > 0 ? ", %u" : "%u", m_ifindex[i]);
+		out += buf;
+	}
+	out += ']';
+	for (size_t c = 0; c < IFCOUNTER_COUNT; ++c) {
+		out += ", \"";
+		out += COUNTERS[c].name;
+		out += "\": [";
+		for (size_t i = 0; i < m_ifindex.size(); ++i) {
+			if (i > 0)
+				out += ", ";
+			double rate;
+			if (!this->Rate(i, static_cast< IfCounter >(c), &rate))
+				out += "null";
+			else {
+				snprintf(buf, sizeof(buf), COUNTERS[c].wide ? "%.0f" : "%.2f", rate);
+				out += buf;
+			}
+		}
+		out += ']';
+	}
+	out += '}';
+}
+
+size_t IfCounterPoller::FormatSize() const {
+	return (2 * FORMAT_NUMBER_MAX
+	+ (IFCOUNTER_COUNT + 1) * (FORMAT_NUMBER_MAX + m_ifindex.size()
+	* FORMAT_NUMBER_MAX));
+}
@@ -0,0 +1,95 @@
+#ifndef IFCOUNTERS_HPP_INC
+#define IFCOUNTERS_HPP_INC
+
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+#include "snmp.hpp"
+
+
+/* The interface counters IfCounterPoller turns into rates. */
+enum IfCounter {
+	IFCOUNTER_IN_OCTETS = 0,
+	IFCOUNTER_OUT_OCTETS,
+	IFCOUNTER_IN_ERRORS,
+	IFCOUNTER_OUT_ERRORS,
+	IFCOUNTER_IN_DISCARDS,
+	IFCOUNTER_OUT_DISCARDS,
+	IFCOUNTER_COUNT
+};
+
+/* Samples an agent's IF-MIB counters (ifHCInOctets, ifHCOutOctets and the
+ * error and discard counters) for every interface, and works out per-second
+ * rates between consecutive samples.
+ *
+ * The interfaces are found once, when constructed. After that Poll() is one
+ * SNMPGetter sample into flat arrays, indexed by the interface's position,
+ * and some arithmetic over them; it allocates nothing.
+ *
+ * Rates are over the agent's sysUpTime rather than our own clock, so they
+ * don't suffer from scheduling jitter. 32-bit counter wraps are undone. A
+ * discontinuity (the agent restarting, or an interface's
+ * ifCounterDiscontinuityTime changing) or a missing counter leaves the
+ * affected rates unknown for one poll, rather than reporting nonsense.
+ */
+class IfCounterPoller {
+public:
+	IfCounterPoller(int version, const std::string& community,
+	const std::string& ip, int port = 161);
+	~IfCounterPoller();
+
+	size_t Size() const {
+		return m_ifindex.size();
+	}
+	unsigned int IfIndex(size_t i) const {
+		return m_ifindex[i];
+	}
+	const std::string& Name(size_t i) const {
+		return m_names[i];
+	}
+
+	/* Takes a sample and works out the rates since the previous one. Returns
+	 * false if there is nothing to compare it with (the first poll, or the
+	 * first since the agent restarted).
+	 */
+	bool Poll();
+	// Seconds between the last two samples, by the agent's clock.
+	double Interval() const {
+		return m_interval;
+	}
+	/* The rate of counter c on interface i per second (in bits for the octet
+	 * counters), or false if it isn't known this time.
+	 */
+	bool Rate(size_t i, IfCounter c, double* rate) const;
+
+	/* Appends the latest rates to out as a JSON object of arrays, one entry
+	 * per interface in IfIndex() order and null where a rate isn't known.
+	 * Doesn't allocate if out has room for FormatSize() more characters.
+	 */
+	void Format(std::string& out) const;
+	size_t FormatSize() const;
+
+private:
+	// Not copyable; it owns the getter.
+	IfCounterPoller(const IfCounterPoller&);
+	IfCounterPoller& operator = (const IfCounterPoller&);
+
+	SNMPSession m_session;
+	SNMPGetter* m_getter;
+	std::vector< unsigned int > m_ifindex;
+	std::vector< std::string > m_names;
+	// The last two samples; the latest is m_sample[m_latest].
+	std::vector< unsigned long long > m_sample[2];
+	std::vector< bool > m_present[2];
+	time_t m_sampled[2];
+	int m_latest;
+	bool m_primed;
+	double m_interval;
+	std::vector< double > m_rates;
+	std::vector< bool > m_known;
+};
+
+
+#endif
@@ -2,13 +2,18 @@
 #include <vector>
 #include <list>
 #include <cmath>
+#include <ctime>
+#include <algorithm>
 
 #include "host.hpp"
 #include "terminal.hpp"
 #include "snmp.hpp"
-#include "tinyxml/tinyxml.h"
+#include "snmpfleet.hpp"
+#include "xmlstream.hpp"
 
 
+class JunosVlanEdit;
+
 class JunosSwitch : public Host {
 public:
 	typedef std::map< std::string, std::pair< std::string, std::list< std::string > > > VlanDBMap;
@@ -21,9 +26,12 @@ public:
 	virtual void Execute(const std::string& cmd, const std::string& args);
 
 private:
+	virtual void ListIfaces(PropTree& ifaces_tree, IfaceDetail detail);
 	void GetTerminal();
 	void LoadDB();
-	void LoadCombinerDB();
+	bool QueryVlan(const std::string& vlan_id, VlanDBMap& found);
+	// Empties the ERP ring DB for reloading and returns true, if it's due.
+	bool CombinerDBDue();
 	void LockConfig();
 	void CommitConfig(PropTree* result);
 
@@ -31,52 +39,441 @@ private:
 	VlanDBMap* m_vlandb;
 	CombinerDBMap* m_combinerdb;
 	IfaceCombinerMap* m_ifacecombinerdb;
-	TiXmlDocument* m_config;
+	time_t m_combinerdb_expires;
+	JunosVlanEdit* m_config;
 };
 
 static HostFactoryRegistrant< JunosSwitch > r("junosswitch");
 
+/* The IF-MIB columns of the SNMP interface listing, in one table walk, and
+ * how many seconds each may be kept in the walk cache.
+ */
+static const struct {
+	const char* oid;
+	int ttl;
+} IFACE_COLUMNS[] = {
+	{ ".1.3.6.1.2.1.31.1.1.1.1", 600 }, // ifName
+	{ ".1.3.6.1.2.1.31.1.1.1.18", 300 }, // ifAlias
+	{ ".1.3.6.1.2.1.31.1.1.1.15", 0 }, // ifHighSpeed
+	{ ".1.3.6.1.2.1.2.2.1.8", 0 } // ifOperStatus
+};
+enum {
+	COL_IFNAME = 0,
+	COL_IFALIAS,
+	COL_IFHIGHSPEED,
+	COL_IFOPERSTATUS
+};
+
+/* The SNMP interface listing behind list-ifaces-old, which is also what an
+ * "snmpfleet" poll uses for JunOS switches.
+ */
+struct JunosIfaceLister : public SNMPIfaceLister {
+	JunosIfaceLister()
+	 : SNMPIfaceLister("junosswitch")
+	{}
+	virtual std::string Community(const PropTree& phost) const {
+		std::string community = phost["auth-snmp2"];
+		if (community.length() <= 0)
+			throw fmt("Must supply an SNMPv2 community string for JunOS list-ifaces-old");
+		return community;
+	}
+	virtual std::vector< SNMPOid > Columns() const {
+		std::vector< SNMPOid > columns;
+		for (size_t i = 0; i < sizeof(IFACE_COLUMNS) / sizeof(IFACE_COLUMNS[0]); ++i)
+			columns.push_back(SNMPParseOid(IFACE_COLUMNS[i].oid));
+		return columns;
+	}
+	virtual int TTL(size_t column) const {
+		return IFACE_COLUMNS[column].ttl;
+	}
+	virtual size_t ColumnCount(IfaceDetail detail) const {
+		if (detail == IFACE_DETAIL_TERSE)
+			return COL_IFHIGHSPEED;
+		return sizeof(IFACE_COLUMNS) / sizeof(IFACE_COLUMNS[0]);
+	}
+	virtual void BuildIfaces(const SNMPTable& table,
+	PropTree& ifaces_tree) const {
+		pcrecpp::RE iface1("(ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?");
+		for (size_t r = 0; r < table.rows.size(); ++r) {
+			const std::string& ifname = table.columns[COL_IFNAME][r].octets;
+			if (!iface1.FullMatch(ifname))
+				continue;
+			const SNMPValue& alias = table.columns[COL_IFALIAS][r];
+			if (alias.Exists())
+				ifaces_tree[ifname]["description"] = alias.octets;
+			if (table.columns.size() <= COL_IFHIGHSPEED)
+				continue;
+			const SNMPValue& speed = table.columns[COL_IFHIGHSPEED][r];
+			const SNMPValue& oper = table.columns[COL_IFOPERSTATUS][r];
+			if (speed.Exists())
+				ifaces_tree[ifname]["speed"].SetInt(speed.Number());
+			// ifOperStatus: 1 is up.
+			if (oper.Exists() && oper.Number() != 1)
+				ifaces_tree[ifname]["speed"].SetInt(0);
+		}
+	}
+};
+static JunosIfaceLister s_iface_lister;
 
-struct JunosCommandCB : public DataCallback {
+/* The fields of each record kept from the NETCONF replies, which are read
+ * with XMLRecordReader as they arrive.
+ */
+// interface-information/physical-interface, for list-ifaces
+static const char* const IFACE_FIELDS[] = {
+	"name",
+	"description",
+	"oper-status",
+	"speed",
+	"ethernet-autonegotiation/link-partner-speed"
+};
+enum {
+	IF_NAME = 0,
+	IF_DESCRIPTION,
+	IF_OPER_STATUS,
+	IF_SPEED,
+	IF_PARTNER_SPEED,
+	IF_COUNT
+};
+// interface-information/physical-interface, for get-half-duplex-ifaces
+static const char* const HALF_DUPLEX_FIELDS[] = {
+	"name",
+	"oper-status",
+	"duplex",
+	"ethernet-autonegotiation/link-partner-duplexity"
+};
+enum {
+	HDF_NAME = 0,
+	HDF_OPER_STATUS,
+	HDF_DUPLEX,
+	HDF_PARTNER_DUPLEXITY,
+	HDF_COUNT
+};
+// vlan-information/vlan
+static const char* const VLAN_FIELDS[] = {
+	"vlan-tag",
+	"vlan-name",
+	"vlan-detail/vlan-member-list/vlan-member/vlan-member-interface"
+};
+enum {
+	VF_TAG = 0,
+	VF_NAME,
+	VF_MEMBER,
+	VF_COUNT
+};
+// erp-pg-configuration/erp-protection-group
+static const char* const ERP_FIELDS[] = {
+	"erp-pg-name",
+	"erp-pg-east-interface-name",
+	"erp-pg-west-interface-name"
+};
+enum {
+	ERP_NAME = 0,
+	ERP_EAST,
+	ERP_WEST,
+	ERP_COUNT
+};
+
+
+/* A NETCONF reply, parsed as it arrives by an XMLRecordReader. OnReply() is
+ * called once it has all been read; an XML error is thrown only then, so
+ * that the reply is always read to its end.
+ */
+struct JunosReplyCB : public DataCallback, public XMLRecordReader {
+	std::string xml_error;
+	JunosReplyCB(const std::string& record_path, const char* const* fields,
+	size_t field_count) :
+		XMLRecordReader(record_path, fields, field_count)
+	{}
+	virtual bool Streaming() const {
+		return true;
+	}
+	virtual void OnChunk(const char* data, size_t len) {
+		if (xml_error.length() > 0)
+			return;
+		try {
+			this->Feed(data, len);
+		} catch (std::string& e) {
+			xml_error = e;
+		}
+	}
+	virtual void OnEnd() {
+		try {
+			this->Finish();
+		} catch (std::string& e) {
+			if (xml_error.length() <= 0)
+				xml_error = e;
+		}
+		if (xml_error.length() > 0) {
+			std::string e;
+			e.swap(xml_error);
+			throw e;
+		}
+		this->OnReply();
+	}
+	virtual void OnData(const std::string& data) {
+		this->OnChunk(data.data(), data.length());
+		this->OnEnd();
+	}
+	virtual void OnRecord() {}
+	virtual void OnReply() = 0;
+	// The reply's rpc-error, as thrown when nothing else was found.
+	std::string RPCError(const char* missing) const {
+		if (this->ErrorMessage().length() > 0)
+			return fmt("RPC error: %s", this->ErrorMessage().c_str());
+		return fmt("RPC error: No %s returned", missing);
+	}
+};
+
+struct JunosCommandCB : public JunosReplyCB {
 	const Boss& boss;
 	bool abort_on_fail;
 	JunosCommandCB(const Boss& b) :
+		JunosReplyCB(std::string(), 0, 0),
 		boss(b),
 		abort_on_fail(false)
 	{}
-	virtual void OnData(const std::string& data) {
-		TiXmlDocument doc;
-		doc.Parse(data.c_str());
-		if (doc.Error()) {
+	virtual void OnEnd() {
+		try {
+			JunosReplyCB::OnEnd();
+		} catch (std::string& e) {
 			if (abort_on_fail)
-				throw fmt("XML error: %s", doc.ErrorDesc());
-			else
-				boss.SendError(fmt("XML error: %s", doc.ErrorDesc()));
+				throw;
+			boss.SendError(e);
 		}
-		if (!doc.RootElement()->FirstChildElement("ok")) {
-			printf("---\n%s\n---\n", data.c_str());
-			TiXmlElement* p = doc.RootElement();
-			TiXmlElement* c = p->FirstChildElement("commit-results");
-			if (c)
-				p = c;
-			TiXmlText* emsg = TiXmlHandle(
-				p->FirstChildElement("rpc-error")
-			).FirstChildElement("error-message").FirstChild().ToText();
+	}
+	virtual void OnReply() {
+		if (!this->Ok()) {
+			const char* emsg = (this->ErrorMessage().length() > 0
+			? this->ErrorMessage().c_str() : "Command failed for an unknown reason");
 			if (abort_on_fail)
-				throw std::string(emsg ? emsg->Value() : "Command failed for an unknown reason");
+				throw std::string(emsg);
 			else
-				boss.SendError(emsg ? emsg->Value() : "Command failed for an unknown reason");
+				boss.SendError(emsg);
 		}
 	}
 };
 
 
+/* get-vlan-information's VLANs, into vlans by tag. For a query narrowed to
+ * one VLAN, only_tag is its tag; anything else the switch matched is left
+ * out, and finding nothing isn't an error.
+ */
+struct JunosVlanCB : public JunosReplyCB {
+	JunosSwitch::VlanDBMap& vlans;
+	std::string only_tag;
+	pcrecpp::RE iface1;
+	JunosVlanCB(JunosSwitch::VlanDBMap& v,
+	const std::string& t = std::string()) :
+		JunosReplyCB("vlan-information/vlan", VLAN_FIELDS, VF_COUNT),
+		vlans(v),
+		only_tag(t),
+		iface1("(((ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?)|(ae[0-9]+)).*")
+	{}
+	virtual void OnRecord() {
+		if (!this->Has(VF_TAG))
+			return;
+		if (only_tag.length() > 0 && this->Value(VF_TAG) != only_tag)
+			return;
+		std::list< std::string >& iflist = vlans.insert(
+			std::make_pair(
+				this->Value(VF_TAG),
+				std::make_pair(this->Value(VF_NAME), std::list< std::string >())
+			)
+		).first->second.second;
+		for (size_t m = 0; m < this->Count(VF_MEMBER); ++m) {
+			std::string real_iface;
+			if (iface1.FullMatch(this->Value(VF_MEMBER, m), &real_iface))
+				iflist.push_back(real_iface);
+		}
+	}
+	virtual void OnReply() {
+		if (only_tag.length() <= 0 && this->Records() <= 0)
+			throw this->RPCError("vlan information");
+	}
+};
+
+/* The ERP rings behind list-ifaces' combiners, from get-ring-configuration.
+ * A switch without any just has none to report.
+ */
+struct JunosRingCB : public JunosReplyCB {
+	JunosSwitch::CombinerDBMap& combiners;
+	JunosSwitch::IfaceCombinerMap& iface_combiners;
+	pcrecpp::RE iface1;
+	JunosRingCB(JunosSwitch::CombinerDBMap& c,
+	JunosSwitch::IfaceCombinerMap& i) :
+		JunosReplyCB("erp-pg-configuration/erp-protection-group",
+		ERP_FIELDS, ERP_COUNT),
+		combiners(c),
+		iface_combiners(i),
+		iface1("(((ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?)|(ae[0-9]+)).*")
+	{}
+	virtual void OnRecord() {
+		if (!this->Has(ERP_NAME))
+			return;
+		const std::string& pgname = this->Value(ERP_NAME);
+		std::list< std::string >& iflist = combiners.insert(
+			std::make_pair(pgname, std::list< std::string >())
+		).first->second;
+		std::string ifname;
+		if (iface1.FullMatch(this->Value(ERP_EAST), &ifname)) {
+			iflist.push_back(ifname);
+			iface_combiners[ifname] = std::string("erp:") + pgname;
+		}
+		if (iface1.FullMatch(this->Value(ERP_WEST), &ifname)) {
+			iflist.push_back(ifname);
+			iface_combiners[ifname] = std::string("erp:") + pgname;
+		}
+	}
+	virtual void OnReply() {}
+};
+
+/* How long the ERP rings are kept before list-ifaces asks again, in seconds. */
+static const int RING_CACHE_TTL = 600;
+
+/* How much of an edit-config to build before writing it to the terminal. */
+static const size_t EDIT_CONFIG_PIECE_SIZE = 4096;
+
+/* The candidate <vlans> edit that mod-vlans builds up between LockConfig()
+ * and CommitConfig(). Each VLAN touched has one entry, found by name through
+ * an index, into which all of its operations are merged; so however many
+ * operations there are, building the edit takes linear time. Send() writes
+ * the edit-config to the terminal a piece at a time as it's generated.
+ */
+class JunosVlanEdit {
+public:
+	/* The VLAN name is to exist, tagged vlan_id; is_new if it didn't before
+	 * this edit.
+	 */
+	void Create(const std::string& name, const std::string& vlan_id,
+	bool is_new);
+	/* The interface (a logical unit, such as "ge-0/0/1.0") is to be a member
+	 * of the VLAN, or not.
+	 */
+	void SetMember(const std::string& name, const std::string& iface,
+	bool member);
+	void Delete(const std::string& name);
+	void Send(Terminal& term, DataCallback* dcb) const;
+
+private:
+	struct VlanEdit {
+		std::string name;
+		std::string vlan_id;
+		bool create;
+		bool is_new;
+		bool del;
+		// In the order first named, each with whether it's to be a member.
+		std::vector< std::pair< std::string, bool > > members;
+		std::map< std::string, size_t > member_index;
+	};
+
+	VlanEdit& Find(const std::string& name);
+
+	// In the order first touched; a list, so that entries never move.
+	std::list< VlanEdit > m_vlans;
+	std::map< std::string, VlanEdit* > m_index;
+};
+
+JunosVlanEdit::VlanEdit& JunosVlanEdit::Find(const std::string& name) {
+	std::map< std::string, VlanEdit* >::const_iterator fd = m_index.find(name);
+	if (fd != m_index.end())
+		return *(fd->second);
+	m_vlans.push_back(VlanEdit());
+	VlanEdit& v = m_vlans.back();
+	v.name = name;
+	v.create = false;
+	v.is_new = false;
+	v.del = false;
+	m_index[name] = &v;
+	return v;
+}
+
+void JunosVlanEdit::Create(const std::string& name,
+const std::string& vlan_id, bool is_new) {
+	VlanEdit& v = this->Find(name);
+	v.vlan_id = vlan_id;
+	v.create = true;
+	// After a delete in the same edit, it's replaced whatever came before.
+	if (!v.del)
+		v.is_new = is_new;
+}
+
+void JunosVlanEdit::SetMember(const std::string& name,
+const std::string& iface, bool member) {
+	VlanEdit& v = this->Find(name);
+	std::map< std::string, size_t >::const_iterator fd
+	= v.member_index.find(iface);
+	if (fd != v.member_index.end()) {
+		// The last word on an interface is the one that counts.
+		v.members[fd->second].second = member;
+		return;
+	}
+	v.member_index[iface] = v.members.size();
+	v.members.push_back(std::make_pair(iface, member));
+}
+
+void JunosVlanEdit::Delete(const std::string& name) {
+	VlanEdit& v = this->Find(name);
+	v.members.clear();
+	v.member_index.clear();
+	if (v.create && v.is_new && !v.del) {
+		// Created by this edit alone, so there's nothing on the switch to delete.
+		v.create = false;
+		v.is_new = false;
+		return;
+	}
+	v.create = false;
+	v.del = true;
+}
+
+void JunosVlanEdit::Send(Terminal& term, DataCallback* dcb) const {
+	std::string buf;
+	buf.reserve(EDIT_CONFIG_PIECE_SIZE + 256);
+	buf = "<rpc><edit-config><target><candidate/></target>"
+	"<config><configuration><vlans>";
+	for (std::list< VlanEdit >::const_iterator it = m_vlans.begin();
+	it != m_vlans.end(); ++it) {
+		if (!it->create && !it->del && it->members.empty())
+			continue;
+		buf += "<vlan";
+		if (it->del)
+			buf += (it->create ? " operation=\"replace\""
+			: " operation=\"delete\"");
+		buf += "><name>";
+		XMLAppendEscaped(buf, it->name);
+		buf += "</name>";
+		if (it->create) {
+			buf += "<vlan-id>";
+			XMLAppendEscaped(buf, it->vlan_id);
+			buf += "</vlan-id>";
+		}
+		for (size_t m = 0; m < it->members.size(); ++m) {
+			buf += (it->members[m].second ? "<interface><name>"
+			: "<interface operation=\"delete\"><name>");
+			XMLAppendEscaped(buf, it->members[m].first);
+			buf += "</name></interface>";
+			if (buf.length() >= EDIT_CONFIG_PIECE_SIZE) {
+				term.Write(buf);
+				buf.clear();
+			}
+		}
+		buf += "</vlan>";
+		if (buf.length() >= EDIT_CONFIG_PIECE_SIZE) {
+			term.Write(buf);
+			buf.clear();
+		}
+	}
+	buf += "</vlans></configuration></config></edit-config></rpc>";
+	term.Execute(buf, dcb);
+}
+
+
 JunosSwitch::JunosSwitch(const Boss& boss, const PropTree& phost)
 	: Host(boss, phost),
 	m_term(0),
 	m_vlandb(0),
 	m_combinerdb(0),
 	m_ifacecombinerdb(0),
+	m_combinerdb_expires(0),
 	m_config(0)
 {
 }
@@ -88,180 +485,28 @@ JunosSwitch::~JunosSwitch() {
 	delete m_ifacecombinerdb;
 }
 
-typedef std::map< std::string, std::string > IfaceMap;
 void JunosSwitch::Execute(const std::string& cmd, const std::string& args) {
-	if (cmd == "list-ifaces") {
-		GetTerminal();
-		LoadCombinerDB();
+	if (cmd == "list-ifaces-old") {
 		PropTree ifaces_tree;
-		struct DCB3 : public DataCallback {
-			const Boss& boss;
-			PropTree& iftree;
-			IfaceCombinerMap& combiner_map;
-			pcrecpp::RE iface1;
-			pcrecpp::RE speed1;
-			pcrecpp::RE speed2;
-			pcrecpp::RE speed3;
-			pcrecpp::RE ifaceup1;
-			DCB3(const Boss& b, PropTree& t, IfaceCombinerMap& m) :
-				boss(b),
-				iftree(t),
-				combiner_map(m),
-				iface1("((ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?)|(ae[0-9]+).*"),
-				speed1("([0-9]+)m.*"),
-				speed2("([0-9]+) Mbps.*"),
-				speed3("([0-9]+)([MGT])bps.*"),
-				ifaceup1("up.*")
-			{}
-			virtual void OnData(const std::string& data) {
-				TiXmlDocument doc;
-				doc.Parse(data.c_str());
-				if (doc.Error())
-					throw fmt("XML error: %s", doc.ErrorDesc());
-				TiXmlElement* p = TiXmlHandle(
-					doc.RootElement()->FirstChildElement("interface-information")
-				).FirstChildElement("physical-interface").ToElement();
-				if (!p) {
-					TiXmlText* emsg = TiXmlHandle(
-						doc.RootElement()->FirstChildElement("rpc-error")
-					).FirstChildElement("error-message").FirstChild().ToText();
-					if (emsg)
-						throw fmt("RPC error: %s", emsg->Value());
-					else
-						throw std::string("RPC error: No interface information returned");
-				}
-				for (; p; p = p->NextSiblingElement("physical-interface")) {
-					bool is_lag = false;
-					TiXmlText* iname = TiXmlHandle(
-						p->FirstChildElement("name")
-					).FirstChild().ToText();
-					if (!iname)
-						continue;
-					if (!iface1.FullMatch(iname->Value()))
-						continue;
-					if (iname->Value()[0] == 'a' && iname->Value()[1] == 'e')
-						is_lag = true;
-					PropTree& editing = iftree[iname->Value()];
-					TiXmlText* idescr = TiXmlHandle(
-						p->FirstChildElement("description")
-					).FirstChild().ToText();
-					if (idescr)
-						editing["description"] = idescr->Value();
-					else
-						editing["description"];
-					int speed_i = -1;
-					char mult_char = 'M';
-					TiXmlText* ioper = TiXmlHandle(
-						p->FirstChildElement("oper-status")
-					).FirstChild().ToText();
-					if (ioper && ifaceup1.FullMatch(ioper->Value())) {
-						TiXmlText* ispeed = TiXmlHandle(
-							p->FirstChildElement("speed")
-						).FirstChild().ToText();
-						if (ispeed) {
-							if (!speed1.FullMatch(ispeed->Value(), &speed_i)) {
-								speed3.FullMatch(ispeed->Value(), &speed_i, &mult_char);
-							}
-						}
-						if (speed_i < 0) {
-							TiXmlText* lpspeed = TiXmlHandle(
-								p->FirstChildElement("ethernet-autonegotiation")
-							).FirstChildElement("link-partner-speed").FirstChild()
-							.ToText();
-							if (!lpspeed
-							|| !speed2.FullMatch(lpspeed->Value(), &speed_i))
-								speed_i = 10;
-						}
-					}
-					int speed_multiplier = 1;
-					if (speed_i < 0)
-						speed_i = 0;
-					else if (mult_char == 'G')
-						speed_multiplier = 1000;
-					else if (mult_char == 'T')
-						speed_multiplier = 1000000;
-					speed_i *= speed_multiplier;
-					if (is_lag) {
-						if (speed_i > 0) {
-							int dec_size = (int)pow(10, (int)log10(speed_i));
-							editing["members"] = dynamic_cast< std::ostringstream& >(
-								std::ostringstream() << std::dec
-								<< (speed_i / dec_size)
-							).str();
-							speed_i /= (speed_i / dec_size);
-						}
-						else
-							editing["members"] = "0";
-					} else
-						editing["members"];
-					editing["speed"] = dynamic_cast< std::ostringstream& >(
-						(std::ostringstream() << std::dec << speed_i)
-					).str();
-					IfaceCombinerMap::const_iterator fd
-					= combiner_map.find(iname->Value());
-					if (fd == combiner_map.end())
-						editing["combiner"];
-					else
-						editing["combiner"] = fd->second;
-				}
-			}
-		} dcb3(m_boss, ifaces_tree, *m_ifacecombinerdb);
-		m_term->Execute("<rpc><get-interface-information><extensive/></get-interface-information></rpc>", &dcb3);
-		m_boss.SendPropTree("interfaces", ifaces_tree);
-	} else if (cmd == "list-ifaces-old") {
-		std::string community = m_phost["auth-snmp2"];
-		if (community.length() <= 0)
-			throw fmt("Must supply an SNMPv2 community string for JunOS list-ifaces-old");
-		std::string ip = m_phost["hostname"];
-		if (ip.length() <= 0)
-			throw fmt("Must supply a hostname or IP address for JunOS list-ifaces-old");
-		PropTree ifaces_tree;
-		struct SCB1 : public SNMPCallback {
-			PropTree iftree;
-			IfaceMap ifaces;
-			int step;
-			pcrecpp::RE iface1;
-			SCB1(PropTree& t)
-			 : iftree(t),
-			 iface1("(ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?")
-			{}
-			virtual void OnData(const std::string& num, const std::string& val) {
-				if (step == 0) {
-					if (iface1.FullMatch(val.substr(8)))
-						ifaces[num] = val.substr(8);
-				} else if (step == 1) {
-					IfaceMap::iterator fd = ifaces.find(num);
-					if (fd != ifaces.end())
-						iftree[fd->second]["description"] = val.substr(8);
-				} else if (step == 2) {
-					IfaceMap::iterator fd = ifaces.find(num);
-					if (fd != ifaces.end())
-						iftree[fd->second]["speed"] = val.substr(9);
-				} else if (step == 3) {
-					IfaceMap::iterator fd = ifaces.find(num);
-					if (fd != ifaces.end() && val.substr(9, 2) != "up")
-						iftree[fd->second]["speed"] = "0";
-				}
-			}
-		} scb1(ifaces_tree);
-		scb1.step = 0;
-		SNMPWalk(2, community, ip, ".1.3.6.1.2.1.31.1.1.1.1", &scb1);
-		scb1.step = 1;
-		SNMPWalk(2, community, ip, ".1.3.6.1.2.1.31.1.1.1.18", &scb1);
-		scb1.step = 2;
-		SNMPWalk(2, community, ip, ".1.3.6.1.2.1.31.1.1.1.15", &scb1);
-		scb1.step = 3;
-		SNMPWalk(2, community, ip, ".1.3.6.1.2.1.2.2.1.8", &scb1);
+		s_iface_lister.ListIfaces(m_phost, ifaces_tree, ParseIfaceDetail(args));
 		m_boss.SendPropTree("interfaces", ifaces_tree);
+	} else if (cmd == "poll-counters") {
+		s_iface_lister.PollCounters(m_boss, m_phost, args);
 	} else if (cmd == "get-vlan-info") {
 		if (args.length() <= 0)
 			throw std::string("Must provide a VLAN to show");
 		if (!pcrecpp::RE("[0-9]{1,4}").FullMatch(args))
 			throw fmt("Invalid vlan ID: %s", args.c_str());
-		LoadDB();
+		// From the DB if it's loaded; if not, only this VLAN is asked for.
+		VlanDBMap found;
+		const VlanDBMap* vlandb = &found;
+		if (m_vlandb || !QueryVlan(args, found)) {
+			LoadDB();
+			vlandb = m_vlandb;
+		}
 		PropTree vlan_data;
-		VlanDBMap::const_iterator fd = m_vlandb->find(args);
-		if (fd != m_vlandb->end()) {
+		VlanDBMap::const_iterator fd = vlandb->find(args);
+		if (fd != vlandb->end()) {
 			std::string vname = fd->second.first;
 			pcrecpp::RE("V[0-9]{1,4}-(.*)").FullMatch(fd->second.first, &vname);
 			vlan_data["name"] = vname;
@@ -272,9 +517,16 @@ void JunosSwitch::Execute(const std::string& cmd, const std::string& args) {
 			}
 		}
 		m_boss.SendPropTree("vlan", vlan_data);
+	} else if (cmd == "refresh-vlans") {
+		// For changes made other than by mod-vlans in this session.
+		delete m_vlandb;
+		m_vlandb = 0;
+		LoadDB();
+		PropTree result;
+		result["success"] = "1";
+		m_boss.SendPropTree("result", result);
 	} else if (cmd == "mod-vlans") {
 		PropTree result;
-		LoadDB();
 		LockConfig();
 		pcrecpp::StringPiece input(args);
 		pcrecpp::RE create1("create ([0-9]{1,4}) \"([a-zA-Z0-9_-]+)\" *");
@@ -290,54 +542,21 @@ void JunosSwitch::Execute(const std::string& cmd, const std::string& args) {
 			if (create1.Consume(&input, &vlan_id, &vlan_name)) {
 				if (!vname1.FullMatch(vlan_name))
 					vlan_name = std::string("V") + vlan_id + "-" + vlan_name;
-				TiXmlElement* v = new TiXmlElement("vlan");
-				TiXmlElement* n = new TiXmlElement("name");
-				TiXmlText* nt = new TiXmlText(vlan_name);
-				n->LinkEndChild(nt);
-				v->LinkEndChild(n);
-				TiXmlElement* i = new TiXmlElement("vlan-id");
-				TiXmlText* it = new TiXmlText(vlan_id);
-				i->LinkEndChild(it);
-				v->LinkEndChild(i);
-				m_config->RootElement()->FirstChildElement("edit-config")
-				->FirstChildElement("config")->FirstChildElement("configuration")
-				->FirstChildElement("vlans")->LinkEndChild(v);
-				m_vlandb->insert(std::make_pair(vlan_id, std::make_pair(
-					vlan_name,
-					std::list< std::string >()
-				)));
+				bool is_new = m_vlandb->insert(std::make_pair(vlan_id,
+					std::make_pair(vlan_name, std::list< std::string >())
+				)).second;
+				m_config->Create(vlan_name, vlan_id, is_new);
 			} else if (rename1.Consume(&input, &vlan_id, &vlan_name)) {
 			} else if (addmembers1.Consume(&input, &vlan_id)) {
-				VlanDBMap::const_iterator fd = m_vlandb->find(vlan_id);
+				VlanDBMap::iterator fd = m_vlandb->find(vlan_id);
 				if (fd != m_vlandb->end()) {
-					TiXmlElement* v = m_config->RootElement()
-					->FirstChildElement("edit-config")
-					->FirstChildElement("config")
-					->FirstChildElement("configuration")
-					->FirstChildElement("vlans")->FirstChildElement("vlan");
-					for (; v; v = v->NextSiblingElement("vlan")) {
-						if (fd->second.first ==
-						v->FirstChildElement("name")->FirstChild()->ToText()->Value())
-							break;
-					}
-					if (!v) {
-						v = new TiXmlElement("vlan");
-						TiXmlElement* n = new TiXmlElement("name");
-						TiXmlText* nt = new TiXmlText(fd->second.first);
-						n->LinkEndChild(nt);
-						v->LinkEndChild(n);
-						m_config->RootElement()->FirstChildElement("edit-config")
-						->FirstChildElement("config")->FirstChildElement("configuration")
-						->FirstChildElement("vlans")->LinkEndChild(v);
-					}
+					std::list< std::string >& members = fd->second.second;
 					std::string iftid;
 					while (iface1.Consume(&input, &iftid)) {
-						TiXmlElement* i = new TiXmlElement("interface");
-						TiXmlElement* n = new TiXmlElement("name");
-						TiXmlText* nt = new TiXmlText(iftid + ".0");
-						n->LinkEndChild(nt);
-						i->LinkEndChild(n);
-						v->LinkEndChild(i);
+						m_config->SetMember(fd->second.first, iftid + ".0", true);
+						if (std::find(members.begin(), members.end(), iftid)
+						== members.end())
+							members.push_back(iftid);
 					}
 				} else {
 					result["errors"].ArrayPushBack(
@@ -345,37 +564,12 @@ void JunosSwitch::Execute(const std::string& cmd, const std::string& args) {
 					);
 				}
 			} else if (removemembers1.Consume(&input, &vlan_id)) {
-				VlanDBMap::const_iterator fd = m_vlandb->find(vlan_id);
+				VlanDBMap::iterator fd = m_vlandb->find(vlan_id);
 				if (fd != m_vlandb->end()) {
-					TiXmlElement* v = m_config->RootElement()
-					->FirstChildElement("edit-config")
-					->FirstChildElement("config")
-					->FirstChildElement("configuration")
-					->FirstChildElement("vlans")->FirstChildElement("vlan");
-					for (; v; v = v->NextSiblingElement("vlan")) {
-						if (fd->second.first ==
-						v->FirstChildElement("name")->FirstChild()->ToText()->Value())
-							break;
-					}
-					if (!v) {
-						v = new TiXmlElement("vlan");
-						TiXmlElement* n = new TiXmlElement("name");
-						TiXmlText* nt = new TiXmlText(fd->second.first);
-						n->LinkEndChild(nt);
-						v->LinkEndChild(n);
-						m_config->RootElement()->FirstChildElement("edit-config")
-						->FirstChildElement("config")->FirstChildElement("configuration")
-						->FirstChildElement("vlans")->LinkEndChild(v);
-					}
 					std::string iftid;
 					while (iface1.Consume(&input, &iftid)) {
-						TiXmlElement* i = new TiXmlElement("interface");
-						i->SetAttribute("operation", "delete");
-						TiXmlElement* n = new TiXmlElement("name");
-						TiXmlText* nt = new TiXmlText(iftid + ".0");
-						n->LinkEndChild(nt);
-						i->LinkEndChild(n);
-						v->LinkEndChild(i);
+						m_config->SetMember(fd->second.first, iftid + ".0", false);
+						fd->second.second.remove(iftid);
 					}
 				} else {
 					result["errors"].ArrayPushBack(
@@ -385,15 +579,7 @@ void JunosSwitch::Execute(const std::string& cmd, const std::string& args) {
 			} else if (delete1.Consume(&input, &vlan_id)) {
 				VlanDBMap::iterator fd = m_vlandb->find(vlan_id);
 				if (fd != m_vlandb->end()) {
-					TiXmlElement* v = new TiXmlElement("vlan");
-					v->SetAttribute("operation", "delete");
-					TiXmlElement* n = new TiXmlElement("name");
-					TiXmlText* nt = new TiXmlText(fd->second.first);
-					n->LinkEndChild(nt);
-					v->LinkEndChild(n);
-					m_config->RootElement()->FirstChildElement("edit-config")
-					->FirstChildElement("config")->FirstChildElement("configuration")
-					->FirstChildElement("vlans")->LinkEndChild(v);
+					m_config->Delete(fd->second.first);
 					m_vlandb->erase(fd);
 				} else {
 					result["errors"].ArrayPushBack(
@@ -409,63 +595,169 @@ void JunosSwitch::Execute(const std::string& cmd, const std::string& args) {
 		m_boss.SendPropTree("result", result);
 	} else if (cmd == "get-half-duplex-ifaces") {
 		GetTerminal();
-		struct DCB3 : public DataCallback {
+		struct DCB3 : public JunosReplyCB {
 			const Boss& boss;
 			pcrecpp::RE iface1;
+			PropTree hdifaces;
 			DCB3(const Boss& b) :
+			 JunosReplyCB("interface-information/physical-interface",
+			 HALF_DUPLEX_FIELDS, HDF_COUNT),
 			 boss(b),
 			 iface1("((ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?).*")
 			{}
-			virtual void OnData(const std::string& data) {
-				TiXmlDocument doc;
-				doc.Parse(data.c_str());
-				if (doc.Error())
-					throw fmt("XML error: %s", doc.ErrorDesc());
-				TiXmlElement* p = TiXmlHandle(
-					doc.RootElement()->FirstChildElement("interface-information")
-				).FirstChildElement("physical-interface").ToElement();
-				if (!p) {
-					TiXmlText* emsg = TiXmlHandle(
-						doc.RootElement()->FirstChildElement("rpc-error")
-					).FirstChildElement("error-message").FirstChild().ToText();
-					if (emsg)
-						throw fmt("RPC error: %s", emsg->Value());
-					else
-						throw std::string("RPC error: No interface information returned");
-				}
-				PropTree hdifaces;
-				for (; p; p = p->NextSiblingElement("physical-interface")) {
-					TiXmlText* iname = TiXmlHandle(
-						p->FirstChildElement("name")
-					).FirstChild().ToText();
-					if (!iname || !iface1.FullMatch(iname->Value()))
-						continue;
-					TiXmlText* ostatus = TiXmlHandle(
-						p->FirstChildElement("oper-status")
-					).FirstChild().ToText();
-					if (!ostatus || strcmp(ostatus->Value(), "up") != 0)
-						continue;
-					TiXmlText* duplex = TiXmlHandle(
-						p->FirstChildElement("duplex")
-					).FirstChild().ToText();
-					if (!duplex || strcmp(duplex->Value(), "Auto") != 0)
-						continue;
-					TiXmlText* lpd = TiXmlHandle(
-						p->FirstChildElement("ethernet-autonegotiation")
-					).FirstChildElement("link-partner-duplexity").FirstChild()
-					.ToText();
-					if (!lpd || strcmp(lpd->Value(), "full-duplex") == 0)
-						continue;
-					hdifaces.ArrayPushBack(std::string(iname->Value()));
-				}
+			virtual void OnRecord() {
+				if (!iface1.FullMatch(this->Value(HDF_NAME)))
+					return;
+				if (this->Value(HDF_OPER_STATUS) != "up"
+				|| this->Value(HDF_DUPLEX) != "Auto"
+				|| !this->Has(HDF_PARTNER_DUPLEXITY)
+				|| this->Value(HDF_PARTNER_DUPLEXITY) == "full-duplex")
+					return;
+				hdifaces.ArrayPushBack(this->Value(HDF_NAME));
+			}
+			virtual void OnReply() {
+				if (this->Records() <= 0)
+					throw this->RPCError("interface information");
 				boss.SendPropTree("interfaces", hdifaces);
 			}
 		} dcb5(m_boss);
-		m_term->Execute("<rpc><get-interface-information><extensive/></get-interface-information></rpc>", &dcb5);
+		m_replies.Execute(*m_term, "<rpc><get-interface-information><extensive/></get-interface-information></rpc>", &dcb5);
 	} else
 		throw fmt("Not implemented: %s", cmd.c_str());
 }
 
+void JunosSwitch::ListIfaces(PropTree& ifaces_tree, IfaceDetail detail) {
+	GetTerminal();
+	/* The rings are kept apart from the interfaces, as they hardly change.
+	 * When they're due, they're asked for first, so that their reply comes
+	 * in ahead of the interfaces' in the same round trip.
+	 */
+	bool load_rings = CombinerDBDue();
+	JunosRingCB rcb(*m_combinerdb, *m_ifacecombinerdb);
+	if (load_rings)
+		m_term->Send("<rpc><get-ring-configuration/></rpc>", &rcb);
+	struct DCB3 : public JunosReplyCB {
+		const Boss& boss;
+		PropTree& iftree;
+		IfaceCombinerMap& combiner_map;
+		bool terse;
+		pcrecpp::RE iface1;
+		pcrecpp::RE speed1;
+		pcrecpp::RE speed2;
+		pcrecpp::RE speed3;
+		pcrecpp::RE ifaceup1;
+		DCB3(const Boss& b, PropTree& t, IfaceCombinerMap& m, bool tr) :
+			JunosReplyCB("interface-information/physical-interface",
+			IFACE_FIELDS, IF_COUNT),
+			boss(b),
+			iftree(t),
+			combiner_map(m),
+			terse(tr),
+			iface1("((ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?)|(ae[0-9]+).*"),
+			speed1("([0-9]+)m.*"),
+			speed2("([0-9]+) Mbps.*"),
+			speed3("([0-9]+)([MGT])bps.*"),
+			ifaceup1("up.*")
+		{}
+		virtual void OnRecord() {
+			if (!this->Has(IF_NAME))
+				return;
+			const std::string& iname = this->Value(IF_NAME);
+			if (!iface1.FullMatch(iname))
+				return;
+			bool is_lag = (iname.substr(0, 2) == "ae");
+			PropTree& editing = iftree[iname];
+			if (this->Has(IF_DESCRIPTION))
+				editing["description"] = this->Value(IF_DESCRIPTION);
+			else
+				editing["description"];
+			if (terse) {
+				// Without the speed, a LAG's member count isn't known either.
+				editing["members"];
+				this->SetCombiner(editing, iname);
+				return;
+			}
+			int speed_i = -1;
+			char mult_char = 'M';
+			if (this->Has(IF_OPER_STATUS)
+			&& ifaceup1.FullMatch(this->Value(IF_OPER_STATUS))) {
+				if (this->Has(IF_SPEED)) {
+					const std::string& ispeed = this->Value(IF_SPEED);
+					if (!speed1.FullMatch(ispeed, &speed_i))
+						speed3.FullMatch(ispeed, &speed_i, &mult_char);
+				}
+				if (speed_i < 0) {
+					if (!this->Has(IF_PARTNER_SPEED)
+					|| !speed2.FullMatch(this->Value(IF_PARTNER_SPEED), &speed_i))
+						speed_i = 10;
+				}
+			}
+			int speed_multiplier = 1;
+			if (speed_i < 0)
+				speed_i = 0;
+			else if (mult_char == 'G')
+				speed_multiplier = 1000;
+			else if (mult_char == 'T')
+				speed_multiplier = 1000000;
+			speed_i *= speed_multiplier;
+			if (is_lag) {
+				if (speed_i > 0) {
+					int dec_size = (int)pow(10, (int)log10(speed_i));
+					editing["members"].SetInt(speed_i / dec_size);
+					speed_i /= (speed_i / dec_size);
+				}
+				else
+					editing["members"].SetInt(0);
+			} else
+				editing["members"];
+			editing["speed"].SetInt(speed_i);
+			this->SetCombiner(editing, iname);
+		}
+		void SetCombiner(PropTree& editing, const std::string& iname) {
+			IfaceCombinerMap::const_iterator fd = combiner_map.find(iname);
+			if (fd == combiner_map.end())
+				editing["combiner"];
+			else
+				editing["combiner"] = fd->second;
+		}
+		virtual void OnReply() {
+			if (this->Records() <= 0)
+				throw this->RPCError("interface information");
+		}
+	} dcb3(m_boss, ifaces_tree, *m_ifacecombinerdb,
+	detail == IFACE_DETAIL_TERSE);
+	if (detail == IFACE_DETAIL_EXTENSIVE)
+		m_replies.Execute(*m_term, "<rpc><get-interface-information><extensive/></get-interface-information></rpc>", &dcb3);
+	else if (detail == IFACE_DETAIL_MEDIA)
+		m_replies.Execute(*m_term, "<rpc><get-interface-information><media/></get-interface-information></rpc>", &dcb3);
+	else {
+		/* terse leaves out the descriptions, which come from "descriptions",
+		 * though only for the interfaces that have one.
+		 */
+		m_replies.Execute(*m_term, "<rpc><get-interface-information><terse/></get-interface-information></rpc>", &dcb3);
+		struct DCB4 : public JunosReplyCB {
+			PropTree& iftree;
+			DCB4(PropTree& t) :
+				JunosReplyCB("interface-information/physical-interface",
+				IFACE_FIELDS, IF_COUNT),
+				iftree(t)
+			{}
+			virtual void OnRecord() {
+				const std::string& iname = this->Value(IF_NAME);
+				if (this->Has(IF_DESCRIPTION) && iftree.ChildExists(iname))
+					iftree[iname]["description"] = this->Value(IF_DESCRIPTION);
+			}
+			virtual void OnReply() {
+				if (this->ErrorMessage().length() > 0)
+					throw this->RPCError("interface descriptions");
+			}
+		} dcb4(ifaces_tree);
+		m_replies.Execute(*m_term, "<rpc><get-interface-information><descriptions/></get-interface-information></rpc>", &dcb4);
+	}
+	if (load_rings)
+		m_combinerdb_expires = time(0) + RING_CACHE_TTL;
+}
+
 void JunosSwitch::GetTerminal() {
 	if (m_term)
 		return;
@@ -473,7 +765,8 @@ void JunosSwitch::GetTerminal() {
 		throw fmt("Must use proto-netconfssh for a JunOS switch");
 	m_term = new Terminal(PROTO_NETCONF_SSH, m_phost["hostname"],
 	m_phost["proto-netconfssh"]);
-	m_term->Execute(
+	// The server's own hello is read along with the first reply.
+	m_term->Send(
 "<hello> \
   <capabilities> \
     <capability>urn:ietf:params:xml:ns:netconf:base:1.0</capability> \
@@ -489,178 +782,99 @@ void JunosSwitch::GetTerminal() {
 }
 
 void JunosSwitch::LoadDB() {
-	LoadCombinerDB();
 	if (m_vlandb)
 		return;
+	GetTerminal();
+	// Kept only once it's all been read, as it may be for the whole session.
+	VlanDBMap vlandb;
+	JunosVlanCB dcb2(vlandb);
+	m_replies.Execute(*m_term, "<rpc><get-vlan-information/></rpc>", &dcb2);
 	m_vlandb = new VlanDBMap;
+	m_vlandb->swap(vlandb);
+}
+
+/* Asks the switch for just the one VLAN, for when the whole DB isn't loaded
+ * and one lookup doesn't warrant loading it. <vlan-name> filters by name, and
+ * our VLANs are all named V<tag>-<name>, so the filter is V<tag>-*; finding
+ * nothing means there's no such VLAN. Returns false only if the switch
+ * rejected the filter, leaving it to the caller to fall back on LoadDB().
+ */
+bool JunosSwitch::QueryVlan(const std::string& vlan_id, VlanDBMap& found) {
 	GetTerminal();
-	struct DCB2 : public DataCallback {
-		VlanDBMap& vlans;
-		pcrecpp::RE iface1;
-		DCB2(VlanDBMap& v) :
-			vlans(v),
-			iface1("(((ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?)|(ae[0-9]+)).*")
-		{}
-		virtual void OnData(const std::string& data) {
-			TiXmlDocument doc;
-			doc.Parse(data.c_str());
-			if (doc.Error())
-				throw fmt("XML error: %s", doc.ErrorDesc());
-			TiXmlElement* v = TiXmlHandle(
-				doc.RootElement()->FirstChildElement("vlan-information")
-			).FirstChildElement("vlan").ToElement();
-			if (!v) {
-				TiXmlText* emsg = TiXmlHandle(
-					doc.RootElement()->FirstChildElement("rpc-error")
-				).FirstChildElement("error-message").FirstChild().ToText();
-				if (emsg)
-					throw fmt("RPC error: %s", emsg->Value());
-				else
-					throw std::string("RPC error: No vlan information returned");
-			}
-			for (; v; v = v->NextSiblingElement("vlan")) {
-				TiXmlText* vtag = TiXmlHandle(
-					v->FirstChildElement("vlan-tag")
-				).FirstChild().ToText();
-				if (!vtag)
-					continue;
-				TiXmlText* vnt = TiXmlHandle(
-					v->FirstChildElement("vlan-name")
-				).FirstChild().ToText();
-				std::string vname;
-				if (vnt)
-					vname = vnt->Value();
-				std::list< std::string >& iflist = vlans.insert(
-					std::make_pair(
-						std::string(vtag->Value()),
-						std::make_pair(vname, std::list< std::string >())
-					)
-				).first->second.second;
-				for (TiXmlElement* m = TiXmlHandle(
-					v->FirstChildElement("vlan-detail")
-				).FirstChildElement("vlan-member-list")
-				.FirstChildElement("vlan-member").ToElement();
-				m; m = m->NextSiblingElement("vlan-member")) {
-					TiXmlText* iface = TiXmlHandle(
-						m->FirstChildElement("vlan-member-interface")
-					).FirstChild().ToText();
-					if (iface) {
-						std::string real_iface;
-						if (iface1.FullMatch(iface->Value(), &real_iface))
-							iflist.push_back(real_iface);
-					}
-				}
-			}
-		}
-	} dcb2(*m_vlandb);
-	m_term->Execute("<rpc><get-vlan-information/></rpc>", &dcb2);
+	JunosVlanCB dcb2(found, vlan_id);
+	std::string rpc = std::string("<rpc><get-vlan-information><vlan-name>V")
+	+ vlan_id + "-*</vlan-name></get-vlan-information></rpc>";
+	m_replies.Execute(*m_term, rpc, &dcb2);
+	return (dcb2.ErrorMessage().length() <= 0);
 }
 
-void JunosSwitch::LoadCombinerDB() {
-	if (m_combinerdb)
-		return;
+bool JunosSwitch::CombinerDBDue() {
+	if (m_ifacecombinerdb && time(0) < m_combinerdb_expires)
+		return false;
+	delete m_combinerdb;
+	delete m_ifacecombinerdb;
 	m_combinerdb = new CombinerDBMap;
 	m_ifacecombinerdb = new IfaceCombinerMap;
-	return;
-	GetTerminal();
-	struct DCB5 : public DataCallback {
-		Boss const& boss;
-		CombinerDBMap& combiners;
-		IfaceCombinerMap& iface_combiners;
-		pcrecpp::RE iface1;
-		DCB5(Boss const& b, CombinerDBMap& c, IfaceCombinerMap& i) :
-			boss(b),
-			combiners(c),
-			iface_combiners(i),
-			iface1("(((ge|xe)-[0-9]+\\/[0-9]+(\\/[0-9]+)?)|(ae[0-9]+)).*")
-		{}
-		virtual void OnData(const std::string& data) {
-			TiXmlDocument doc;
-			doc.Parse(data.c_str());
-			if (doc.Error())
-				throw fmt("XML error: %s", doc.ErrorDesc());
-			TiXmlElement* g = TiXmlHandle(
-				doc.RootElement()->FirstChildElement("erp-pg-configuration")
-			).FirstChildElement("erp-protection-group").ToElement();
-			if (!g)
-				return;
-			for (; g; g = g->NextSiblingElement("erp-protection-group")) {
-				TiXmlText* pgname = TiXmlHandle(
-					g->FirstChildElement("erp-pg-name")
-				).FirstChild().ToText();
-				if (!pgname || strlen(pgname->Value()) <= 0)
-					continue;
-				std::list< std::string >& iflist = combiners.insert(
-					std::make_pair(
-						std::string(pgname->Value()), std::list< std::string >()
-					)
-				).first->second;
-				TiXmlText* xifname = TiXmlHandle(
-					g->FirstChildElement("erp-pg-east-interface-name")
-				).FirstChild().ToText();
-				std::string ifname;
-				if (iface1.FullMatch(xifname->Value(), &ifname)) {
-					iflist.push_back(ifname);
-					iface_combiners[ifname] = std::string("erp:")
-					+ pgname->Value();
-					printf("%s\n", pgname->Value());
-				}
-				xifname = TiXmlHandle(
-					g->FirstChildElement("erp-pg-west-interface-name")
-				).FirstChild().ToText();
-				if (iface1.FullMatch(xifname->Value(), &ifname)) {
-					iflist.push_back(ifname);
-					iface_combiners[ifname] = std::string("erp:")
-					+ pgname->Value();
-				}
-			}
-		}
-	} dcb5(m_boss, *m_combinerdb, *m_ifacecombinerdb);
-	m_term->Execute("<rpc><get-ring-configuration/></rpc>", &dcb5);
+	return true;
 }
 
+/* Locks the candidate and loads the VLAN DB, which are asked for together
+ * so that it takes a single round trip.
+ */
 void JunosSwitch::LockConfig() {
-	if (m_config)
+	if (m_config) {
+		LoadDB();
 		return;
+	}
 	GetTerminal();
 	JunosCommandCB jcb(m_boss);
 	jcb.abort_on_fail = true;
-	m_term->Execute("<rpc><lock><target><candidate/></target></lock></rpc>", &jcb);
-	m_config = new TiXmlDocument;
-	m_config->Parse(
-"<rpc> \
-  <edit-config> \
-    <target><candidate/></target> \
-    <config> \
-      <configuration> \
-        <vlans/> \
-      </configuration> \
-    </config> \
-  </edit-config> \
-</rpc>"
-	);
-	if (m_config->Error())
-		throw fmt("XML error: %s", m_config->ErrorDesc());
+	m_term->Send("<rpc><lock><target><candidate/></target></lock></rpc>", &jcb);
+	LoadDB();
+	m_term->Flush();
+	m_config = new JunosVlanEdit;
 }
 
+/* Commits the edit mod-vlans built. mod-vlans has already brought m_vlandb
+ * up to date as it went, so that's kept if the commit goes through; if not,
+ * it's thrown away, to be loaded afresh when next needed.
+ */
 void JunosSwitch::CommitConfig(PropTree* result) {
 	if (!m_config)
 		return;
-	delete m_vlandb;
-	m_vlandb = 0;
-	std::string newconfig;
-	newconfig << (*m_config);
 	GetTerminal();
 	JunosCommandCB jcb(m_boss);
 	jcb.abort_on_fail = true;
+	JunosCommandCB ucb(m_boss);
+	ucb.abort_on_fail = true;
+	// Only an edit known to have gone in whole is committed.
+	bool edited = false;
 	try {
-		m_term->Execute(newconfig, &jcb);
-		m_term->Execute("<rpc><commit/></rpc>", &jcb);
+		m_config->Send(*m_term, &jcb);
+		edited = true;
 	} catch(std::string& e) {
 		if (result)
 			(*result)["errors"].ArrayPushBack(e);
 	}
-	m_term->Execute("<rpc><unlock><target><candidate/></target></unlock></rpc>", &jcb);
+	// The unlock needn't wait for the commit's reply.
+	if (edited)
+		m_term->Send("<rpc><commit/></rpc>", &jcb);
+	m_term->Send("<rpc><unlock><target><candidate/></target></unlock></rpc>", &ucb);
+	bool committed = false;
+	if (edited) {
+		try {
+			m_term->Receive();
+			committed = true;
+		} catch(std::string& e) {
+			if (result)
+				(*result)["errors"].ArrayPushBack(e);
+		}
+	}
+	if (!committed) {
+		delete m_vlandb;
+		m_vlandb = 0;
+	}
+	m_term->Receive();
 	delete m_config;
 	m_config = 0;
 }
@@ -6,6 +6,8 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstdarg>
+#include <cerrno>
+#include <ctime>
 
 extern "C" {
 #ifdef WIN32
@@ -13,6 +15,8 @@ extern "C" {
 #include <winsock2.h>
 #else
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -21,6 +25,9 @@ extern "C" {
 
 #include "common.hpp"
 #include "host.hpp"
+#include "propdiff.hpp"
+#include "propsnapshot.hpp"
+#include "snmp.hpp"
 #include "yajl/yajl_gen.h"
 
 
@@ -76,28 +83,63 @@ void Boss::SetTCP(int port) {
 		throw fmt("Failed to connect to 127.0.0.1:%d", port);
 }
 PropTree Boss::GetOp() {
-	std::string buf;
-	char ch;
+	size_t scan = 0;
 	while (true) {
+		size_t end = m_input.find("}}:}}:", scan);
+		if (end != std::string::npos) {
+			std::string op(m_input, 0, end);
+			m_input.erase(0, end + 6);
+			return PropTree::FromJson(op);
+		}
+		// The terminator may be split across reads.
+		scan = (m_input.length() > 5 ? m_input.length() - 5 : 0);
+		char buf[4096];
+		int got;
 		if (m_sock != 0) {
-			if (recv(m_sock, &ch, 1, 0) <= 0)
+			got = recv(m_sock, buf, sizeof(buf), 0);
+			if (got <= 0)
 				throw fmt("EOF or error on boss TCP input");
 		} else {
-			if (fread(&ch, 1, 1, stdin) != 1)
+#ifdef WIN32
+			// fread() would wait for the whole block.
+			got = static_cast< int >(fread(buf, 1, 1, stdin));
+#else
+			/* Unbuffered by stdio, so that whatever the boss sent is either
+			 * still on the descriptor or in m_input, where WaitForInput()
+			 * looks for it.
+			 */
+			got = static_cast< int >(read(0, buf, sizeof(buf)));
+#endif
+			if (got <= 0)
 				throw fmt("EOF or error on boss stdin input");
 		}
-		buf += ch;
-		if (buf.length() >= 6
-		&& buf[buf.length() - 1] == ':'
-		&& buf[buf.length() - 2] == '}'
-		&& buf[buf.length() - 3] == '}'
-		&& buf[buf.length() - 4] == ':'
-		&& buf[buf.length() - 5] == '}'
-		&& buf[buf.length() - 6] == '}')
-			break;
+		m_input.append(buf, got);
+	}
+}
+bool Boss::WaitForInput(int seconds) const {
+	// What GetOp() has read past the last op comes first.
+	if (m_input.find_first_not_of(" \t\r\n") != std::string::npos)
+		return true;
+#ifdef WIN32
+	// select() only works on sockets here, so stdin can't be watched.
+	if (m_sock == 0) {
+		Sleep(seconds * 1000);
+		return false;
+	}
+#endif
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(m_sock, &fds);
+	struct timeval tv;
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	int ret = select(m_sock + 1, &fds, 0, 0, &tv);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return false;
+		throw fmt("Error waiting on boss input");
 	}
-	buf.erase(buf.length() - 6);
-	return PropTree::FromJson(buf);
+	return (ret > 0);
 }
 void Boss::Send(const char* snd, size_t len) const {
 	if (m_sock != 0)
@@ -121,6 +163,10 @@ void Boss::SendOutputFinished() const {
 	std::string snd = "{\"output-finished\": 1}\n}}:}}:\n";
 	this->Send(snd.c_str(), snd.length());
 }
+void Boss::SendMessage(std::string const& json) const {
+	this->Send(json.data(), json.length());
+	this->Send("\n}}:}}:\n", 8);
+}
 void Boss::SendReady() const {
 	std::string snd = "{\"ready\": 1}\n}}:}}:\n";
 	this->Send(snd.c_str(), snd.length());
@@ -129,20 +175,42 @@ void Boss::SendGoodbye() const {
 	std::string snd = "{\"goodbye\": 1}\n}}:}}:\n";
 	this->Send(snd.c_str(), snd.length());
 }
+static void SendPropTreeScalar(yajl_gen g, PropTree const& proptree) {
+	switch (proptree.GetType()) {
+		case PROPTREE_INTEGER:
+			yajl_gen_integer(g, proptree.GetInt());
+			break;
+		case PROPTREE_DOUBLE:
+			// JSON has no representation for inf/NaN.
+			if (yajl_gen_double(g, proptree.GetDouble()) != yajl_gen_status_ok)
+				yajl_gen_null(g);
+			break;
+		case PROPTREE_BOOL:
+			yajl_gen_bool(g, proptree.GetBool() ? 1 : 0);
+			break;
+		case PROPTREE_NULL:
+			yajl_gen_null(g);
+			break;
+		default:
+			{
+				std::string data = proptree.GetData();
+				yajl_gen_string(
+					g,
+					reinterpret_cast< const unsigned char* >(data.c_str()),
+					data.length()
+				);
+			}
+			break;
+	}
+}
 static void SendPropTreeRecursive(yajl_gen g, PropTree const& proptree) {
-	if (!proptree.HasChildren()) {
-		yajl_gen_string(
-			g,
-			reinterpret_cast< const unsigned char* >(proptree.GetData().c_str()),
-			proptree.GetData().length()
-		);
-	} else if (proptree.IsArray()) {
+	if (proptree.IsArray()) {
 		yajl_gen_array_open(g);
-		for (PropTree::const_iterator it = proptree.Begin();
-		it != proptree.End();
-		++it)
-			SendPropTreeRecursive(g, *it);
+		for (size_t i = 0; i < proptree.Size(); ++i)
+			SendPropTreeRecursive(g, proptree.at(i));
 		yajl_gen_array_close(g);
+	} else if (!proptree.HasChildren()) {
+		SendPropTreeScalar(g, proptree);
 	} else {
 		yajl_gen_map_open(g);
 		for (PropTree::const_iterator it = proptree.Begin();
@@ -199,6 +267,135 @@ Host* Host::Construct(const Boss& boss, const PropTree& phost) {
 	return fd->second->Construct(boss, phost);
 }
 
+/* The commands that never change a device. Anything else (mod-vlans,
+ * passthru, and whatever comes along later) is taken to be a write.
+ */
+static bool IsReadCommand(const std::string& cmd) {
+	static const char* const READS[] = {
+		"list-ifaces",
+		"list-ifaces-old",
+		"list-iface-details",
+		"watch-ifaces",
+		"poll-counters",
+		"get-vlan-info",
+		"get-half-duplex-ifaces",
+		"saved-ifaces",
+		"snmp-tuning"
+	};
+	for (size_t i = 0; i < sizeof(READS) / sizeof(READS[0]); ++i) {
+		if (cmd == READS[i])
+			return true;
+	}
+	return false;
+}
+
+void Host::Dispatch(const std::string& cmd, const std::string& args) {
+	if (!IsReadCommand(cmd)) {
+		m_replies.Clear();
+		try {
+			Execute(cmd, args);
+		} catch (...) {
+			m_replies.Clear();
+			throw;
+		}
+		m_replies.Clear();
+	} else if (cmd == "list-ifaces") {
+		PropTree ifaces_tree;
+		ListIfaces(ifaces_tree, ParseIfaceDetail(args));
+		SaveInventory(ifaces_tree);
+		m_boss.SendPropTree("interfaces", ifaces_tree);
+	} else if (cmd == "watch-ifaces")
+		WatchIfaces(args);
+	else if (cmd == "saved-ifaces")
+		SendSavedInventory();
+	else if (cmd == "snmp-tuning")
+		SendSNMPTuning();
+	else
+		Execute(cmd, args);
+}
+
+void Host::SendSNMPTuning() {
+	PropTree tunings_tree;
+	std::map< std::string, SNMPTuning >* tunings = SNMPTuning::GetTunings();
+	for (std::map< std::string, SNMPTuning >::const_iterator it
+	= tunings->begin();
+	it != tunings->end();
+	++it) {
+		PropTree& tuning = tunings_tree[it->first];
+		tuning["max-repetitions"].SetInt(it->second.max_repetitions);
+		tuning["ceiling"].SetInt(it->second.ceiling);
+		tuning["rtt-ms"].SetInt(it->second.rtt_ms);
+		tuning["response-bytes"].SetInt(it->second.response_bytes);
+	}
+	m_boss.SendPropTree("snmp-tuning", tunings_tree);
+}
+
+IfaceDetail Host::ParseIfaceDetail(const std::string& args) {
+	if (args.length() <= 0 || args == "media")
+		return IFACE_DETAIL_MEDIA;
+	if (args == "terse")
+		return IFACE_DETAIL_TERSE;
+	if (args == "extensive")
+		return IFACE_DETAIL_EXTENSIVE;
+	throw fmt("Invalid interface detail level: %s", args.c_str());
+}
+
+void Host::ListIfaces(PropTree& ifaces_tree, IfaceDetail detail) {
+	throw std::string("Not implemented: list-ifaces");
+}
+
+void Host::WatchIfaces(const std::string& args) {
+	char* end;
+	long interval = strtol(args.c_str(), &end, 10);
+	long polls = strtol(end, &end, 10);
+	if (args.length() <= 0)
+		interval = 60;
+	while (*end == ' ')
+		++end;
+	if (interval <= 0 || polls < 0)
+		throw fmt("Invalid watch-ifaces arguments: %s", args.c_str());
+	IfaceDetail detail = ParseIfaceDetail(end);
+	time_t next = time(0) + interval;
+	PropTree ifaces_tree;
+	ListIfaces(ifaces_tree, detail);
+	SaveInventory(ifaces_tree);
+	m_boss.SendPropTree("interfaces", ifaces_tree);
+	for (long poll = 1; polls == 0 || poll < polls; ++poll) {
+		time_t now = time(0);
+		if (m_boss.WaitForInput(next > now ? next - now : 0))
+			break;
+		next += interval;
+		// Each poll is meant to see the device as it is now.
+		m_replies.Clear();
+		PropTree latest;
+		ListIfaces(latest, detail);
+		PropTree patch = PropDiff::Diff(ifaces_tree, latest);
+		if (patch.Size() > 0) {
+			SaveInventory(latest);
+			m_boss.SendPropTree("interfaces-patch", patch);
+		}
+		ifaces_tree.Swap(latest);
+	}
+	m_boss.SendOutputFinished();
+}
+
+void Host::SaveInventory(const PropTree& ifaces_tree) {
+	if (!m_phost.ChildExists("inventory-snapshot"))
+		return;
+	try {
+		PropSnapshot::Write(m_phost["inventory-snapshot"], ifaces_tree);
+	} catch (std::string& e) {
+		m_boss.SendError(e);
+	}
+}
+
+void Host::SendSavedInventory() {
+	if (!m_phost.ChildExists("inventory-snapshot"))
+		throw std::string("No inventory-snapshot file for saved-ifaces");
+	PropSnapshot snap(m_phost["inventory-snapshot"]);
+	m_boss.SendPropTree("interfaces", snap.Load());
+}
+
 
 int main(int argc, char* argv[]) {
 #ifdef WIN32
@@ -230,7 +427,7 @@ int main(int argc, char* argv[]) {
 				break;
 			if (!op.ChildExists("command"))
 				throw std::string("Command expected");
-			host->Execute(op["command"], op["args"]);
+			host->Dispatch(op["command"], op["args"]);
 		}
 		delete host;
 		boss.SendGoodbye();
@@ -0,0 +1,219 @@
+/* File: propdiff.cpp
+ */
+
+
+#include "propdiff.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include "common.hpp"
+
+
+static void AddOp(PropTree& patch, const char* op, std::string const& path,
+PropTree const* value) {
+	PropTree& entry = patch.ArrayPushBack(PropTree());
+	entry["op"] = std::string(op);
+	entry["path"] = path;
+	if (value)
+		entry["value"] = *value;
+}
+
+// Returns true and sets idx if step is a plain array index.
+static bool ParseIndex(std::string const& step, size_t* idx) {
+	if (step.length() <= 0 || step.length() > 9
+	|| (step[0] == '0' && step.length() > 1))
+		return false;
+	for (std::string::const_iterator it = step.begin(); it != step.end(); ++it) {
+		if (*it < '0' || *it > '9')
+			return false;
+	}
+	*idx = strtoul(step.c_str(), 0, 10);
+	return true;
+}
+
+// Returns the existing child of tree named by one pointer step.
+static PropTree& PatchStep(PropTree& tree, std::string const& step,
+std::string const& path) {
+	if (tree.IsArray()) {
+		size_t idx;
+		if (!ParseIndex(step, &idx) || idx >= tree.Size())
+			throw fmt("Patch path not found: %s", path.c_str());
+		return tree.at(idx);
+	}
+	if (!tree.ChildExists(step))
+		throw fmt("Patch path not found: %s", path.c_str());
+	return tree.at(step);
+}
+
+
+PropTree PropDiff::Diff(PropTree const& from, PropTree const& to) {
+	PropTree patch;
+	patch.SetArray();
+	std::string path;
+	DiffRecursive(from, to, path, patch);
+	return patch;
+}
+
+void PropDiff::DiffRecursive(PropTree const& from, PropTree const& to,
+std::string& path, PropTree& patch) {
+	PropTreeNode const& a = from.Node();
+	PropTreeNode const& b = to.Node();
+	if (&a == &b)
+		return;
+	size_t len = path.length();
+	if (!a.array && !b.array && !a.children.empty() && !b.children.empty()) {
+		for (PropTreeChildrenArray::const_iterator it = a.children.begin();
+		it != a.children.end();
+		++it) {
+			if (it->key == PropTreeKeys::Empty())
+				continue;
+			AppendPointerStep(path, *(it->key));
+			size_t fd = b.Find(it->key);
+			if (fd >= b.children.size())
+				AddOp(patch, "remove", path, 0);
+			else
+				DiffRecursive(it->tree, b.children[fd].tree, path, patch);
+			path.erase(len);
+		}
+		for (PropTreeChildrenArray::const_iterator it = b.children.begin();
+		it != b.children.end();
+		++it) {
+			if (it->key == PropTreeKeys::Empty()
+			|| a.Find(it->key) < a.children.size())
+				continue;
+			AppendPointerStep(path, *(it->key));
+			AddOp(patch, "add", path, &(it->tree));
+			path.erase(len);
+		}
+		return;
+	}
+	if (a.array && b.array && a.children.size() == b.children.size()) {
+		char buf[32];
+		for (size_t i = 0; i < a.children.size(); ++i) {
+			snprintf(buf, sizeof(buf), "/%lu", static_cast< unsigned long >(i));
+			path += buf;
+			DiffRecursive(a.children[i].tree, b.children[i].tree, path, patch);
+			path.erase(len);
+		}
+		return;
+	}
+	if (!Equal(from, to))
+		AddOp(patch, "replace", path, &to);
+}
+
+bool PropDiff::Equal(PropTree const& x, PropTree const& y) {
+	PropTreeNode const& a = x.Node();
+	PropTreeNode const& b = y.Node();
+	if (&a == &b)
+		return true;
+	if (a.array != b.array || a.children.size() != b.children.size())
+		return false;
+	if (a.children.empty()) {
+		if (a.type != b.type)
+			return false;
+		switch (a.type) {
+			case PROPTREE_INTEGER:
+				return (a.scalar.i == b.scalar.i);
+			case PROPTREE_DOUBLE:
+				return (a.scalar.d == b.scalar.d);
+			case PROPTREE_BOOL:
+				return (a.scalar.b == b.scalar.b);
+			case PROPTREE_NULL:
+				return true;
+			default:
+				return (a.data == b.data);
+		}
+	}
+	for (size_t i = 0; i < a.children.size(); ++i) {
+		PropTreeKey key = a.children[i].key;
+		size_t fd = i;
+		if (key != PropTreeKeys::Empty())
+			fd = b.Find(key);
+		else if (b.children[i].key != key)
+			return false;
+		if (fd >= b.children.size()
+		|| !Equal(a.children[i].tree, b.children[fd].tree))
+			return false;
+	}
+	return true;
+}
+
+void PropDiff::Patch(PropTree& tree, PropTree const& patch) {
+	for (size_t i = 0; i < patch.Size(); ++i) {
+		PropTree const& entry = patch.at(i);
+		std::string op = entry["op"];
+		std::string path = entry["path"];
+		if (op != "add" && op != "remove" && op != "replace")
+			throw fmt("Unknown patch op: %s", op.c_str());
+		std::vector< std::string > steps = ParsePointer(path);
+		if (steps.empty()) {
+			if (op == "remove")
+				tree = PropTree();
+			else
+				tree = entry["value"];
+			continue;
+		}
+		PropTree* parent = &tree;
+		for (size_t s = 0; s + 1 < steps.size(); ++s)
+			parent = &PatchStep(*parent, steps[s], path);
+		std::string const& last = steps.back();
+		if (op == "remove") {
+			if (parent->IsArray()) {
+				size_t idx;
+				if (!ParseIndex(last, &idx) || idx >= parent->Size())
+					throw fmt("Patch path not found: %s", path.c_str());
+				parent->Erase(idx);
+			} else if (!parent->Erase(last))
+				throw fmt("Patch path not found: %s", path.c_str());
+		} else if (parent->IsArray()) {
+			size_t idx = parent->Size();
+			if (op == "replace" || last != "-") {
+				if (!ParseIndex(last, &idx) || idx > parent->Size()
+				|| (op == "replace" && idx == parent->Size()))
+					throw fmt("Patch path not found: %s", path.c_str());
+			}
+			if (op == "replace")
+				parent->at(idx) = entry["value"];
+			else
+				parent->ArrayInsert(idx, entry["value"]);
+		} else {
+			if (op == "replace" && !parent->ChildExists(last))
+				throw fmt("Patch path not found: %s", path.c_str());
+			parent->at(last) = entry["value"];
+		}
+	}
+}
+
+void PropDiff::AppendPointerStep(std::string& path, std::string const& key) {
+	path += '/';
+	for (std::string::const_iterator it = key.begin(); it != key.end(); ++it) {
+		if (*it == '~')
+			path += "~0";
+		else if (*it == '/')
+			path += "~1";
+		else
+			path += *it;
+	}
+}
+
+std::vector< std::string > PropDiff::ParsePointer(std::string const& path) {
+	std::vector< std::string > steps;
+	if (path.length() <= 0)
+		return steps;
+	if (path[0] != '/')
+		throw fmt("Invalid patch path: %s", path.c_str());
+	for (std::string::const_iterator it = path.begin(); it != path.end(); ++it) {
+		if (*it == '/') {
+			steps.push_back(std::string());
+			continue;
+		}
+		if (*it == '~') {
+			++it;
+			if (it == path.end() || (*it != '0' && *it != '1'))
+				throw fmt("Invalid patch path: %s", path.c_str());
+			steps.back() += (*it == '0' ? '~' : '/');
+		} else
+			steps.back() += *it;
+	}
+	return steps;
+}
@@ -0,0 +1,51 @@
+/* File: propdiff.hpp
+ *
+ * Structural differences between two PropTrees, and the patches that carry
+ * them. A patch is itself a PropTree, an array of operations in the manner
+ * of JSON Patch (RFC 6902), so it can go straight to the boss with
+ * SendPropTree():
+ *
+ *   [ { "op": "add", "path": "/ge-0~10~12", "value": { ... } },
+ *     { "op": "remove", "path": "/ge-0~10~13" },
+ *     { "op": "replace", "path": "/ge-0~10~14/speed", "value": 1000 } ]
+ *
+ * Paths are JSON Pointers (RFC 6901): each key is preceded by '/', with '~'
+ * written as "~0" and '/' as "~1"; array elements are addressed by index.
+ */
+#ifndef SWITCHTOOL_PROPDIFF_HPP_INC
+#define SWITCHTOOL_PROPDIFF_HPP_INC
+
+#include <string>
+#include <vector>
+#include "proptree.hpp"
+
+class PropDiff {
+public:
+	/* Returns the patch that turns from into to: a remove for every key only
+	 * in from, an add for every key only in to, and a replace for every
+	 * value that changed. Arrays whose length changed are replaced whole.
+	 *
+	 * Subtrees that from and to still share copy-on-write are skipped without
+	 * being looked at, so diffing a tree against a modified copy of itself
+	 * costs time in proportion to what was modified.
+	 */
+	static PropTree Diff(PropTree const& from, PropTree const& to);
+
+	/* Applies a patch made by Diff() (or any patch using add, remove and
+	 * replace). Throws a std::string if an operation doesn't fit the tree.
+	 */
+	static void Patch(PropTree& tree, PropTree const& patch);
+
+	// Deep comparison of keys, values and scalar types.
+	static bool Equal(PropTree const& x, PropTree const& y);
+
+	static void AppendPointerStep(std::string& path, std::string const& key);
+	// Splits a JSON Pointer into unescaped keys. Throws if it's malformed.
+	static std::vector< std::string > ParsePointer(std::string const& path);
+
+private:
+	static void DiffRecursive(PropTree const& from, PropTree const& to,
+	std::string& path, PropTree& patch);
+};
+
+#endif // SWITCHTOOL_PROPDIFF_HPP_INC
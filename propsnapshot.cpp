@@ -0,0 +1,508 @@
+/* File: propsnapshot.cpp
+ */
+
+extern "C" {
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+}
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "common.hpp"
+#include "propsnapshot.hpp"
+
+
+static const unsigned int PROPSNAPSHOT_MAGIC = 0x31535450; // "PTS1"
+static const unsigned int PROPSNAPSHOT_ARRAY = 0x100;
+static const unsigned int PROPSNAPSHOT_TYPE_MASK = 0xff;
+static const size_t HEADER_MAGIC = 0;
+static const size_t HEADER_LENGTH = 4;
+static const size_t HEADER_KEY_COUNT = 8;
+static const size_t HEADER_KEYS = 12;
+static const size_t HEADER_ROOT = 16;
+static const size_t HEADER_SIZE = 20;
+
+
+/* Encoder */
+
+struct KeyStringLess {
+	bool operator () (PropTreeKey a, PropTreeKey b) const {
+		return (*a < *b);
+	}
+};
+
+struct SnapshotEncoder {
+	std::string out;
+	std::map< PropTreeKey, unsigned int > key_ids;
+	std::map< PropTreeNode const*, unsigned int > written;
+
+	void Word(unsigned int w) {
+		this->out.append(reinterpret_cast< const char* >(&w), 4);
+	}
+	void Pad() {
+		while (this->out.length() % 4)
+			this->out += '\0';
+	}
+	void PatchWord(size_t offset, unsigned int w) {
+		memcpy(&(this->out[offset]), &w, 4);
+	}
+
+	void CollectKeys(PropTreeNode const& node,
+	std::map< PropTreeNode const*, bool >& seen) {
+		if (seen.find(&node) != seen.end())
+			return;
+		seen[&node] = true;
+		for (PropTreeChildrenArray::const_iterator it = node.children.begin();
+		it != node.children.end();
+		++it) {
+			this->key_ids[it->key] = 0;
+			this->CollectKeys(PropSnapshot::NodeOf(it->tree), seen);
+		}
+	}
+
+	// Writes the node's children first, then the node; returns its offset.
+	unsigned int WriteNode(PropTreeNode const& node) {
+		std::map< PropTreeNode const*, unsigned int >::const_iterator fd
+		= this->written.find(&node);
+		if (fd != this->written.end())
+			return fd->second;
+		std::vector< unsigned int > child_offsets;
+		child_offsets.reserve(node.children.size());
+		for (PropTreeChildrenArray::const_iterator it = node.children.begin();
+		it != node.children.end();
+		++it)
+			child_offsets.push_back(
+				this->WriteNode(PropSnapshot::NodeOf(it->tree))
+			);
+
+		unsigned int offset = this->out.length();
+		this->Word(node.type | (node.array ? PROPSNAPSHOT_ARRAY : 0));
+		this->Word(node.children.size());
+		switch (node.type) {
+			case PROPTREE_STRING:
+				this->Word(node.data.length());
+				this->out += node.data;
+				this->Pad();
+				break;
+			case PROPTREE_INTEGER:
+				this->out.append(reinterpret_cast< const char* >(&node.scalar.i), 8);
+				break;
+			case PROPTREE_DOUBLE:
+				this->out.append(reinterpret_cast< const char* >(&node.scalar.d), 8);
+				break;
+			case PROPTREE_BOOL:
+				this->Word(node.scalar.b ? 1 : 0);
+				break;
+			default:
+				break;
+		}
+		std::vector< std::pair< unsigned int, unsigned int > > sorted;
+		for (size_t i = 0; i < node.children.size(); ++i) {
+			unsigned int id = this->key_ids[node.children[i].key];
+			this->Word(id);
+			this->Word(child_offsets[i]);
+			sorted.push_back(std::make_pair(id, i));
+		}
+		if (!node.array && node.children.size() > PROPTREE_LINEAR_SCAN_MAX) {
+			std::sort(sorted.begin(), sorted.end());
+			for (size_t i = 0; i < sorted.size(); ++i)
+				this->Word(sorted[i].second);
+		}
+		this->written[&node] = offset;
+		return offset;
+	}
+};
+
+std::string PropSnapshot::Encode(PropTree const& tree) {
+	SnapshotEncoder enc;
+	std::map< PropTreeNode const*, bool > seen;
+	enc.CollectKeys(PropSnapshot::NodeOf(tree), seen);
+
+	std::vector< PropTreeKey > keys;
+	for (std::map< PropTreeKey, unsigned int >::const_iterator it
+	= enc.key_ids.begin();
+	it != enc.key_ids.end();
+	++it)
+		keys.push_back(it->first);
+	std::sort(keys.begin(), keys.end(), KeyStringLess());
+	for (size_t i = 0; i < keys.size(); ++i)
+		enc.key_ids[keys[i]] = i;
+
+	enc.out.assign(HEADER_SIZE, '\0');
+	std::vector< unsigned int > key_offsets;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		key_offsets.push_back(enc.out.length());
+		enc.out += *(keys[i]);
+	}
+	enc.Pad();
+	unsigned int key_table = enc.out.length();
+	for (size_t i = 0; i < keys.size(); ++i) {
+		enc.Word(key_offsets[i]);
+		enc.Word(keys[i]->length());
+	}
+	unsigned int root = enc.WriteNode(PropSnapshot::NodeOf(tree));
+
+	enc.PatchWord(HEADER_MAGIC, PROPSNAPSHOT_MAGIC);
+	enc.PatchWord(HEADER_LENGTH, enc.out.length());
+	enc.PatchWord(HEADER_KEY_COUNT, keys.size());
+	enc.PatchWord(HEADER_KEYS, key_table);
+	enc.PatchWord(HEADER_ROOT, root);
+	return enc.out;
+}
+
+void PropSnapshot::Write(std::string const& filename, PropTree const& tree) {
+	std::string encoded = PropSnapshot::Encode(tree);
+	std::string tmpname = filename + ".tmp";
+	FILE* f = fopen(tmpname.c_str(), "wb");
+	if (!f)
+		throw fmt("Unable to write snapshot '%s'", tmpname.c_str());
+	bool ok = (fwrite(encoded.data(), 1, encoded.length(), f)
+	== encoded.length());
+	if (fclose(f) != 0)
+		ok = false;
+#ifdef WIN32
+	if (ok)
+		remove(filename.c_str());
+#endif
+	if (!ok || rename(tmpname.c_str(), filename.c_str()) != 0) {
+		remove(tmpname.c_str());
+		throw fmt("Unable to write snapshot '%s'", filename.c_str());
+	}
+}
+
+
+/* Reader */
+
+PropSnapshot::PropSnapshot(std::string const& filename)
+	: m_data(0),
+	m_size(0),
+	m_mapped(false),
+	m_key_count(0),
+	m_keys(0),
+	m_root(0)
+{
+#ifdef WIN32
+	// No mmap; read it in whole.
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (!f)
+		throw fmt("Unable to open snapshot '%s'", filename.c_str());
+	std::string buf;
+	char chunk[4096];
+	size_t got;
+	while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		buf.append(chunk, got);
+	fclose(f);
+	char* data = new char[buf.length() + 1];
+	memcpy(data, buf.data(), buf.length());
+	m_data = data;
+	m_size = buf.length();
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw fmt("Unable to open snapshot '%s'", filename.c_str());
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)HEADER_SIZE) {
+		close(fd);
+		throw fmt("Not a snapshot: '%s'", filename.c_str());
+	}
+	void* map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw fmt("Unable to map snapshot '%s'", filename.c_str());
+	m_data = static_cast< const char* >(map);
+	m_size = st.st_size;
+	m_mapped = true;
+#endif
+	if (m_size < HEADER_SIZE
+	|| Word(HEADER_MAGIC) != PROPSNAPSHOT_MAGIC
+	|| Word(HEADER_LENGTH) != m_size) {
+		Unmap();
+		throw fmt("Not a snapshot: '%s'", filename.c_str());
+	}
+	m_key_count = Word(HEADER_KEY_COUNT);
+	m_keys = Word(HEADER_KEYS);
+	m_root = Word(HEADER_ROOT);
+}
+
+PropSnapshot::~PropSnapshot() {
+	Unmap();
+}
+
+void PropSnapshot::Unmap() {
+	if (!m_data)
+		return;
+#ifdef WIN32
+	delete[] m_data;
+#else
+	if (m_mapped)
+		munmap(const_cast< char* >(m_data), m_size);
+#endif
+	m_data = 0;
+}
+
+unsigned int PropSnapshot::Word(size_t offset) const {
+	unsigned int w;
+	this->Bytes(offset, &w, 4);
+	return w;
+}
+
+void PropSnapshot::Bytes(size_t offset, void* out, size_t len) const {
+	if (offset > this->m_size || len > this->m_size - offset)
+		throw std::string("Corrupt snapshot: read past end");
+	memcpy(out, this->m_data + offset, len);
+}
+
+std::string PropSnapshot::String(size_t offset, size_t len) const {
+	if (offset > this->m_size || len > this->m_size - offset)
+		throw std::string("Corrupt snapshot: read past end");
+	return std::string(this->m_data + offset, len);
+}
+
+std::string PropSnapshot::Key(unsigned int id) const {
+	if (id >= this->m_key_count)
+		throw std::string("Corrupt snapshot: bad key id");
+	size_t entry = this->m_keys + id * 8;
+	return this->String(this->Word(entry), this->Word(entry + 4));
+}
+
+long PropSnapshot::FindKey(std::string const& key) const {
+	// The key table is sorted, so compare in place rather than copying out.
+	size_t lo = 0;
+	size_t hi = this->m_key_count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		size_t entry = this->m_keys + mid * 8;
+		size_t koff = this->Word(entry);
+		size_t klen = this->Word(entry + 4);
+		if (koff > this->m_size || klen > this->m_size - koff)
+			throw std::string("Corrupt snapshot: read past end");
+		int cmp = memcmp(this->m_data + koff, key.data(),
+		std::min(klen, key.length()));
+		if (cmp == 0)
+			cmp = (klen < key.length() ? -1 : (klen > key.length() ? 1 : 0));
+		if (cmp == 0)
+			return mid;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+
+/* Node views */
+
+size_t PropSnapshotNode::ChildrenOffset() const {
+	size_t payload = this->m_offset + 8;
+	switch (this->GetType()) {
+		case PROPTREE_STRING:
+			return payload + 4 + ((this->m_snap->Word(payload) + 3) & ~3U);
+		case PROPTREE_INTEGER:
+		case PROPTREE_DOUBLE:
+			return payload + 8;
+		case PROPTREE_BOOL:
+			return payload + 4;
+		default:
+			return payload;
+	}
+}
+
+PropTreeType PropSnapshotNode::GetType() const {
+	if (!this->m_snap)
+		return PROPTREE_STRING;
+	return static_cast< PropTreeType >(
+		this->m_snap->Word(this->m_offset) & PROPSNAPSHOT_TYPE_MASK
+	);
+}
+
+bool PropSnapshotNode::IsArray() const {
+	if (!this->m_snap)
+		return false;
+	return ((this->m_snap->Word(this->m_offset) & PROPSNAPSHOT_ARRAY) != 0);
+}
+
+size_t PropSnapshotNode::Size() const {
+	if (!this->m_snap)
+		return 0;
+	return this->m_snap->Word(this->m_offset + 4);
+}
+
+PropSnapshotNode PropSnapshotNode::at(size_t idx) const {
+	if (idx >= this->Size())
+		return PropSnapshotNode();
+	size_t offset = this->m_snap->Word(this->ChildrenOffset() + idx * 8 + 4);
+	/* Children are always written before their parent, so one that isn't
+	 * could only lead back up the tree, and ToPropTree() round forever.
+	 */
+	if (offset >= this->m_offset)
+		throw std::string("Corrupt snapshot: child after its parent");
+	return PropSnapshotNode(this->m_snap, offset);
+}
+
+std::string PropSnapshotNode::GetKey(size_t idx) const {
+	if (idx >= this->Size())
+		return std::string();
+	return this->m_snap->Key(
+		this->m_snap->Word(this->ChildrenOffset() + idx * 8)
+	);
+}
+
+PropSnapshotNode PropSnapshotNode::at(std::string const& key) const {
+	size_t count = this->Size();
+	if (count == 0 || this->IsArray())
+		return PropSnapshotNode();
+	long id = this->m_snap->FindKey(key);
+	if (id < 0)
+		return PropSnapshotNode();
+	size_t children = this->ChildrenOffset();
+	if (count <= PROPTREE_LINEAR_SCAN_MAX) {
+		for (size_t i = 0; i < count; ++i) {
+			if (this->m_snap->Word(children + i * 8) == (unsigned int)id)
+				return this->at(i);
+		}
+		return PropSnapshotNode();
+	}
+	size_t sorted = children + count * 8;
+	size_t lo = 0;
+	size_t hi = count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		unsigned int pos = this->m_snap->Word(sorted + mid * 4);
+		unsigned int mid_id = this->m_snap->Word(children + pos * 8);
+		if (mid_id == (unsigned int)id)
+			return this->at(pos);
+		if (mid_id < (unsigned int)id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return PropSnapshotNode();
+}
+
+std::string PropSnapshotNode::GetData() const {
+	if (!this->m_snap)
+		return std::string();
+	if (this->GetType() == PROPTREE_STRING) {
+		size_t payload = this->m_offset + 8;
+		return this->m_snap->String(payload + 4, this->m_snap->Word(payload));
+	}
+	PropTree tmp;
+	switch (this->GetType()) {
+		case PROPTREE_INTEGER:
+			tmp.SetInt(this->GetInt());
+			break;
+		case PROPTREE_DOUBLE:
+			tmp.SetDouble(this->GetDouble());
+			break;
+		case PROPTREE_BOOL:
+			tmp.SetBool(this->GetBool());
+			break;
+		default:
+			tmp.SetNull();
+			break;
+	}
+	return tmp.GetData();
+}
+
+long long PropSnapshotNode::GetInt() const {
+	switch (this->GetType()) {
+		case PROPTREE_INTEGER:
+			{
+				long long val;
+				this->m_snap->Bytes(this->m_offset + 8, &val, 8);
+				return val;
+			}
+		case PROPTREE_DOUBLE:
+			return static_cast< long long >(this->GetDouble());
+		case PROPTREE_BOOL:
+			return (this->GetBool() ? 1 : 0);
+		case PROPTREE_NULL:
+			return 0;
+		default:
+			return PropTree(this->GetData()).GetInt();
+	}
+}
+
+double PropSnapshotNode::GetDouble() const {
+	switch (this->GetType()) {
+		case PROPTREE_DOUBLE:
+			{
+				double val;
+				this->m_snap->Bytes(this->m_offset + 8, &val, 8);
+				return val;
+			}
+		case PROPTREE_INTEGER:
+			return static_cast< double >(this->GetInt());
+		case PROPTREE_BOOL:
+			return (this->GetBool() ? 1.0 : 0.0);
+		case PROPTREE_NULL:
+			return 0.0;
+		default:
+			return PropTree(this->GetData()).GetDouble();
+	}
+}
+
+bool PropSnapshotNode::GetBool() const {
+	switch (this->GetType()) {
+		case PROPTREE_BOOL:
+			return (this->m_snap->Word(this->m_offset + 8) != 0);
+		case PROPTREE_INTEGER:
+			return (this->GetInt() != 0);
+		case PROPTREE_DOUBLE:
+			return (this->GetDouble() != 0.0);
+		case PROPTREE_NULL:
+			return false;
+		default:
+			return PropTree(this->GetData()).GetBool();
+	}
+}
+
+PropTree PropSnapshotNode::ToPropTree() const {
+	PropTree ret;
+	if (!this->m_snap)
+		return ret;
+	switch (this->GetType()) {
+		case PROPTREE_INTEGER:
+			ret.SetInt(this->GetInt());
+			break;
+		case PROPTREE_DOUBLE:
+			ret.SetDouble(this->GetDouble());
+			break;
+		case PROPTREE_BOOL:
+			ret.SetBool(this->GetBool());
+			break;
+		case PROPTREE_NULL:
+			ret.SetNull();
+			break;
+		default:
+			if (this->GetData().length() > 0)
+				ret.SetData(this->GetData());
+			break;
+	}
+	size_t count = this->Size();
+	if (this->IsArray()) {
+		ret.SetArray();
+		for (size_t i = 0; i < count; ++i)
+			ret.ArrayPushBack(this->at(i).ToPropTree());
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			std::string key = this->GetKey(i);
+			if (key.length() > 0)
+				ret[key] = this->at(i).ToPropTree();
+			else
+				ret.ArrayPushBack(this->at(i).ToPropTree());
+		}
+	}
+	return ret;
+}
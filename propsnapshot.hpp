@@ -0,0 +1,145 @@
+/* File: propsnapshot.hpp
+ *
+ * A compact binary encoding of a PropTree, meant for keeping inventories on
+ * disk between runs. A snapshot file is memory-mapped and read in place:
+ * opening one costs a stat and an mmap no matter how big it is, and only the
+ * nodes actually visited are ever touched.
+ *
+ * Layout (all integers are 32-bit, in the byte order of the machine that
+ * wrote the file, and every record starts on a 4-byte boundary):
+ *
+ *   header:   magic, total length, key count, key table offset, root offset
+ *   keys:     key count x { string offset, length }, sorted by string; a
+ *             key's id is its position in this table
+ *   nodes:    type (| PROPSNAPSHOT_ARRAY), child count, then the scalar:
+ *               string: length, bytes, padding
+ *               integer/double: 8 bytes
+ *               bool: 1 word
+ *             then child count x { key id, node offset } in the tree's order,
+ *             then, for keyed nodes with more than PROPTREE_LINEAR_SCAN_MAX
+ *             children, an offset table of child positions sorted by key id
+ *             for binary search.
+ *
+ * Subtrees shared copy-on-write between several trees are written once.
+ */
+#ifndef SWITCHTOOL_PROPSNAPSHOT_HPP_INC
+#define SWITCHTOOL_PROPSNAPSHOT_HPP_INC
+
+#include <string>
+#include "proptree.hpp"
+
+class PropSnapshot;
+struct SnapshotEncoder;
+
+/* A read-only view of one node inside a PropSnapshot. Views are small values
+ * and remain valid for as long as the snapshot they came from. Looking up a
+ * missing child gives a view for which Exists() is false and which reads as
+ * an empty string, just like the const PropTree::at().
+ */
+class PropSnapshotNode {
+public:
+	PropSnapshotNode()
+	 : m_snap(0),
+	 m_offset(0)
+	{}
+
+	bool Exists() const {
+		return (this->m_snap != 0);
+	}
+
+	template< class T >
+	PropSnapshotNode operator [] (T const& key) const {
+		return this->at(key);
+	}
+	PropSnapshotNode at(size_t idx) const;
+	PropSnapshotNode at(std::string const& key) const;
+	bool ChildExists(std::string const& key) const {
+		return this->at(key).Exists();
+	}
+	// Returns the key of the idx-th child (empty for array elements).
+	std::string GetKey(size_t idx) const;
+
+	bool HasChildren() const {
+		return (this->Size() > 0);
+	}
+	bool IsArray() const;
+	size_t Size() const;
+
+	PropTreeType GetType() const;
+	std::string GetData() const;
+	long long GetInt() const;
+	double GetDouble() const;
+	bool GetBool() const;
+
+	// Deserializes this node and everything below it.
+	PropTree ToPropTree() const;
+
+private:
+	friend class PropSnapshot;
+
+	PropSnapshotNode(PropSnapshot const* snap, size_t offset)
+	 : m_snap(snap),
+	 m_offset(offset)
+	{}
+
+	size_t ChildrenOffset() const;
+
+	PropSnapshot const* m_snap;
+	size_t m_offset;
+};
+
+class PropSnapshot {
+public:
+	// Encodes a tree into the snapshot format.
+	static std::string Encode(PropTree const& tree);
+	/* Writes a snapshot file, via a temporary file and a rename so that a
+	 * reader never sees a partial one.
+	 */
+	static void Write(std::string const& filename, PropTree const& tree);
+
+	/* Maps a snapshot file. Throws a std::string if the file can't be read
+	 * or isn't a snapshot.
+	 */
+	PropSnapshot(std::string const& filename);
+	~PropSnapshot();
+
+	PropSnapshotNode Root() const {
+		return PropSnapshotNode(this, this->m_root);
+	}
+	PropTree Load() const {
+		return this->Root().ToPropTree();
+	}
+
+private:
+	friend class PropSnapshotNode;
+	friend struct SnapshotEncoder;
+
+	static PropTreeNode const& NodeOf(PropTree const& tree) {
+		return tree.Node();
+	}
+
+	// Not copyable; the mapping belongs to exactly one object.
+	PropSnapshot(PropSnapshot const&);
+	PropSnapshot& operator = (PropSnapshot const&);
+
+	void Unmap();
+
+	/* Bounds-checked reads; a truncated or corrupt file throws rather than
+	 * reading past the mapping.
+	 */
+	unsigned int Word(size_t offset) const;
+	void Bytes(size_t offset, void* out, size_t len) const;
+	std::string String(size_t offset, size_t len) const;
+	// Returns the id of key, or -1 if no node in the snapshot uses it.
+	long FindKey(std::string const& key) const;
+	std::string Key(unsigned int id) const;
+
+	const char* m_data;
+	size_t m_size;
+	bool m_mapped;
+	unsigned int m_key_count;
+	size_t m_keys;
+	size_t m_root;
+};
+
+#endif // SWITCHTOOL_PROPSNAPSHOT_HPP_INC
@@ -7,13 +7,438 @@
 #include "proptree.hpp"
 
 #include <stack>
-#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
 #include "common.hpp"
 #include "yajl/yajl_parse.h"
 
 
+/* The intern table is itself an open-addressing hash of pointers to the
+ * keys, each a separate allocation so that sweeping can free it.
+ */
+struct PropTreeKeyTable {
+	std::vector< PropTreeKey > slots;
+	size_t count;
+
+	PropTreeKeyTable()
+	 : count(0)
+	{}
+
+	void Rebuild(size_t size);
+	void Sweep();
+};
+
+// Unused keys are only swept once there are more than this many.
+static const size_t KEY_SWEEP_MIN = 1024;
+
+size_t PropTreeKeys::s_unused = 0;
+
+static PropTreeKeyTable& KeyTable() {
+	/* Never destroyed, as static trees still release their keys as the
+	 * process exits.
+	 */
+	static PropTreeKeyTable* table = new PropTreeKeyTable;
+	return *table;
+}
+
+static size_t HashKeyString(std::string const& key) {
+	// FNV-1a
+	size_t h = 2166136261U;
+	for (std::string::const_iterator it = key.begin(); it != key.end(); ++it) {
+		h ^= static_cast< unsigned char >(*it);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void KeyTableInsert(PropTreeKeyTable& table, PropTreeKey key) {
+	size_t mask = table.slots.size() - 1;
+	size_t h = HashKeyString(*key) & mask;
+	while (table.slots[h])
+		h = (h + 1) & mask;
+	table.slots[h] = key;
+}
+
+void PropTreeKeyTable::Rebuild(size_t size) {
+	std::vector< PropTreeKey > old(size, 0);
+	old.swap(this->slots);
+	for (size_t i = 0; i < old.size(); ++i) {
+		if (old[i])
+			KeyTableInsert(*this, old[i]);
+	}
+}
+
+void PropTreeKeyTable::Sweep() {
+	size_t live = 0;
+	for (size_t i = 0; i < this->slots.size(); ++i) {
+		if (!this->slots[i])
+			continue;
+		if (this->slots[i]->refs == 0) {
+			delete this->slots[i];
+			this->slots[i] = 0;
+		} else
+			++live;
+	}
+	this->count = live;
+	PropTreeKeys::s_unused = 0;
+	size_t size = 64;
+	while ((live + 1) * 2 > size)
+		size *= 2;
+	this->Rebuild(size);
+}
+
+PropTreeKey PropTreeKeys::Intern(std::string const& key) {
+	PropTreeKey fd = PropTreeKeys::Find(key);
+	if (fd)
+		return fd;
+	PropTreeKeyTable& table = KeyTable();
+	if (s_unused > KEY_SWEEP_MIN && s_unused * 2 > table.count)
+		table.Sweep();
+	PropTreeKey ikey = new PropTreeKeyString(key);
+	++(table.count);
+	++s_unused;
+	if (table.count * 2 > table.slots.size())
+		table.Rebuild(table.slots.empty() ? 64 : table.slots.size() * 2);
+	KeyTableInsert(table, ikey);
+	return ikey;
+}
+
+PropTreeKey PropTreeKeys::Find(std::string const& key) {
+	PropTreeKeyTable const& table = KeyTable();
+	if (table.slots.empty())
+		return 0;
+	size_t mask = table.slots.size() - 1;
+	for (size_t h = HashKeyString(key) & mask; table.slots[h]; h = (h + 1) & mask) {
+		if (*(table.slots[h]) == key)
+			return table.slots[h];
+	}
+	return 0;
+}
+
+static PropTreeKey InternForever(std::string const& key) {
+	PropTreeKey ikey = PropTreeKeys::Intern(key);
+	PropTreeKeys::Retain(ikey);
+	return ikey;
+}
+
+PropTreeKey PropTreeKeys::Empty() {
+	static PropTreeKey empty = InternForever(std::string());
+	return empty;
+}
+
+
+/* Free PropTreeNode slots are chained through their own storage. Arenas are
+ * never handed back to the system; a process that once held a large
+ * inventory simply keeps the slots around for the next one.
+ */
+union PropTreeNodeSlot {
+	PropTreeNodeSlot* next;
+	char storage[sizeof(PropTreeNode)];
+	double align_d;
+	void* align_p;
+};
+static const size_t NODES_PER_ARENA = 512;
+static PropTreeNodeSlot* s_free_slots = 0;
+
+void* PropTreeNode::operator new(size_t size) {
+	if (size != sizeof(PropTreeNode))
+		return ::operator new(size);
+	if (!s_free_slots) {
+		PropTreeNodeSlot* arena = static_cast< PropTreeNodeSlot* >(
+			::operator new(sizeof(PropTreeNodeSlot) * NODES_PER_ARENA)
+		);
+		for (size_t i = 0; i < NODES_PER_ARENA - 1; ++i)
+			arena[i].next = &(arena[i + 1]);
+		arena[NODES_PER_ARENA - 1].next = 0;
+		s_free_slots = arena;
+	}
+	PropTreeNodeSlot* slot = s_free_slots;
+	s_free_slots = slot->next;
+	return slot;
+}
+
+void PropTreeNode::operator delete(void* p, size_t size) {
+	if (!p)
+		return;
+	if (size != sizeof(PropTreeNode)) {
+		::operator delete(p);
+		return;
+	}
+	PropTreeNodeSlot* slot = static_cast< PropTreeNodeSlot* >(p);
+	slot->next = s_free_slots;
+	s_free_slots = slot;
+}
+
+/* Fibonacci hashing: multiplies by 2^64 divided by the golden ratio and
+ * keeps the top bits of the product, which depend on every bit of the
+ * pointer. shift is 64 - log2 of the index size.
+ */
+static size_t HashKeyPointer(PropTreeKey key, unsigned int shift) {
+	unsigned long long x = reinterpret_cast< size_t >(key);
+	return static_cast< size_t >((x * 11400714819323198485ULL) >> shift);
+}
+
+size_t PropTreeNode::Find(PropTreeKey key) const {
+	if (!key)
+		return this->children.size();
+	if (this->index.empty()) {
+		for (size_t i = 0; i < this->children.size(); ++i) {
+			if (this->children[i].key == key)
+				return i;
+		}
+		return this->children.size();
+	}
+	size_t mask = this->index.size() - 1;
+	for (size_t h = HashKeyPointer(key, this->index_shift); this->index[h]; h = (h + 1) & mask) {
+		if (this->children[this->index[h] - 1].key == key)
+			return this->index[h] - 1;
+	}
+	return this->children.size();
+}
+
+PropTree& PropTreeNode::Append(PropTreeKey key, PropTree const& tree) {
+	this->children.push_back(PropTreeChild(key, tree));
+	++(this->keyed);
+	this->array = false;
+	if (!this->index.empty()) {
+		if (this->keyed * 2 > this->index.size())
+			this->Reindex(this->index.size() * 2);
+		else
+			this->IndexInsert(this->children.size() - 1);
+	} else if (this->keyed > PROPTREE_LINEAR_SCAN_MAX)
+		this->Reindex(PROPTREE_LINEAR_SCAN_MAX * 4);
+	return this->children.back().tree;
+}
+
+PropTree& PropTreeNode::Insert(size_t offset, PropTreeKey key,
+PropTree const& tree) {
+	this->children.insert(this->children.begin() + offset,
+	PropTreeChild(key, tree));
+	if (key != PropTreeKeys::Empty()) {
+		++(this->keyed);
+		this->array = false;
+	}
+	if (!this->index.empty())
+		this->Reindex(this->keyed * 2 > this->index.size()
+		? this->index.size() * 2 : this->index.size());
+	else if (this->keyed > PROPTREE_LINEAR_SCAN_MAX)
+		this->Reindex(PROPTREE_LINEAR_SCAN_MAX * 4);
+	return this->children[offset].tree;
+}
+
+void PropTreeNode::Erase(size_t offset) {
+	if (this->children[offset].key != PropTreeKeys::Empty())
+		--(this->keyed);
+	this->children.erase(this->children.begin() + offset);
+	if (this->keyed <= PROPTREE_LINEAR_SCAN_MAX)
+		this->index.clear();
+	else if (!this->index.empty())
+		this->Reindex(this->index.size());
+}
+
+std::string PropTreeNode::FormatScalar() const {
+	char buf[32];
+	switch (this->type) {
+		case PROPTREE_INTEGER:
+			snprintf(buf, sizeof(buf), "%lld", this->scalar.i);
+			return buf;
+		case PROPTREE_DOUBLE:
+			// The shortest of these that reads back as the same double.
+			for (int prec = 15; prec <= 17; ++prec) {
+				snprintf(buf, sizeof(buf), "%.*g", prec, this->scalar.d);
+				if (strtod(buf, 0) == this->scalar.d)
+					break;
+			}
+			return buf;
+		case PROPTREE_BOOL:
+			return (this->scalar.b ? "1" : "0");
+		case PROPTREE_NULL:
+			return std::string();
+		default:
+			return this->data;
+	}
+}
+
+long long PropTree::GetInt() const {
+	PropTreeNode const& node = this->Node();
+	switch (node.type) {
+		case PROPTREE_INTEGER:
+			return node.scalar.i;
+		case PROPTREE_DOUBLE:
+			return static_cast< long long >(node.scalar.d);
+		case PROPTREE_BOOL:
+			return (node.scalar.b ? 1 : 0);
+		case PROPTREE_NULL:
+			return 0;
+		default:
+			return strtoll(node.data.c_str(), 0, 10);
+	}
+}
+
+double PropTree::GetDouble() const {
+	PropTreeNode const& node = this->Node();
+	switch (node.type) {
+		case PROPTREE_INTEGER:
+			return static_cast< double >(node.scalar.i);
+		case PROPTREE_DOUBLE:
+			return node.scalar.d;
+		case PROPTREE_BOOL:
+			return (node.scalar.b ? 1.0 : 0.0);
+		case PROPTREE_NULL:
+			return 0.0;
+		default:
+			return strtod(node.data.c_str(), 0);
+	}
+}
+
+bool PropTree::GetBool() const {
+	PropTreeNode const& node = this->Node();
+	switch (node.type) {
+		case PROPTREE_INTEGER:
+			return (node.scalar.i != 0);
+		case PROPTREE_DOUBLE:
+			return (node.scalar.d != 0.0);
+		case PROPTREE_BOOL:
+			return node.scalar.b;
+		case PROPTREE_NULL:
+			return false;
+		default:
+			return (node.data.length() > 0 && node.data != "0"
+			&& node.data != "false");
+	}
+}
+
+void PropTreeNode::Reindex(size_t slots) {
+	this->index.assign(slots, 0);
+	this->index_shift = 64;
+	for (size_t n = slots; n > 1; n >>= 1)
+		--this->index_shift;
+	for (size_t i = 0; i < this->children.size(); ++i) {
+		if (this->children[i].key != PropTreeKeys::Empty())
+			this->IndexInsert(i);
+	}
+}
+
+void PropTreeNode::IndexInsert(size_t offset) {
+	size_t mask = this->index.size() - 1;
+	size_t h = HashKeyPointer(this->children[offset].key, this->index_shift);
+	while (this->index[h])
+		h = (h + 1) & mask;
+	this->index[h] = offset + 1;
+}
+
+
+PropPath::PropPath(std::string const& path) {
+	std::string key;
+	bool escaped = false;
+	bool literal = false;
+	for (std::string::const_iterator it = path.begin(); ; ++it) {
+		if (it == path.end() || (!escaped && *it == '.')) {
+			if (key == "*" && !literal)
+				this->m_steps.push_back(0);
+			else {
+				this->m_steps.push_back(PropTreeKeys::Intern(key));
+				PropTreeKeys::Retain(this->m_steps.back());
+			}
+			key.clear();
+			literal = false;
+			if (it == path.end())
+				break;
+			continue;
+		}
+		if (!escaped && *it == '\\') {
+			escaped = true;
+			literal = true;
+			continue;
+		}
+		escaped = false;
+		key += *it;
+	}
+}
+
+PropPath::PropPath(PropPath const& p)
+ : m_steps(p.m_steps)
+{
+	for (size_t i = 0; i < this->m_steps.size(); ++i) {
+		if (this->m_steps[i])
+			PropTreeKeys::Retain(this->m_steps[i]);
+	}
+}
+
+PropPath::~PropPath() {
+	for (size_t i = 0; i < this->m_steps.size(); ++i) {
+		if (this->m_steps[i])
+			PropTreeKeys::Release(this->m_steps[i]);
+	}
+}
+
+PropPath& PropPath::operator = (PropPath const& p) {
+	PropPath tmp(p);
+	this->m_steps.swap(tmp.m_steps);
+	return *this;
+}
+
+PropTree const* PropPath::Find(PropTree const& tree) const {
+	PropTree const* at = &tree;
+	for (std::vector< PropTreeKey >::const_iterator it = this->m_steps.begin();
+	it != this->m_steps.end();
+	++it) {
+		PropTreeNode const& node = at->Node();
+		size_t fd = (*it ? node.Find(*it) : 0);
+		if (fd >= node.children.size())
+			return 0;
+		at = &(node.children[fd].tree);
+	}
+	return at;
+}
+
+PropTree const& PropPath::Get(PropTree const& tree) const {
+	static PropTree empty;
+	PropTree const* fd = this->Find(tree);
+	return (fd ? *fd : empty);
+}
+
+size_t PropPath::Select(PropTree const& tree, PropPathVisitor& visitor) const {
+	std::vector< PropTreeKey > wildcard_keys;
+	wildcard_keys.reserve(this->m_steps.size());
+	return this->SelectRecursive(tree, 0, wildcard_keys, visitor);
+}
+
+size_t PropPath::SelectRecursive(PropTree const& tree, size_t step,
+std::vector< PropTreeKey >& wildcard_keys, PropPathVisitor& visitor) const {
+	if (step >= this->m_steps.size()) {
+		visitor.OnMatch(wildcard_keys, tree);
+		return 1;
+	}
+	PropTreeNode const& node = tree.Node();
+	if (this->m_steps[step]) {
+		size_t fd = node.Find(this->m_steps[step]);
+		if (fd >= node.children.size())
+			return 0;
+		return this->SelectRecursive(node.children[fd].tree, step + 1,
+		wildcard_keys, visitor);
+	}
+	size_t matches = 0;
+	for (PropTreeChildrenArray::const_iterator it = node.children.begin();
+	it != node.children.end();
+	++it) {
+		wildcard_keys.push_back(it->key);
+		matches += this->SelectRecursive(it->tree, step + 1, wildcard_keys,
+		visitor);
+		wildcard_keys.pop_back();
+	}
+	return matches;
+}
+
+
+/* Builds a PropTree from yajl callbacks. "where" holds the open containers,
+ * each flagged true if it is an array; "editing" is the slot a value lands
+ * in when the innermost container is a map (or at the top level). Array
+ * elements are appended as their values arrive, so arrays never carry keys.
+ */
 struct JsonPropTreeParser {
-	std::stack< std::pair< PropTree*, size_t > > where;
+	std::stack< std::pair< PropTree*, bool > > where;
 	PropTree* editing;
 
 	JsonPropTreeParser(PropTree& populate)
@@ -22,32 +447,53 @@ struct JsonPropTreeParser {
 
 	static int OnNull(void* vme) {
 		JsonPropTreeParser* me = static_cast< JsonPropTreeParser* >(vme);
-		me->editing->SetData("");
-		me->MaybeIncrementArrayKey();
+		me->Target()->SetNull();
 		return 1;
 	}
 	static int OnBool(void* vme, int val) {
 		JsonPropTreeParser* me = static_cast< JsonPropTreeParser* >(vme);
-		me->editing->SetData(val ? "1" : "0");
-		me->MaybeIncrementArrayKey();
+		me->Target()->SetBool(val != 0);
 		return 1;
 	}
+	/* yajl hands us the number's text; integers that fit in a long long
+	 * stay exact, anything else (fractions, exponents, overflow) becomes a
+	 * double.
+	 */
 	static int OnNumber(void* vme, const char* val_start, size_t val_len) {
-		return JsonPropTreeParser::OnString(vme,
-		reinterpret_cast< const unsigned char* >(val_start), val_len);
+		JsonPropTreeParser* me = static_cast< JsonPropTreeParser* >(vme);
+		PropTree* target = me->Target();
+		char buf[64];
+		// Too long to be exact either way; keep the text rather than cut it.
+		if (val_len >= sizeof(buf)) {
+			target->SetData(std::string(val_start, val_len));
+			return 1;
+		}
+		memcpy(buf, val_start, val_len);
+		buf[val_len] = '\0';
+		bool is_int = (strpbrk(buf, ".eE") == 0);
+		if (is_int) {
+			errno = 0;
+			long long ival = strtoll(buf, 0, 10);
+			if (errno == ERANGE)
+				is_int = false;
+			else
+				target->SetInt(ival);
+		}
+		if (!is_int)
+			target->SetDouble(strtod(buf, 0));
+		return 1;
 	}
 	static int OnString(void* vme, const unsigned char* val_start,
 	size_t val_len) {
 		JsonPropTreeParser* me = static_cast< JsonPropTreeParser* >(vme);
-		me->editing->SetData(
+		me->Target()->SetData(
 			std::string(reinterpret_cast< const char* >(val_start), val_len)
 		);
-		me->MaybeIncrementArrayKey();
 		return 1;
 	}
 	static int OnMapStart(void* vme) {
 		JsonPropTreeParser* me = static_cast< JsonPropTreeParser* >(vme);
-		me->where.push(std::make_pair(me->editing, 0UL));
+		me->where.push(std::make_pair(me->Target(), false));
 		return 1;
 	}
 	static int OnMapKey(void* vme, const unsigned char* key_start,
@@ -60,32 +506,27 @@ struct JsonPropTreeParser {
 	}
 	static int OnMapEnd(void* vme) {
 		JsonPropTreeParser* me = static_cast< JsonPropTreeParser* >(vme);
-		me->editing = me->where.top().first;
 		me->where.pop();
-		me->MaybeIncrementArrayKey();
 		return 1;
 	}
 	static int OnArrayStart(void* vme) {
 		JsonPropTreeParser* me = static_cast< JsonPropTreeParser* >(vme);
-		me->where.push(std::make_pair(me->editing, 1UL));
-		me->editing = &((*(me->editing))["0"]);
+		PropTree* target = me->Target();
+		target->SetArray();
+		me->where.push(std::make_pair(target, true));
 		return 1;
 	}
 	static int OnArrayEnd(void* vme) {
 		JsonPropTreeParser* me = static_cast< JsonPropTreeParser* >(vme);
-		me->editing = me->where.top().first;
 		me->where.pop();
-		me->MaybeIncrementArrayKey();
 		return 1;
 	}
 
-	void MaybeIncrementArrayKey() {
-		if (this->where.size() > 0 && this->where.top().second > 0) {
-			std::ostringstream oss;
-			oss << this->where.top().second;
-			this->editing = &((*(this->where.top().first))[oss.str()]);
-			++(this->where.top().second);
-		}
+	// Returns the tree the next value should be stored in.
+	PropTree* Target() {
+		if (this->where.size() > 0 && this->where.top().second)
+			return &(this->where.top().first->ArrayPushBack(PropTree()));
+		return this->editing;
 	}
 };
 
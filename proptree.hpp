@@ -5,8 +5,8 @@
  * Representing a fantastic case of me not finding quite what I needed in
  * another library at the time I wrote it, PropTree is a simple JSON-like
  * data structure for C++, or "property tree": a key-value hierarchy
- * where the keys are strings and the values are either strings or child
- * PropTree objects.
+ * where the keys are strings and the values are either scalars (strings,
+ * integers, doubles, booleans or null, as in JSON) or child PropTree objects.
  * 
  */
 #ifndef SWITCHTOOL_PROPTREE_HPP_INC
@@ -14,11 +14,21 @@
 
 #include <cstdio>
 #include <vector>
-#include <map>
 #include <string>
 
 class PropTree;
 
+/* The kind of scalar a PropTree holds. Trees default to an empty string,
+ * and GetData() renders any kind as a string for callers that don't care.
+ */
+enum PropTreeType {
+	PROPTREE_STRING = 0,
+	PROPTREE_INTEGER,
+	PROPTREE_DOUBLE,
+	PROPTREE_BOOL,
+	PROPTREE_NULL
+};
+
 /* This fun little "choose" idiom implements true/false as a template parameter in order
  * to easily define both const and non-const iterators for the PropTree in a single
  * template declaration.
@@ -37,17 +47,70 @@ struct choose< false, IsTrue, IsFalse > {
 	typedef IsFalse type;
 };
 
-/* For readability, typedef a vector that will hold all children of a PropTree
- * as key/value pairs.
+/* Child keys are interned: each distinct key string is stored exactly once,
+ * and children refer to it by pointer. The same handful of keys
+ * ("description", "speed", "members", ...) repeat across thousands of
+ * interface records, so this keeps one copy of each and makes key comparison
+ * a pointer comparison.
+ *
+ * Each interned key counts the children (and PropPath steps) using it. A key
+ * nothing uses any more stays interned, so that a tree rebuilt with the same
+ * keys (every poll of watch-ifaces, say) finds them still there; but once the
+ * unused keys outnumber the used ones, the next new key sweeps them away.
+ * A long-running process whose interfaces come and go therefore holds at
+ * most about twice the keys its live trees use.
  */
-typedef std::vector<
-	std::pair< std::string, PropTree >
-> PropTreeChildrenArray;
-/* For readability, typedef a map that will remember which offset in a vector
- * holds a given PropTree child, for a given key. See below; this is a O(n)
- * space tradeoff to gain O(log(n)) search time.
+struct PropTreeKeyString : public std::string {
+	explicit PropTreeKeyString(std::string const& key)
+	 : std::string(key),
+	 refs(0)
+	{}
+
+	mutable size_t refs;
+};
+typedef PropTreeKeyString const* PropTreeKey;
+
+struct PropTreeKeys {
+	/* Returns the interned copy of key, adding it if it's new. The caller
+	 * must Retain() it before interning any other key.
+	 */
+	static PropTreeKey Intern(std::string const& key);
+	/* Returns the interned copy of key, or 0 if it isn't interned. Only good
+	 * until the next Intern().
+	 */
+	static PropTreeKey Find(std::string const& key);
+	// The key given to array elements; never swept.
+	static PropTreeKey Empty();
+
+	static void Retain(PropTreeKey key) {
+		if (key->refs++ == 0)
+			--s_unused;
+	}
+	static void Release(PropTreeKey key) {
+		if (--key->refs == 0)
+			++s_unused;
+	}
+
+private:
+	friend struct PropTreeKeyTable;
+
+	// How many interned keys have no references.
+	static size_t s_unused;
+};
+
+/* One child slot of a PropTree: an interned key and the child itself. A
+ * node's children live contiguously in a single PropTreeChildrenArray.
+ */
+struct PropTreeChild;
+typedef std::vector< PropTreeChild > PropTreeChildrenArray;
+/* Most nodes have a handful of children (an interface record, an auth
+ * block), and for those a linear scan of the interned key pointers beats any
+ * index. Past PROPTREE_LINEAR_SCAN_MAX keyed children, a node builds an
+ * open-addressing hash table of child offsets (stored +1, so 0 marks an
+ * empty slot) so that nodes like a big "interfaces" map stay O(1) to search.
  */
-typedef std::map< std::string, size_t > PropTreeChildrenMap;
+typedef std::vector< unsigned int > PropTreeChildrenIndex;
+const size_t PROPTREE_LINEAR_SCAN_MAX = 8;
 
 /* This class allows iteration through the children of a PropTree object. */
 template< bool isconst = false >
@@ -85,10 +148,10 @@ public:
 	 * define dereference and increment operations.
 	 */
 	PropTreeRef operator * () const {
-		return m_array_iter->second;
+		return m_array_iter->tree;
 	}
 	PropTreePtr operator -> () const {
-		return &(m_array_iter->second);
+		return &(m_array_iter->tree);
 	}
 	PropTreeIterator& operator ++ () {
 		++m_array_iter;
@@ -104,7 +167,7 @@ public:
 	 * currently pointed to by the iterator.
 	 */
 	std::string const& GetKey() const {
-		return m_array_iter->first;
+		return *(m_array_iter->key);
 	}
 
 	/* Equality/inequality operators */
@@ -132,6 +195,18 @@ private:
 	ChildrenArrayIterType m_array_iter;
 };
 
+struct PropTreeNode;
+
+/* A PropTree is a small handle onto a reference-counted PropTreeNode. Copying
+ * a PropTree (including passing or returning one by value) only bumps the
+ * reference count, so whole trees can be handed around in O(1). The node is
+ * cloned, one level at a time, only when a shared tree is about to be
+ * modified ("copy-on-write").
+ *
+ * As with any copy-on-write container, a reference obtained from a
+ * non-const accessor (at(), operator [], Begin()) should not be held across
+ * a copy of the tree it came from; modify through it before sharing.
+ */
 class PropTree
 {
 public:
@@ -143,32 +218,45 @@ public:
 	static PropTree FromJson(std::string const& json_string);
 
 	// Constructors
-	PropTree() {}
-
-	PropTree(std::string const& data)
-	 : m_data(data)
+	PropTree()
+	 : m_node(0)
 	{}
 
+	PropTree(std::string const& data);
+
 	PropTree(PropTree const& c)
-	 : m_data(c.m_data),
-	 m_children_array(c.m_children_array),
-	 m_children_map(c.m_children_map)
-	{}
+	 : m_node(c.m_node)
+	{
+		this->Retain();
+	}
+
+#if __cplusplus >= 201103L
+	PropTree(PropTree&& c)
+	 : m_node(c.m_node)
+	{
+		c.m_node = 0;
+	}
+#endif
+
+	~PropTree() {
+		this->Release();
+	}
 
 	// Symbol operators
 	PropTree& operator = (PropTree const& c)
 	{
-		this->m_data = c.m_data;
-		this->m_children_array = c.m_children_array;
-		this->m_children_map = c.m_children_map;
+		PropTree tmp(c);
+		this->Swap(tmp);
 		return *this;
 	}
-	PropTree& operator = (std::string const& data) {
-		this->m_data = data;
-		this->m_children_array.clear();
-		this->m_children_map.clear();
+#if __cplusplus >= 201103L
+	PropTree& operator = (PropTree&& c)
+	{
+		this->Swap(c);
 		return *this;
 	}
+#endif
+	PropTree& operator = (std::string const& data);
 
 	template< class T >
 	PropTree& operator [] (T const& key) {
@@ -180,93 +268,433 @@ public:
 	}
 
 	// Cast operators
-	operator std::string () const {
-		return this->m_data;
-	}
+	operator std::string () const;
 
 	// Comparison operators
-	friend bool operator == (const PropTree& x, const std::string& y) {
-		return (x.m_data == y);
-	}
-	friend bool operator != (const PropTree& x, const std::string& y) {
-		return (x.m_data != y);
-	}
+	friend bool operator == (const PropTree& x, const std::string& y);
+	friend bool operator != (const PropTree& x, const std::string& y);
 
 	// Property functions
-	bool HasChildren() const {
-		return !(this->m_children_array.empty());
-	}
+	bool HasChildren() const;
+	/* A tree is an array once it has been made one with SetArray() or had
+	 * an element added with ArrayPushBack(), until a keyed child is added or
+	 * its value is replaced. Array elements have no keys; they are addressed
+	 * by at(size_t) and appended in O(1).
+	 */
+	bool IsArray() const;
+	bool ChildExists(std::string const& child) const;
 
-	bool IsArray() const {
-		return this->m_children_map.empty();
-	}
+	// Accessors
+	PropTree const& at(size_t idx) const;
+	PropTree& at(size_t idx);
+	PropTree const& at(std::string const& key) const;
+	PropTree& at(std::string const& key);
+
+	PropTree& ArrayPushBack(PropTree const& proptree);
+	// Inserts an array element before position idx (Size() appends).
+	PropTree& ArrayInsert(size_t idx, PropTree const& proptree);
+	// Removes the idx-th child.
+	void Erase(size_t idx);
+	// Removes the child with the given key, returning false if there's none.
+	bool Erase(std::string const& key);
+	// Replaces any children with an empty array.
+	void SetArray();
+	size_t Size() const;
+
+	std::string GetData() const;
+	void SetData(std::string const& data);
+
+	/* Typed scalar accessors. The getters convert from whatever kind is
+	 * stored (a string is parsed as by strtoll/strtod; "", "0" and "false"
+	 * are false), so they are safe to use on values from any source.
+	 */
+	PropTreeType GetType() const;
+	bool IsNull() const;
+	long long GetInt() const;
+	double GetDouble() const;
+	bool GetBool() const;
+	void SetInt(long long val);
+	void SetDouble(double val);
+	void SetBool(bool val);
+	void SetNull();
 
-	bool ChildExists(std::string const& child) const {
-		return (this->m_children_map.find(child) != this->m_children_map.end());
+	// Iterator functions
+	iterator Begin();
+	const_iterator Begin() const;
+	iterator End();
+	const_iterator End() const;
+
+	// Exchanges contents with another tree in O(1).
+	void Swap(PropTree& other) {
+		PropTreeNode* tmp = this->m_node;
+		this->m_node = other.m_node;
+		other.m_node = tmp;
 	}
 
-	// Accessors
-	PropTree const& at(size_t idx) const {
-		return this->m_children_array[idx].second;
+private:
+	friend class PropTreeIterator< false >;
+	friend class PropTreeIterator< true >;
+	friend class PropPath;
+	friend class PropSnapshot;
+	friend class PropDiff;
+
+	/* Returns the node for reading; an empty tree has no node of its own
+	 * and reads from a shared, permanently empty one.
+	 */
+	PropTreeNode const& Node() const;
+	/* Returns the node for writing, allocating it or cloning it away from
+	 * any other tree sharing it first.
+	 */
+	PropTreeNode& Mutable();
+	void Retain();
+	void Release();
+
+	PropTreeNode* m_node;
+};
+
+struct PropTreeChild {
+	PropTreeKey key;
+	PropTree tree;
+
+	PropTreeChild(PropTreeKey k, PropTree const& t)
+	 : key(k),
+	 tree(t)
+	{
+		PropTreeKeys::Retain(this->key);
 	}
-	PropTree& at(size_t idx) {
-		return this->m_children_array[idx].second;
+	PropTreeChild(PropTreeChild const& c)
+	 : key(c.key),
+	 tree(c.tree)
+	{
+		PropTreeKeys::Retain(this->key);
 	}
-	PropTree const& at(std::string const& key) const {
-		PropTreeChildrenMap::const_iterator fd = this->m_children_map.find(key);
-		if (fd == this->m_children_map.end()) {
-			static PropTree empty;
-			return empty;
-		} else
-			return this->m_children_array[fd->second].second;
+	~PropTreeChild() {
+		PropTreeKeys::Release(this->key);
 	}
-	PropTree& at(std::string const& key) {
-		PropTreeChildrenMap::iterator fd = this->m_children_map.find(key);
-		if (fd == this->m_children_map.end()) {
-			this->m_children_map.insert(
-				std::make_pair(key, this->m_children_array.size())
-			);
-			this->m_children_array.push_back(std::make_pair(key, PropTree()));
-			return this->m_children_array.back().second;
-		} else
-			return this->m_children_array[fd->second].second;
+	PropTreeChild& operator = (PropTreeChild const& c) {
+		PropTreeKeys::Retain(c.key);
+		PropTreeKeys::Release(this->key);
+		this->key = c.key;
+		this->tree = c.tree;
+		return *this;
 	}
+};
 
-	PropTree& ArrayPushBack(PropTree const& proptree) {
-		this->m_children_array.push_back(
-			std::make_pair(std::string(), proptree)
-		);
-		return this->m_children_array.back().second;
+/* The shared body of a PropTree. The children are themselves PropTree
+ * handles, so cloning a node for copy-on-write costs one reference per
+ * direct child rather than a deep copy of the whole subtree.
+ *
+ * Nodes are all the same size and are created and destroyed constantly
+ * while parsing and building inventories, so they are carved out of
+ * pooled arenas (see proptree.cpp) rather than each being a separate heap
+ * allocation. A freed node's slot goes back to the pool for the next one,
+ * but the arenas themselves are kept for the life of the process: the memory
+ * held is that of the most nodes ever alive at once, not of all those ever
+ * created.
+ */
+struct PropTreeNode {
+	size_t refs;
+	PropTreeType type;
+	// Only used when type is PROPTREE_STRING.
+	std::string data;
+	union {
+		long long i;
+		double d;
+		bool b;
+	} scalar;
+	PropTreeChildrenArray children;
+	PropTreeChildrenIndex index;
+	// 64 - log2(index.size()), for HashKeyPointer().
+	unsigned int index_shift;
+	size_t keyed;
+	bool array;
+
+	PropTreeNode()
+	 : refs(1),
+	 type(PROPTREE_STRING),
+	 index_shift(64),
+	 keyed(0),
+	 array(false)
+	{
+		this->scalar.i = 0;
 	}
+	PropTreeNode(PropTreeNode const& c)
+	 : refs(1),
+	 type(c.type),
+	 data(c.data),
+	 scalar(c.scalar),
+	 children(c.children),
+	 index(c.index),
+	 index_shift(c.index_shift),
+	 keyed(c.keyed),
+	 array(c.array)
+	{}
 
-	std::string GetData() const {
-		return this->m_data;
-	}
-	void SetData(std::string const& data) {
-		this->m_data = data;
+	static void* operator new(size_t size);
+	static void operator delete(void* p, size_t size);
+
+	static PropTreeNode const& Empty() {
+		static PropTreeNode empty;
+		return empty;
 	}
 
-	// Iterator functions
-	iterator Begin() {
-		return iterator(this, m_children_array.begin());
+	/* Returns the offset in children of the child with the given key, or
+	 * children.size() if there isn't one. A null key never matches.
+	 */
+	size_t Find(PropTreeKey key) const;
+	// Appends a keyed child and records it in the index, if there is one.
+	PropTree& Append(PropTreeKey key, PropTree const& tree);
+	/* Inserts or removes the child at offset. Both move the children after
+	 * it, so any index is rebuilt: O(n), unlike Append().
+	 */
+	PropTree& Insert(size_t offset, PropTreeKey key, PropTree const& tree);
+	void Erase(size_t offset);
+	// Renders a non-string scalar the way GetData() reports it.
+	std::string FormatScalar() const;
+	void SetString(std::string const& val) {
+		this->type = PROPTREE_STRING;
+		this->data = val;
 	}
-	const_iterator Begin() const {
-		return const_iterator(this, m_children_array.begin());
+	void SetScalar(PropTreeType t) {
+		this->type = t;
+		this->data.clear();
 	}
-	iterator End() {
-		return iterator(this, m_children_array.end());
+	void Clear() {
+		this->children.clear();
+		this->index.clear();
+		this->keyed = 0;
+		this->array = false;
 	}
-	const_iterator End() const {
-		return const_iterator(this, m_children_array.end());
+
+private:
+	void Reindex(size_t slots);
+	void IndexInsert(size_t offset);
+};
+
+inline PropTree::PropTree(std::string const& data)
+ : m_node(new PropTreeNode)
+{
+	this->m_node->SetString(data);
+}
+
+inline PropTreeNode const& PropTree::Node() const {
+	return this->m_node ? *(this->m_node) : PropTreeNode::Empty();
+}
+inline PropTreeNode& PropTree::Mutable() {
+	if (!this->m_node)
+		this->m_node = new PropTreeNode;
+	else if (this->m_node->refs > 1) {
+		PropTreeNode* clone = new PropTreeNode(*(this->m_node));
+		--(this->m_node->refs);
+		this->m_node = clone;
 	}
+	return *(this->m_node);
+}
+inline void PropTree::Retain() {
+	if (this->m_node)
+		++(this->m_node->refs);
+}
+inline void PropTree::Release() {
+	if (this->m_node && --(this->m_node->refs) == 0)
+		delete this->m_node;
+	this->m_node = 0;
+}
+
+inline PropTree& PropTree::operator = (std::string const& data) {
+	// No point cloning children from a shared node only to drop them.
+	if (this->m_node && this->m_node->refs > 1)
+		this->Release();
+	PropTreeNode& node = this->Mutable();
+	node.SetString(data);
+	node.Clear();
+	return *this;
+}
+
+inline PropTree::operator std::string () const {
+	return this->GetData();
+}
+
+inline bool operator == (const PropTree& x, const std::string& y) {
+	PropTreeNode const& node = x.Node();
+	if (node.type == PROPTREE_STRING)
+		return (node.data == y);
+	return (node.FormatScalar() == y);
+}
+inline bool operator != (const PropTree& x, const std::string& y) {
+	return !(x == y);
+}
+
+inline bool PropTree::HasChildren() const {
+	return !(this->Node().children.empty());
+}
+
+inline bool PropTree::IsArray() const {
+	return this->Node().array;
+}
+
+inline bool PropTree::ChildExists(std::string const& child) const {
+	PropTreeNode const& node = this->Node();
+	return (node.Find(PropTreeKeys::Find(child)) < node.children.size());
+}
+
+inline PropTree const& PropTree::at(size_t idx) const {
+	return this->Node().children[idx].tree;
+}
+inline PropTree& PropTree::at(size_t idx) {
+	return this->Mutable().children[idx].tree;
+}
+inline PropTree const& PropTree::at(std::string const& key) const {
+	PropTreeNode const& node = this->Node();
+	size_t fd = node.Find(PropTreeKeys::Find(key));
+	if (fd >= node.children.size()) {
+		static PropTree empty;
+		return empty;
+	} else
+		return node.children[fd].tree;
+}
+inline PropTree& PropTree::at(std::string const& key) {
+	PropTreeNode& node = this->Mutable();
+	PropTreeKey ikey = PropTreeKeys::Intern(key);
+	size_t fd = node.Find(ikey);
+	if (fd >= node.children.size())
+		return node.Append(ikey, PropTree());
+	else
+		return node.children[fd].tree;
+}
+
+inline PropTree& PropTree::ArrayPushBack(PropTree const& proptree) {
+	PropTreeNode& node = this->Mutable();
+	if (node.keyed == 0)
+		node.array = true;
+	node.children.push_back(PropTreeChild(PropTreeKeys::Empty(), proptree));
+	return node.children.back().tree;
+}
+inline PropTree& PropTree::ArrayInsert(size_t idx, PropTree const& proptree) {
+	PropTreeNode& node = this->Mutable();
+	if (node.keyed == 0)
+		node.array = true;
+	return node.Insert(idx, PropTreeKeys::Empty(), proptree);
+}
+inline void PropTree::Erase(size_t idx) {
+	this->Mutable().Erase(idx);
+}
+inline bool PropTree::Erase(std::string const& key) {
+	PropTreeKey ikey = PropTreeKeys::Find(key);
+	if (this->Node().Find(ikey) >= this->Size())
+		return false;
+	PropTreeNode& node = this->Mutable();
+	node.Erase(node.Find(ikey));
+	return true;
+}
+inline void PropTree::SetArray() {
+	PropTreeNode& node = this->Mutable();
+	node.Clear();
+	node.array = true;
+}
+inline size_t PropTree::Size() const {
+	return this->Node().children.size();
+}
+
+inline std::string PropTree::GetData() const {
+	PropTreeNode const& node = this->Node();
+	if (node.type == PROPTREE_STRING)
+		return node.data;
+	return node.FormatScalar();
+}
+inline void PropTree::SetData(std::string const& data) {
+	this->Mutable().SetString(data);
+}
+
+inline PropTreeType PropTree::GetType() const {
+	return this->Node().type;
+}
+inline bool PropTree::IsNull() const {
+	return (this->Node().type == PROPTREE_NULL);
+}
+inline void PropTree::SetInt(long long val) {
+	PropTreeNode& node = this->Mutable();
+	node.SetScalar(PROPTREE_INTEGER);
+	node.scalar.i = val;
+}
+inline void PropTree::SetDouble(double val) {
+	PropTreeNode& node = this->Mutable();
+	node.SetScalar(PROPTREE_DOUBLE);
+	node.scalar.d = val;
+}
+inline void PropTree::SetBool(bool val) {
+	PropTreeNode& node = this->Mutable();
+	node.SetScalar(PROPTREE_BOOL);
+	node.scalar.b = val;
+}
+inline void PropTree::SetNull() {
+	this->Mutable().SetScalar(PROPTREE_NULL);
+}
+
+inline PropTree::iterator PropTree::Begin() {
+	PropTreeNode& node = this->Mutable();
+	return iterator(this, node.children.begin());
+}
+inline PropTree::const_iterator PropTree::Begin() const {
+	return const_iterator(this, this->Node().children.begin());
+}
+inline PropTree::iterator PropTree::End() {
+	PropTreeNode& node = this->Mutable();
+	return iterator(this, node.children.end());
+}
+inline PropTree::const_iterator PropTree::End() const {
+	return const_iterator(this, this->Node().children.end());
+}
+
+
+/* Receives the matches of a PropPath::Select(). wildcard_keys holds the key
+ * each "*" step matched, in path order (array elements match with an
+ * empty key).
+ */
+struct PropPathVisitor {
+	virtual ~PropPathVisitor() {}
+	virtual void OnMatch(std::vector< PropTreeKey > const& wildcard_keys,
+	PropTree const& match) = 0;
+};
+
+/* A compiled selector into a PropTree, written as dot-separated keys, e.g.
+ * PropPath("proto-telnet.auth"). A step of "*" matches every child, as in
+ * "interfaces.*.speed"; a literal '.' or '*' in a key is escaped with '\'.
+ *
+ * The keys are interned once, when the path is compiled, so resolving a
+ * path is a pointer comparison (or hash probe) per step: it never builds a
+ * key string, never allocates and, unlike the non-const PropTree::at(),
+ * never inserts missing children. Paths are cheap to keep around as static
+ * constants.
+ */
+class PropPath {
+public:
+	PropPath(std::string const& path);
+	PropPath(PropPath const& p);
+	~PropPath();
+	PropPath& operator = (PropPath const& p);
+
+	/* Resolves a path with no wildcards, returning 0 if any step is
+	 * missing. (A wildcard step resolves to the first child.)
+	 */
+	PropTree const* Find(PropTree const& tree) const;
+	// As Find(), but returns an empty tree when the path is missing.
+	PropTree const& Get(PropTree const& tree) const;
+	bool Exists(PropTree const& tree) const {
+		return (this->Find(tree) != 0);
+	}
+
+	/* Calls visitor for every tree the path matches, expanding wildcards, in
+	 * a single depth-first pass over only the parts of the tree the path
+	 * touches. Returns the number of matches.
+	 */
+	size_t Select(PropTree const& tree, PropPathVisitor& visitor) const;
 
 private:
-	friend class PropTreeIterator< false >;
-	friend class PropTreeIterator< true >;
+	size_t SelectRecursive(PropTree const& tree, size_t step,
+	std::vector< PropTreeKey >& wildcard_keys, PropPathVisitor& visitor) const;
 
-	std::string m_data;
-	PropTreeChildrenArray m_children_array;
-	PropTreeChildrenMap m_children_map;
+	// One entry per step; 0 is a wildcard.
+	std::vector< PropTreeKey > m_steps;
 };
 
 #endif // SWITCHTOOL_PROPTREE_HPP_INC
@@ -0,0 +1,79 @@
+#include "common.hpp"
+#include "terminal.hpp"
+#include "replycache.hpp"
+
+
+/* Passes a reply on to the real callback, keeping a copy of it as it goes.
+ */
+struct ReplyRecorder : public DataCallback {
+	DataCallback* dcb;
+	std::vector< std::string >& pieces;
+	ReplyRecorder(DataCallback* d, std::vector< std::string >& p)
+	 : dcb(d),
+	 pieces(p)
+	{}
+	virtual void OnData(const std::string& data) {
+		pieces.push_back(data);
+		dcb->OnData(data);
+	}
+	virtual bool Streaming() const {
+		return dcb->Streaming();
+	}
+	virtual void OnChunk(const char* data, size_t len) {
+		// Kept as one piece, however it arrived.
+		if (pieces.empty())
+			pieces.push_back(std::string());
+		pieces[0].append(data, len);
+		dcb->OnChunk(data, len);
+	}
+	virtual void OnEnd() {
+		dcb->OnEnd();
+	}
+};
+
+
+ReplyCache::ReplyCache(int ttl)
+ : m_ttl(ttl)
+{
+}
+
+void ReplyCache::Execute(Terminal& term, const std::string& cmd,
+DataCallback* dcb) {
+	if (m_ttl <= 0 || !dcb) {
+		term.Execute(cmd, dcb);
+		return;
+	}
+	time_t now = time(0);
+	std::map< std::string, Reply >::iterator fd = m_replies.find(cmd);
+	if (fd != m_replies.end()) {
+		if (fd->second.expires > now) {
+			// Replies to anything already sent still come first.
+			term.Flush();
+			Replay(fd->second, dcb);
+			return;
+		}
+		m_replies.erase(fd);
+	}
+	std::vector< std::string > pieces;
+	ReplyRecorder recorder(dcb, pieces);
+	term.Execute(cmd, &recorder);
+	Reply& reply = m_replies[cmd];
+	reply.expires = now + m_ttl;
+	reply.pieces.swap(pieces);
+}
+
+void ReplyCache::Clear() {
+	m_replies.clear();
+}
+
+void ReplyCache::Replay(const Reply& reply, DataCallback* dcb) {
+	if (!dcb->Streaming()) {
+		for (size_t i = 0; i < reply.pieces.size(); ++i)
+			dcb->OnData(reply.pieces[i]);
+		return;
+	}
+	// Only NETCONF replies stream, and those are recorded whole either way.
+	for (size_t i = 0; i < reply.pieces.size(); ++i)
+		dcb->OnChunk(reply.pieces[i].data(), reply.pieces[i].length());
+	dcb->OnEnd();
+}
@@ -0,0 +1,48 @@
+#ifndef REPLYCACHE_HPP_INC
+#define REPLYCACHE_HPP_INC
+
+
+#include <string>
+#include <map>
+#include <vector>
+#include <ctime>
+
+
+class Terminal;
+struct DataCallback;
+
+/* Keeps the raw replies to a host's read-only commands, keyed by the exact
+ * command (or RPC) text, so that asking the same thing twice within ttl
+ * seconds goes to the device only once. A cached reply is handed to the
+ * callback just as the terminal would have: line by line for the CLI, or
+ * whole (or as one chunk, for a streaming callback) for NETCONF; and only
+ * once any NETCONF requests already sent have been answered, so that
+ * replies still arrive in the order asked for.
+ *
+ * Only replies whose callback returned normally are kept; one that threw
+ * (an RPC error, say) is asked for again next time. Anything that might
+ * change the device's state must Clear() the cache; Host::Dispatch() does so
+ * around every command that isn't a read.
+ */
+class ReplyCache {
+public:
+	ReplyCache(int ttl);
+
+	// As Terminal::Execute(), but from the cache if it can be.
+	void Execute(Terminal& term, const std::string& cmd, DataCallback* dcb);
+	void Clear();
+
+private:
+	struct Reply {
+		time_t expires;
+		std::vector< std::string > pieces;
+	};
+
+	static void Replay(const Reply& reply, DataCallback* dcb);
+
+	int m_ttl;
+	std::map< std::string, Reply > m_replies;
+};
+
+
+#endif
@@ -1,46 +1,1109 @@
+extern "C" {
+#ifdef WIN32
+#include <windows.h>
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+}
+
 #include <cstdio>
-#include <pcrecpp.h>
+#include <cstdlib>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
 
 #include "common.hpp"
 #include "snmp.hpp"
+#include "snmpber.hpp"
+
+
+static const int SNMP_TIMEOUT_SECONDS = 1;
+static const int SNMP_RETRIES = 5;
+static const int SNMP_MAX_REPETITIONS = 10;
+static const int SNMP_MAX_REPETITIONS_LIMIT = 200;
+// What a GETBULK response may grow to: one Ethernet frame, less IP and UDP.
+static const size_t SNMP_MAX_RESPONSE_BYTES = 1472;
+static const long long SNMP_FAST_RTT_MS = 200;
+static const size_t SNMP_GET_VARBINDS = 48;
+
+static const int SNMP_ERR_TOOBIG = 1;
+static const int SNMP_ERR_NOSUCHNAME = 2;
+
+
+static bool OidStartsWith(const SNMPOid& oid, const SNMPOid& prefix) {
+	if (oid.size() < prefix.size())
+		return false;
+	for (size_t i = 0; i < prefix.size(); ++i) {
+		if (oid[i] != prefix[i])
+			return false;
+	}
+	return true;
+}
+
+static void ResolveAgent(const std::string& ip, int port,
+struct sockaddr_in* addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	addr->sin_addr.s_addr = inet_addr(ip.c_str());
+	if (addr->sin_addr.s_addr == INADDR_NONE) {
+		struct hostent* he = gethostbyname(ip.c_str());
+		if (!he || he->h_addrtype != AF_INET)
+			throw fmt("Unknown host: %s", ip.c_str());
+		memcpy(&(addr->sin_addr), he->h_addr_list[0], sizeof(addr->sin_addr));
+	}
+}
+
+/* The progress of a table walk: which columns are still going and the last
+ * OID seen in each. The same state drives a blocking SNMPSession and the
+ * asynchronous SNMPPoller.
+ */
+struct TableWalkState {
+	std::vector< SNMPOid > columns;
+	std::vector< SNMPOid > last;
+	std::vector< size_t > active;
+	/* How many of the columns, leading the rest, are scalars still to be
+	 * fetched: they go in the first request, as its non-repeaters.
+	 */
+	size_t scalars;
+
+	TableWalkState(const std::vector< SNMPOid >& c, size_t s = 0)
+	 : columns(c),
+	 last(c),
+	 scalars(std::min(s, c.size()))
+	{
+		for (size_t i = 0; i < c.size(); ++i)
+			this->active.push_back(i);
+	}
+
+	bool Done() const {
+		return this->active.empty();
+	}
+
+	// The varbinds of the next request: one per column still going.
+	void NextOids(std::vector< SNMPOid >& oids) const {
+		oids.clear();
+		for (size_t j = 0; j < this->active.size(); ++j)
+			oids.push_back(this->last[this->active[j]]);
+	}
+
+	// How many of NextOids() are to be sent as non-repeaters.
+	int NonRepeaters() const {
+		return static_cast< int >(this->scalars);
+	}
+
+	/* Takes a GETBULK or GETNEXT response to NextOids(): one varbind for
+	 * each scalar, then the other columns repeated in order, one row per
+	 * repetition. Varbinds still within their column go to scb; a column is
+	 * finished at the first one that isn't, and a scalar after its one.
+	 */
+	void Advance(const std::vector< SNMPVarBind >& vbs, SNMPCallback* scb) {
+		std::vector< bool > done(this->active.size(),
+		vbs.size() <= this->scalars);
+		for (size_t j = 0; j < this->scalars; ++j) {
+			done[j] = true;
+			if (j < vbs.size() && vbs[j].Exists()
+			&& OidStartsWith(vbs[j].oid, this->columns[this->active[j]]) && scb)
+				scb->OnVarBind(vbs[j]);
+		}
+		size_t repeaters = this->active.size() - this->scalars;
+		for (size_t i = this->scalars; repeaters > 0 && i < vbs.size(); ++i) {
+			size_t j = this->scalars + (i - this->scalars) % repeaters;
+			size_t c = this->active[j];
+			if (done[j])
+				continue;
+			if (!vbs[i].Exists() || !OidStartsWith(vbs[i].oid, this->columns[c])) {
+				done[j] = true;
+				continue;
+			}
+			if (!(this->last[c] < vbs[i].oid))
+				throw fmt("OID not increasing: %s",
+				SNMPFormatOid(vbs[i].oid).c_str());
+			this->last[c] = vbs[i].oid;
+			if (scb)
+				scb->OnVarBind(vbs[i]);
+		}
+		std::vector< size_t > still;
+		for (size_t j = 0; j < this->active.size(); ++j) {
+			if (!done[j])
+				still.push_back(this->active[j]);
+		}
+		this->active.swap(still);
+		this->scalars = 0;
+	}
+
+	/* Handles an error-status from the agent, returning false if the walk
+	 * can't go on. SNMPv1 agents report the end of a column as noSuchName,
+	 * with error-index pointing at the varbind (counting from 1).
+	 */
+	bool OnError(int version, int error_status, int error_index) {
+		if (version != 1 || error_status != SNMP_ERR_NOSUCHNAME
+		|| error_index < 1
+		|| static_cast< size_t >(error_index) > this->active.size())
+			return false;
+		this->active.erase(this->active.begin() + (error_index - 1));
+		return true;
+	}
+};
+
+
+SNMPOid SNMPParseOid(const std::string& oid) {
+	SNMPOid ret;
+	const char* c = oid.c_str();
+	if (*c == '.')
+		++c;
+	while (*c) {
+		if (*c < '0' || *c > '9')
+			throw fmt("Invalid OID: %s", oid.c_str());
+		char* end;
+		ret.push_back(static_cast< unsigned int >(strtoul(c, &end, 10)));
+		c = end;
+		if (*c == '.' && *(c + 1))
+			++c;
+		else if (*c)
+			throw fmt("Invalid OID: %s", oid.c_str());
+	}
+	return ret;
+}
+
+std::string SNMPFormatOid(const SNMPOid& oid) {
+	std::string ret;
+	char buf[16];
+	for (SNMPOid::const_iterator it = oid.begin(); it != oid.end(); ++it) {
+		snprintf(buf, sizeof(buf), ".%u", *it);
+		ret += buf;
+	}
+	return ret;
+}
+
+static std::string HexString(const std::string& octets) {
+	std::string ret;
+	char buf[4];
+	for (std::string::const_iterator it = octets.begin(); it != octets.end(); ++it) {
+		snprintf(buf, sizeof(buf), "%02X ", static_cast< unsigned char >(*it));
+		ret += buf;
+	}
+	return ret;
+}
+
+std::string SNMPValue::Format() const {
+	switch (this->type) {
+		case SNMP_INTEGER:
+			return fmt("INTEGER: %lld", this->integer);
+		case SNMP_OCTET_STRING:
+			for (std::string::const_iterator it = this->octets.begin();
+			it != this->octets.end();
+			++it) {
+				unsigned char c = static_cast< unsigned char >(*it);
+				if ((c < 0x20 || c > 0x7e) && c != '\r' && c != '\n' && c != '\t')
+					return "Hex-STRING: " + HexString(this->octets);
+			}
+			return "STRING: \"" + this->octets + "\"";
+		case SNMP_NULL:
+			return "NULL";
+		case SNMP_OBJECT_ID:
+			return "OID: " + SNMPFormatOid(this->oid_value);
+		case SNMP_IPADDRESS:
+			if (this->octets.length() != 4)
+				return "IpAddress: " + HexString(this->octets);
+			return fmt("IpAddress: %u.%u.%u.%u",
+			static_cast< unsigned char >(this->octets[0]),
+			static_cast< unsigned char >(this->octets[1]),
+			static_cast< unsigned char >(this->octets[2]),
+			static_cast< unsigned char >(this->octets[3]));
+		case SNMP_COUNTER32:
+			return fmt("Counter32: %llu", this->counter);
+		case SNMP_GAUGE32:
+			return fmt("Gauge32: %llu", this->counter);
+		case SNMP_TIMETICKS:
+			return fmt("Timeticks: (%llu)", this->counter);
+		case SNMP_COUNTER64:
+			return fmt("Counter64: %llu", this->counter);
+		case SNMP_NO_SUCH_OBJECT:
+			return "No Such Object available on this agent at this OID";
+		case SNMP_NO_SUCH_INSTANCE:
+			return "No Such Instance currently exists at this OID";
+		case SNMP_END_OF_MIB_VIEW:
+			return "No more variables left in this MIB View (It is past the end of the MIB tree)";
+		default:
+			return "OPAQUE: " + HexString(this->octets);
+	}
+}
+
+void SNMPCallback::OnVarBind(const SNMPVarBind& vb) {
+	this->OnData(fmt("%u", vb.Index()), vb.Format());
+}
+
+size_t SNMPTable::Find(unsigned int index) const {
+	SNMPOid key(1, index);
+	std::vector< SNMPOid >::const_iterator fd
+	= std::lower_bound(this->rows.begin(), this->rows.end(), key);
+	if (fd == this->rows.end() || *fd != key)
+		return this->rows.size();
+	return (fd - this->rows.begin());
+}
+
+
+SNMPTableBuilder::SNMPTableBuilder(const std::vector< SNMPOid >& columns)
+ : m_columns(columns),
+ m_found(columns.size())
+{}
+
+void SNMPTableBuilder::OnVarBind(const SNMPVarBind& vb) {
+	for (size_t c = 0; c < m_columns.size(); ++c) {
+		if (OidStartsWith(vb.oid, m_columns[c])) {
+			m_found[c].push_back(vb);
+			return;
+		}
+	}
+}
+
+void SNMPTableBuilder::Finish(SNMPTable& table) const {
+	std::map< SNMPOid, size_t > row_of;
+	for (size_t c = 0; c < m_columns.size(); ++c) {
+		for (std::vector< SNMPVarBind >::const_iterator it = m_found[c].begin();
+		it != m_found[c].end();
+		++it)
+			row_of[SNMPOid(it->oid.begin() + m_columns[c].size(), it->oid.end())];
+	}
+	table.rows.clear();
+	table.rows.reserve(row_of.size());
+	for (std::map< SNMPOid, size_t >::iterator it = row_of.begin();
+	it != row_of.end();
+	++it) {
+		it->second = table.rows.size();
+		table.rows.push_back(it->first);
+	}
+	SNMPValue missing;
+	missing.type = SNMP_NO_SUCH_INSTANCE;
+	table.columns.assign(m_columns.size(),
+	std::vector< SNMPValue >(table.rows.size(), missing));
+	for (size_t c = 0; c < m_columns.size(); ++c) {
+		for (std::vector< SNMPVarBind >::const_iterator it = m_found[c].begin();
+		it != m_found[c].end();
+		++it) {
+			size_t r = row_of[SNMPOid(it->oid.begin() + m_columns[c].size(),
+			it->oid.end())];
+			table.columns[c][r] = *it;
+		}
+	}
+}
+
+
+static long long NowMs() {
+#ifdef WIN32
+	return GetTickCount();
+#else
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return static_cast< long long >(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+SNMPTuning::SNMPTuning()
+ : max_repetitions(SNMP_MAX_REPETITIONS),
+ ceiling(SNMP_MAX_REPETITIONS_LIMIT),
+ rtt_ms(0),
+ response_bytes(0)
+{}
+
+std::map< std::string, SNMPTuning >* SNMPTuning::GetTunings() {
+	static std::map< std::string, SNMPTuning > tunings;
+	return &tunings;
+}
+
+SNMPTuning& SNMPTuning::For(const std::string& ip, int max_repetitions) {
+	std::map< std::string, SNMPTuning >::iterator fd = GetTunings()->find(ip);
+	if (fd != GetTunings()->end())
+		return fd->second;
+	SNMPTuning& tuning = (*GetTunings())[ip];
+	if (max_repetitions > 0)
+		tuning.max_repetitions = std::min(max_repetitions, tuning.ceiling);
+	return tuning;
+}
+
+void SNMPTuning::OnResponse(int asked, bool full, int attempts, long long rtt,
+size_t bytes) {
+	if (attempts > 1) {
+		// It got there in the end, but something was lost on the way.
+		this->OnTimeout(asked);
+		return;
+	}
+	this->rtt_ms = (this->rtt_ms > 0 ? (this->rtt_ms * 7 + rtt) / 8 : rtt);
+	this->response_bytes = bytes;
+	// A short response (the end of the walk) says nothing about the limits.
+	if (!full || asked != this->max_repetitions)
+		return;
+	int grown = asked + std::max(1, asked / 4);
+	if (grown <= this->ceiling
+	&& this->rtt_ms < SNMP_FAST_RTT_MS
+	&& bytes * grown / asked <= SNMP_MAX_RESPONSE_BYTES)
+		this->max_repetitions = grown;
+	else if (bytes > SNMP_MAX_RESPONSE_BYTES && asked > 1) {
+		this->max_repetitions = std::max(1,
+		static_cast< int >(asked * SNMP_MAX_RESPONSE_BYTES / bytes));
+	}
+}
+
+void SNMPTuning::OnTooBig(int asked) {
+	this->ceiling = std::max(1, asked - 1);
+	this->max_repetitions = std::min(this->max_repetitions,
+	std::max(1, asked / 2));
+}
+
+void SNMPTuning::OnTimeout(int asked) {
+	this->max_repetitions = std::min(this->max_repetitions,
+	std::max(1, asked / 2));
+}
+
+
+SNMPSession::SNMPSession(int version, const std::string& community,
+const std::string& ip, int port)
+ : m_version(version),
+ m_community(community),
+ m_ip(ip),
+ m_request_id(static_cast< unsigned int >(time(0)) * 2654435761U),
+ m_tuning(SNMPTuning::For(ip)),
+ m_last_attempts(0)
+{
+	if (version != 1 && version != 2)
+		throw fmt("Unsupported SNMP version: %d", version);
+	ResolveAgent(ip, port, &m_addr);
+	m_sock = socket(AF_INET, SOCK_DGRAM, 0);
+#ifdef WIN32
+	if (m_sock == INVALID_SOCKET)
+#else
+	if (m_sock < 0)
+#endif
+		throw fmt("Failed to create SNMP socket for %s", ip.c_str());
+	// Connected, so the kernel drops datagrams from anyone but the agent.
+	if (connect(m_sock, (struct sockaddr*)&m_addr, sizeof(m_addr)) != 0) {
+#ifdef WIN32
+		closesocket(m_sock);
+#else
+		close(m_sock);
+#endif
+		throw fmt("Failed to connect SNMP socket to %s", ip.c_str());
+	}
+}
+
+SNMPSession::~SNMPSession() {
+#ifdef WIN32
+	closesocket(m_sock);
+#else
+	close(m_sock);
+#endif
+}
+
+unsigned int SNMPSession::NextRequestId() {
+	// Always four octets when encoded; see SNMPGetter.
+	return (((++m_request_id) & 0x00ffffff) | 0x01000000);
+}
+
+size_t SNMPSession::Transact(const std::string& packet,
+unsigned int request_id, unsigned char* buf, size_t size, int* attempts) {
+	for (int attempt = 0; attempt <= SNMP_RETRIES; ++attempt) {
+		if (attempts)
+			*attempts = attempt + 1;
+		if (send(m_sock, packet.data(), packet.length(), 0)
+		!= static_cast< int >(packet.length()))
+			throw fmt("Failed to send SNMP request to %s", m_ip.c_str());
+		while (true) {
+			struct timeval timeout;
+			timeout.tv_sec = SNMP_TIMEOUT_SECONDS;
+			timeout.tv_usec = 0;
+			fd_set fd;
+			FD_ZERO(&fd);
+			FD_SET(m_sock, &fd);
+			if (select(m_sock + 1, &fd, NULL, NULL, &timeout) <= 0)
+				break;
+			int len = recv(m_sock, reinterpret_cast< char* >(buf), size, 0);
+			if (len <= 0)
+				break;
+			unsigned int got_id;
+			int error_status;
+			int error_index;
+			try {
+				DecodeResponseHeader(buf, len, &got_id, &error_status,
+				&error_index);
+				if (got_id == request_id)
+					return len;
+			} catch (std::string&) {
+				// A garbled datagram is as good as a lost one.
+			}
+		}
+	}
+	throw fmt("Timeout: No Response from %s", m_ip.c_str());
+}
+
+int SNMPSession::Request(unsigned char pdu_type,
+const std::vector< SNMPOid >& oids, int non_repeaters, int max_repetitions,
+std::vector< SNMPVarBind >& vbs, int* error_index) {
+	std::string varbinds;
+	for (std::vector< SNMPOid >::const_iterator it = oids.begin();
+	it != oids.end();
+	++it)
+		BerAppendVarBind(varbinds, *it);
+	return this->Exchange(pdu_type, varbinds, oids.size(), non_repeaters,
+	max_repetitions, vbs, error_index);
+}
+
+int SNMPSession::Exchange(unsigned char pdu_type, const std::string& varbinds,
+size_t count, int non_repeaters, int max_repetitions,
+std::vector< SNMPVarBind >& vbs, int* error_index) {
+	unsigned int request_id = this->NextRequestId();
+	std::string packet = EncodeMessage(m_version, m_community, pdu_type,
+	request_id, non_repeaters, max_repetitions, varbinds);
+
+	static unsigned char buf[65536];
+	int attempts;
+	long long sent = NowMs();
+	size_t len;
+	try {
+		len = this->Transact(packet, request_id, buf, sizeof(buf), &attempts);
+		m_last_attempts = attempts;
+	} catch (std::string&) {
+		m_last_attempts = SNMP_RETRIES + 1;
+		if (pdu_type == PDU_GETBULK)
+			m_tuning.OnTimeout(max_repetitions);
+		throw;
+	}
+	unsigned int got_id;
+	int error_status;
+	int got_index;
+	size_t had = vbs.size();
+	DecodeResponse(buf, len, &got_id, &error_status, &got_index, vbs);
+	if (error_index)
+		*error_index = got_index;
+	// Non-repeaters alone say nothing about how many repetitions fit.
+	size_t repeaters = count - non_repeaters;
+	if (pdu_type == PDU_GETBULK && repeaters > 0) {
+		if (error_status == SNMP_ERR_TOOBIG)
+			m_tuning.OnTooBig(max_repetitions);
+		else if (error_status == 0) {
+			m_tuning.OnResponse(max_repetitions,
+			vbs.size() - had >= non_repeaters + repeaters * max_repetitions,
+			attempts, NowMs() - sent, len);
+		}
+	}
+	return error_status;
+}
+
+void SNMPSession::Get(const std::vector< SNMPOid >& oids,
+std::vector< SNMPVarBind >& vbs) {
+	size_t per_request = SNMP_GET_VARBINDS;
+	size_t first = 0;
+	while (first < oids.size()) {
+		size_t count = std::min(per_request, oids.size() - first);
+		std::vector< SNMPOid > batch(oids.begin() + first,
+		oids.begin() + first + count);
+		size_t had = vbs.size();
+		int status = this->Request(PDU_GET, batch, 0, 0, vbs);
+		if (status == SNMP_ERR_TOOBIG && count > 1) {
+			vbs.resize(had);
+			per_request = count / 2;
+			continue;
+		}
+		if (status != 0)
+			throw fmt("SNMP error-status %d from %s", status, m_ip.c_str());
+		first += count;
+	}
+}
+
+void SNMPSession::Set(const std::vector< SNMPVarBind >& vbs,
+size_t* set_count) {
+	size_t max_bytes = SNMP_MAX_RESPONSE_BYTES;
+	size_t first = 0;
+	if (set_count)
+		*set_count = 0;
+	while (first < vbs.size()) {
+		// As many as fit in max_bytes, but at least one.
+		std::string varbinds;
+		size_t count = 0;
+		for (; first + count < vbs.size(); ++count) {
+			std::string vb;
+			BerAppendVarBind(vb, vbs[first + count].oid, &vbs[first + count]);
+			if (count > 0 && varbinds.length() + vb.length() > max_bytes)
+				break;
+			varbinds += vb;
+		}
+		std::vector< SNMPVarBind > response;
+		int error_index = 0;
+		int status = this->Exchange(PDU_SET, varbinds, count, 0, 0, response,
+		&error_index);
+		if (status == SNMP_ERR_TOOBIG && count > 1) {
+			max_bytes = varbinds.length() / 2;
+			continue;
+		}
+		if (status != 0) {
+			std::string oid;
+			if (error_index >= 1 && static_cast< size_t >(error_index) <= count)
+				oid = SNMPFormatOid(vbs[first + error_index - 1].oid);
+			throw fmt("SNMP SET of %s failed with error-status %d from %s",
+			oid.c_str(), status, m_ip.c_str());
+		}
+		first += count;
+		if (set_count)
+			*set_count = first;
+	}
+}
+
+void SNMPSession::Walk(const SNMPOid& root, SNMPCallback* scb) {
+	std::vector< SNMPOid > oids(1, root);
+	std::vector< SNMPVarBind > vbs;
+	while (true) {
+		vbs.clear();
+		int status;
+		int asked = m_tuning.max_repetitions;
+		if (m_version == 1)
+			status = this->Request(PDU_GETNEXT, oids, 0, 0, vbs);
+		else
+			status = this->Request(PDU_GETBULK, oids, 0, asked, vbs);
+		// The tuning has been cut down already; try again with less.
+		if (status == SNMP_ERR_TOOBIG && m_version != 1 && asked > 1)
+			continue;
+		if (status == SNMP_ERR_NOSUCHNAME && m_version == 1)
+			return;
+		if (status != 0)
+			throw fmt("SNMP error-status %d from %s", status, m_ip.c_str());
+		if (vbs.empty())
+			return;
+		for (std::vector< SNMPVarBind >::const_iterator it = vbs.begin();
+		it != vbs.end();
+		++it) {
+			if (!it->Exists() || !OidStartsWith(it->oid, root))
+				return;
+			if (!(oids[0] < it->oid))
+				throw fmt("OID not increasing: %s", SNMPFormatOid(it->oid).c_str());
+			if (scb)
+				scb->OnVarBind(*it);
+			oids[0] = it->oid;
+		}
+	}
+}
+
+void SNMPSession::WalkTable(const std::vector< SNMPOid >& columns,
+SNMPTable& table) {
+	SNMPTableBuilder builder(columns);
+	this->WalkTable(columns, &builder);
+	builder.Finish(table);
+}
+
+void SNMPSession::WalkTable(const std::vector< SNMPOid >& columns,
+SNMPCallback* scb, size_t scalars) {
+	// GETNEXT has no non-repeaters; the scalars are walked like the rest.
+	TableWalkState state(columns, m_version == 1 ? 0 : scalars);
+	std::vector< SNMPOid > oids;
+	std::vector< SNMPVarBind > vbs;
+	while (!state.Done()) {
+		state.NextOids(oids);
+		vbs.clear();
+		int error_index = 0;
+		int asked = m_tuning.max_repetitions;
+		int status = this->Request(m_version == 1 ? PDU_GETNEXT : PDU_GETBULK,
+		oids, state.NonRepeaters(), asked, vbs, &error_index);
+		if (status == SNMP_ERR_TOOBIG && m_version != 1 && asked > 1)
+			continue;
+		if (status != 0) {
+			if (!state.OnError(m_version, status, error_index))
+				throw fmt("SNMP error-status %d from %s", status, m_ip.c_str());
+			continue;
+		}
+		state.Advance(vbs, scb);
+	}
+}
+
+
+SNMPGetter::SNMPGetter(SNMPSession& session,
+const std::vector< SNMPOid >& oids)
+ : m_session(session),
+ m_oids(oids),
+ m_per_request(SNMP_GET_VARBINDS)
+{
+	m_oid_offsets.push_back(0);
+	for (size_t i = 0; i < oids.size(); ++i) {
+		BerAppendOidContent(m_oid_octets, oids[i]);
+		m_oid_offsets.push_back(m_oid_octets.length());
+	}
+	this->Prepare();
+}
+
+void SNMPGetter::Prepare() {
+	m_requests.clear();
+	for (size_t first = 0; first < m_oids.size(); first += m_per_request) {
+		m_requests.push_back(Request());
+		Request& req = m_requests.back();
+		req.first = first;
+		req.count = std::min(m_per_request, m_oids.size() - first);
+		std::vector< SNMPOid > oids(m_oids.begin() + first,
+		m_oids.begin() + first + req.count);
+		// Any id from NextRequestId() has the same encoded length as this.
+		req.packet = EncodeRequest(m_session.m_version, m_session.m_community,
+		PDU_GET, 0x01000000, oids, 0, 0, &(req.id_offset));
+	}
+}
+
+void SNMPGetter::Sample(std::vector< unsigned long long >& values,
+std::vector< bool >& present) {
+	values.resize(this->Size());
+	present.resize(this->Size());
+	static unsigned char buf[65536];
+	size_t r = 0;
+	while (r < m_requests.size()) {
+		Request& req = m_requests[r];
+		unsigned int request_id = m_session.NextRequestId();
+		for (int i = 0; i < 4; ++i) {
+			req.packet[req.id_offset + i]
+			= static_cast< char >((request_id >> (24 - i * 8)) & 0xff);
+		}
+		size_t len = m_session.Transact(req.packet, request_id, buf,
+		sizeof(buf));
+		unsigned int got_id;
+		int error_status;
+		int error_index;
+		BerReader list = DecodeResponseHeader(buf, len, &got_id, &error_status,
+		&error_index);
+		if (error_status == SNMP_ERR_TOOBIG && m_per_request > 1) {
+			// Start over with smaller requests; this is the only reallocation.
+			m_per_request /= 2;
+			this->Prepare();
+			r = 0;
+			continue;
+		}
+		if (error_status != 0)
+			throw fmt("SNMP error-status %d from %s", error_status,
+			m_session.m_ip.c_str());
+		for (size_t i = req.first; i < req.first + req.count; ++i) {
+			BerReader seq = list.Expect(BER_SEQUENCE);
+			BerReader oid = seq.Expect(SNMP_OBJECT_ID);
+			size_t oid_len = m_oid_offsets[i + 1] - m_oid_offsets[i];
+			if (static_cast< size_t >(oid.end - oid.p) != oid_len
+			|| memcmp(oid.p, m_oid_octets.data() + m_oid_offsets[i], oid_len) != 0)
+				throw fmt("Unexpected OID in SNMP response from %s",
+				m_session.m_ip.c_str());
+			unsigned char tag;
+			BerReader val = seq.Read(&tag);
+			switch (tag) {
+				case SNMP_INTEGER:
+					values[i] = static_cast< unsigned long long >(val.Integer());
+					present[i] = true;
+					break;
+				case SNMP_COUNTER32:
+				case SNMP_GAUGE32:
+				case SNMP_TIMETICKS:
+				case SNMP_COUNTER64:
+					values[i] = val.Unsigned();
+					present[i] = true;
+					break;
+				default:
+					present[i] = false;
+					break;
+			}
+		}
+		++r;
+	}
+}
+
+
+static const char* const OID_SYS_UP_TIME = ".1.3.6.1.2.1.1.3";
+static const char* const OID_IF_TABLE_LAST_CHANGE = ".1.3.6.1.2.1.31.1.5";
+
+SNMPTableCache::SNMPTableCache(const std::vector< SNMPOid >& columns,
+const std::vector< int >& ttls)
+ : m_columns(columns.size()),
+ m_uptime_oid(SNMPParseOid(OID_SYS_UP_TIME)),
+ m_last_change_oid(SNMPParseOid(OID_IF_TABLE_LAST_CHANGE)),
+ m_stamped(0)
+{
+	for (size_t c = 0; c < columns.size(); ++c) {
+		m_columns[c].oid = columns[c];
+		m_columns[c].ttl = (c < ttls.size() ? ttls[c] : 0);
+		m_columns[c].walked = 0;
+		m_columns[c].walking = false;
+	}
+}
+
+void SNMPTableCache::Clear() {
+	for (size_t c = 0; c < m_columns.size(); ++c) {
+		m_columns[c].walked = 0;
+		m_columns[c].vbs.clear();
+	}
+}
+
+std::vector< SNMPOid > SNMPTableCache::Begin() {
+	time_t now = time(0);
+	// The stamps lead; see Stamps().
+	std::vector< SNMPOid > walk;
+	walk.push_back(m_uptime_oid);
+	walk.push_back(m_last_change_oid);
+	m_walk_uptime = SNMPValue();
+	m_walk_last_change = SNMPValue();
+	for (size_t c = 0; c < m_columns.size(); ++c) {
+		Column& col = m_columns[c];
+		col.walking = (col.walked == 0 || now - col.walked >= col.ttl);
+		if (col.walking) {
+			col.vbs.clear();
+			walk.push_back(col.oid);
+		}
+	}
+	return walk;
+}
+
+void SNMPTableCache::OnVarBind(const SNMPVarBind& vb) {
+	for (size_t c = 0; c < m_columns.size(); ++c) {
+		if (m_columns[c].walking && OidStartsWith(vb.oid, m_columns[c].oid)) {
+			m_columns[c].vbs.push_back(vb);
+			return;
+		}
+	}
+	if (OidStartsWith(vb.oid, m_uptime_oid))
+		m_walk_uptime = vb;
+	else if (OidStartsWith(vb.oid, m_last_change_oid))
+		m_walk_last_change = vb;
+}
+
+bool SNMPTableCache::Finish(SNMPTable& table) {
+	time_t now = time(0);
+	bool cached = false;
+	for (size_t c = 0; c < m_columns.size(); ++c)
+		cached = cached || !m_columns[c].walking;
+	if (cached) {
+		/* sysUpTime (in hundredths of a second, wrapping at 2^32) that has
+		 * run ahead of our clock means the agent restarted in between.
+		 */
+		unsigned long long ticks = (m_walk_uptime.counter - m_uptime.counter)
+		& 0xffffffffULL;
+		bool restarted = (m_walk_uptime.type != SNMP_TIMETICKS
+		|| m_uptime.type != SNMP_TIMETICKS
+		|| ticks > static_cast< unsigned long long >(now - m_stamped + 2) * 100);
+		bool changed = (m_walk_last_change.type != m_last_change.type
+		|| m_walk_last_change.counter != m_last_change.counter);
+		if (restarted || changed) {
+			this->Clear();
+			return false;
+		}
+	}
+	m_uptime = m_walk_uptime;
+	m_last_change = m_walk_last_change;
+	m_stamped = now;
+
+	std::vector< SNMPOid > columns;
+	for (size_t c = 0; c < m_columns.size(); ++c)
+		columns.push_back(m_columns[c].oid);
+	SNMPTableBuilder builder(columns);
+	for (size_t c = 0; c < m_columns.size(); ++c) {
+		Column& col = m_columns[c];
+		if (col.walking) {
+			col.walking = false;
+			col.walked = (col.ttl > 0 ? now : 0);
+		}
+		for (std::vector< SNMPVarBind >::const_iterator it = col.vbs.begin();
+		it != col.vbs.end();
+		++it)
+			builder.OnVarBind(*it);
+	}
+	builder.Finish(table);
+	return true;
+}
+
+
+struct SNMPPollerWalk {
+	int version;
+	std::string community;
+	std::string ip;
+	int port;
+	struct sockaddr_in addr;
+	TableWalkState state;
+	SNMPCallback* scb;
+	SNMPTuning& tuning;
+	// The outstanding request, if request_id is non-zero.
+	unsigned int request_id;
+	std::string packet;
+	size_t oids;
+	int non_repeaters;
+	int asked;
+	long long sent;
+	int attempts;
+	long long deadline;
+
+	SNMPPollerWalk(int v, const std::string& c, const std::string& i, int p,
+	const std::vector< SNMPOid >& columns, size_t scalars, SNMPCallback* s)
+	 : version(v),
+	 community(c),
+	 ip(i),
+	 port(p),
+	 state(columns, v == 1 ? 0 : scalars),
+	 scb(s),
+	 tuning(SNMPTuning::For(i)),
+	 request_id(0),
+	 oids(0),
+	 non_repeaters(0),
+	 asked(0),
+	 sent(0),
+	 attempts(0),
+	 deadline(0)
+	{}
+};
+
+SNMPPoller::SNMPPoller(size_t max_walks, int host_interval_ms)
+ : m_max_walks(max_walks > 0 ? max_walks : 1),
+ m_host_interval_ms(host_interval_ms),
+ m_request_id(static_cast< unsigned int >(time(0)) * 2654435761U)
+{
+	m_sock = socket(AF_INET, SOCK_DGRAM, 0);
+#ifdef WIN32
+	if (m_sock == INVALID_SOCKET)
+#else
+	if (m_sock < 0)
+#endif
+		throw std::string("Failed to create SNMP poller socket");
+}
+
+SNMPPoller::~SNMPPoller() {
+	for (std::deque< SNMPPollerWalk* >::iterator it = m_queued.begin();
+	it != m_queued.end();
+	++it)
+		delete *it;
+	for (std::vector< SNMPPollerWalk* >::iterator it = m_running.begin();
+	it != m_running.end();
+	++it)
+		delete *it;
+#ifdef WIN32
+	closesocket(m_sock);
+#else
+	close(m_sock);
+#endif
+}
+
+void SNMPPoller::AddWalk(int version, const std::string& community,
+const std::string& ip, const std::vector< SNMPOid >& columns,
+SNMPCallback* scb, int port, size_t scalars) {
+	m_queued.push_back(new SNMPPollerWalk(version, community, ip, port,
+	columns, scalars, scb));
+}
+
+void SNMPPoller::Start(SNMPPollerWalk* walk) {
+	try {
+		if (walk->version != 1 && walk->version != 2)
+			throw fmt("Unsupported SNMP version: %d", walk->version);
+		ResolveAgent(walk->ip, walk->port, &(walk->addr));
+	} catch (std::string& e) {
+		walk->scb->OnComplete(e);
+		delete walk;
+		return;
+	}
+	m_running.push_back(walk);
+}
+
+void SNMPPoller::Send(SNMPPollerWalk* walk, long long now) {
+	if (walk->request_id == 0) {
+		// A new request rather than a retransmission.
+		m_request_id = (m_request_id + 1) & 0x7fffffff;
+		if (m_request_id == 0)
+			m_request_id = 1;
+		walk->request_id = m_request_id;
+		std::vector< SNMPOid > oids;
+		walk->state.NextOids(oids);
+		walk->oids = oids.size();
+		walk->non_repeaters = walk->state.NonRepeaters();
+		walk->asked = walk->tuning.max_repetitions;
+		walk->packet = EncodeRequest(walk->version, walk->community,
+		walk->version == 1 ? PDU_GETNEXT : PDU_GETBULK, walk->request_id,
+		oids, walk->non_repeaters, walk->asked);
+		walk->sent = now;
+		walk->attempts = 0;
+		m_requests[walk->request_id] = walk;
+	}
+	++(walk->attempts);
+	walk->deadline = now + SNMP_TIMEOUT_SECONDS * 1000;
+	m_host_ready[walk->addr.sin_addr.s_addr] = now + m_host_interval_ms;
+	// A failed send is left to the retransmit timer, like a lost datagram.
+	sendto(m_sock, walk->packet.data(), walk->packet.length(), 0,
+	(struct sockaddr*)&(walk->addr), sizeof(walk->addr));
+}
+
+void SNMPPoller::Receive() {
+	static unsigned char buf[65536];
+	struct sockaddr_in from;
+#ifdef WIN32
+	int fromlen = sizeof(from);
+#else
+	socklen_t fromlen = sizeof(from);
+#endif
+	int len = recvfrom(m_sock, reinterpret_cast< char* >(buf), sizeof(buf), 0,
+	(struct sockaddr*)&from, &fromlen);
+	if (len <= 0)
+		return;
+	unsigned int request_id;
+	int error_status;
+	int error_index;
+	std::vector< SNMPVarBind > vbs;
+	try {
+		DecodeResponse(buf, len, &request_id, &error_status, &error_index, vbs);
+	} catch (std::string&) {
+		return;
+	}
+	std::map< unsigned int, SNMPPollerWalk* >::iterator fd
+	= m_requests.find(request_id);
+	if (fd == m_requests.end())
+		return;
+	SNMPPollerWalk* walk = fd->second;
+	// Only the agent the request went to gets to answer it.
+	if (from.sin_addr.s_addr != walk->addr.sin_addr.s_addr
+	|| from.sin_port != walk->addr.sin_port)
+		return;
+	m_requests.erase(fd);
+	walk->request_id = 0;
+	// As in SNMPSession::Exchange(), non-repeaters alone don't count.
+	size_t repeaters = walk->oids - walk->non_repeaters;
+	if (walk->version != 1 && repeaters > 0) {
+		if (error_status == SNMP_ERR_TOOBIG)
+			walk->tuning.OnTooBig(walk->asked);
+		else if (error_status == 0) {
+			walk->tuning.OnResponse(walk->asked,
+			vbs.size() >= walk->non_repeaters + repeaters * walk->asked,
+			walk->attempts, NowMs() - walk->sent, len);
+		}
+	}
+	// After tooBig, the next request goes out smaller.
+	bool resend = (error_status == SNMP_ERR_TOOBIG && walk->version != 1
+	&& walk->asked > 1);
+	try {
+		if (error_status == 0)
+			walk->state.Advance(vbs, walk->scb);
+		else if (!resend
+		&& !walk->state.OnError(walk->version, error_status, error_index))
+			throw fmt("SNMP error-status %d from %s", error_status,
+			walk->ip.c_str());
+	} catch (std::string& e) {
+		this->Complete(walk, e);
+		return;
+	}
+	if (walk->state.Done())
+		this->Complete(walk, std::string());
+}
+
+void SNMPPoller::Complete(SNMPPollerWalk* walk, const std::string& error) {
+	if (walk->request_id != 0)
+		m_requests.erase(walk->request_id);
+	for (std::vector< SNMPPollerWalk* >::iterator it = m_running.begin();
+	it != m_running.end();
+	++it) {
+		if (*it == walk) {
+			m_running.erase(it);
+			break;
+		}
+	}
+	walk->scb->OnComplete(error);
+	delete walk;
+}
+
+void SNMPPoller::Run() {
+	while (!m_queued.empty() || !m_running.empty()) {
+		while (!m_queued.empty() && m_running.size() < m_max_walks) {
+			SNMPPollerWalk* walk = m_queued.front();
+			m_queued.pop_front();
+			this->Start(walk);
+		}
+		long long now = NowMs();
+		long long wake = now + SNMP_TIMEOUT_SECONDS * 1000;
+		// Iterate over a copy; Complete() removes walks from m_running.
+		std::vector< SNMPPollerWalk* > running(m_running);
+		for (std::vector< SNMPPollerWalk* >::iterator it = running.begin();
+		it != running.end();
+		++it) {
+			SNMPPollerWalk* walk = *it;
+			if (walk->request_id != 0 && walk->deadline > now) {
+				if (walk->deadline < wake)
+					wake = walk->deadline;
+				continue;
+			}
+			if (walk->request_id != 0 && walk->attempts > SNMP_RETRIES) {
+				if (walk->version != 1)
+					walk->tuning.OnTimeout(walk->asked);
+				this->Complete(walk, fmt("Timeout: No Response from %s",
+				walk->ip.c_str()));
+				continue;
+			}
+			long long ready = m_host_ready[walk->addr.sin_addr.s_addr];
+			if (ready > now) {
+				if (ready < wake)
+					wake = ready;
+				continue;
+			}
+			this->Send(walk, now);
+			if (walk->deadline < wake)
+				wake = walk->deadline;
+		}
+		if (m_running.empty())
+			continue;
+		struct timeval timeout;
+		long long wait = (wake > now ? wake - now : 0);
+		timeout.tv_sec = static_cast< long >(wait / 1000);
+		timeout.tv_usec = static_cast< long >((wait % 1000) * 1000);
+		fd_set fd;
+		FD_ZERO(&fd);
+		FD_SET(m_sock, &fd);
+		if (select(m_sock + 1, &fd, NULL, NULL, &timeout) > 0)
+			this->Receive();
+	}
+}
 
 
 void SNMPWalk(int version, const std::string& community, const std::string& ip,
 const std::string& oid, SNMPCallback* scb) {
-	std::string rn = fmt(
-		"snmpbulkwalk -v %dc -c %s %s %s 2>&1",
-		version,
-		community.c_str(),
-		ip.c_str(),
-		oid.c_str()
+	SNMPSession session(version, community, ip);
+	session.Walk(SNMPParseOid(oid), scb);
+}
+
+void SNMPWalkTable(int version, const std::string& community,
+const std::string& ip, const std::vector< std::string >& columns,
+SNMPTable& table) {
+	std::vector< SNMPOid > oids;
+	for (std::vector< std::string >::const_iterator it = columns.begin();
+	it != columns.end();
+	++it)
+		oids.push_back(SNMPParseOid(*it));
+	SNMPSession session(version, community, ip);
+	session.WalkTable(oids, table);
+}
+
+static int LeadingZeros64(unsigned long long word) {
+#ifdef __GNUC__
+	return __builtin_clzll(word);
+#else
+	int n = 0;
+	for (; !(word & 0x8000000000000000ULL); word <<= 1)
+		++n;
+	return n;
+#endif
+}
+
+void SNMPBitmapBits(const std::string& octets, unsigned int base,
+std::vector< unsigned int >& bits) {
+	const unsigned char* p = reinterpret_cast< const unsigned char* >(
+		octets.data()
 	);
-	FILE* p = popen(rn.c_str(), "r");
-	if (!p)
-		throw fmt("Failed to execute '%s'", rn.c_str());
-	pcrecpp::RE snmp1(".*\\.([0-9]+) \\= (.*)");
-	std::string line;
-	char c;
-	std::string num;
-	std::string val;
-	std::string err;
-	while (true) {
-		c = fgetc(p);
-		if (feof(p) || c == '\n') {
-			if (snmp1.FullMatch(line, &num, &val)) {
-				if (scb)
-					scb->OnData(num, val);
-			} else if (line.length() > 0 && err.length() <= 0)
-				err = line;
-			if (feof(p))
-				break;
-			line.clear();
-			continue;
+	for (size_t i = 0; i < octets.length(); i += 8) {
+		// Big-endian, so that bit 63 is the first bit of the eight octets.
+		unsigned long long word = 0;
+		size_t n = std::min(static_cast< size_t >(8), octets.length() - i);
+		for (size_t b = 0; b < n; ++b)
+			word |= static_cast< unsigned long long >(p[i + b]) << (56 - b * 8);
+		while (word != 0) {
+			int lead = LeadingZeros64(word);
+			bits.push_back(base + i * 8 + lead);
+			word &= ~(0x8000000000000000ULL >> lead);
 		}
-		line += c;
 	}
-	int ret = pclose(p);
-	if (ret != 0)
-		throw err;
 }
 
 std::string SNMPUnSTRING(const std::string& value)
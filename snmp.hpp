@@ -2,17 +2,432 @@
 #define SNMP_HPP_INC
 
 
+#ifdef WIN32
+#include <windows.h>
+#include <winsock2.h>
+#else
+extern "C" {
+#include <netinet/in.h>
+}
+#endif
+
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <ctime>
+
+
+/* ASN.1 / SNMP tags of the value types a varbind can carry, including the
+ * SNMPv2 exceptions that stand in for a value at the end of a walk.
+ */
+enum SNMPType {
+	SNMP_INTEGER = 0x02,
+	SNMP_OCTET_STRING = 0x04,
+	SNMP_NULL = 0x05,
+	SNMP_OBJECT_ID = 0x06,
+	SNMP_IPADDRESS = 0x40,
+	SNMP_COUNTER32 = 0x41,
+	SNMP_GAUGE32 = 0x42,
+	SNMP_TIMETICKS = 0x43,
+	SNMP_OPAQUE = 0x44,
+	SNMP_COUNTER64 = 0x46,
+	SNMP_NO_SUCH_OBJECT = 0x80,
+	SNMP_NO_SUCH_INSTANCE = 0x81,
+	SNMP_END_OF_MIB_VIEW = 0x82
+};
+
+typedef std::vector< unsigned int > SNMPOid;
+
+/* Parses a dotted OID (the leading '.' is optional). Throws a std::string if
+ * it isn't one.
+ */
+SNMPOid SNMPParseOid(const std::string& oid);
+// Formats an OID the way net-snmp does, with a leading '.'.
+std::string SNMPFormatOid(const SNMPOid& oid);
+
+/* One decoded value. Only the member matching the type is set. */
+struct SNMPValue {
+	SNMPType type;
+	// SNMP_INTEGER
+	long long integer;
+	// SNMP_COUNTER32, SNMP_GAUGE32, SNMP_TIMETICKS, SNMP_COUNTER64
+	unsigned long long counter;
+	// SNMP_OCTET_STRING, SNMP_IPADDRESS and SNMP_OPAQUE, as raw bytes
+	std::string octets;
+	// SNMP_OBJECT_ID
+	SNMPOid oid_value;
+
+	SNMPValue()
+	 : type(SNMP_NULL),
+	 integer(0),
+	 counter(0)
+	{}
+
+	// False for the exceptions that stand in for a missing value.
+	bool Exists() const {
+		return (this->type != SNMP_NO_SUCH_OBJECT
+		&& this->type != SNMP_NO_SUCH_INSTANCE
+		&& this->type != SNMP_END_OF_MIB_VIEW);
+	}
+	// INTEGER or any of the counter types as a number.
+	long long Number() const {
+		return (this->type == SNMP_INTEGER ? this->integer
+		: static_cast< long long >(this->counter));
+	}
+	// Renders the value as snmpwalk prints it, e.g. "Gauge32: 1000".
+	std::string Format() const;
+};
+
+/* One decoded variable binding: a value and the OID it was found at. */
+struct SNMPVarBind : public SNMPValue {
+	SNMPOid oid;
+
+	// The last sub-identifier; the ifIndex, for the interface tables.
+	unsigned int Index() const {
+		return (this->oid.empty() ? 0 : this->oid.back());
+	}
+};
 
+/* Several columns of one conceptual table, as walked by WalkTable(). rows
+ * holds each row's index (the OID suffix after the column, in ascending
+ * order) and columns[c][r] is column c's value in row r. A column with
+ * nothing in some row holds SNMP_NO_SUCH_INSTANCE there.
+ */
+struct SNMPTable {
+	std::vector< SNMPOid > rows;
+	std::vector< std::vector< SNMPValue > > columns;
 
+	/* Returns the row with a single-part index (such as an ifIndex), or
+	 * rows.size() if there isn't one.
+	 */
+	size_t Find(unsigned int index) const;
+};
+
+/* Receives the results of a walk. Callbacks written against the old
+ * snmpbulkwalk output implement OnData(), which gets the last sub-identifier
+ * and the value as snmpwalk would print it. New callbacks should override
+ * OnVarBind() instead and use the typed value directly.
+ */
 struct SNMPCallback {
 	virtual ~SNMPCallback() {}
-	virtual void OnData(const std::string& num, const std::string& val) = 0;
+	virtual void OnVarBind(const SNMPVarBind& vb);
+	virtual void OnData(const std::string& num, const std::string& val) {}
+	/* Called when a walk run by an SNMPPoller ends: error is empty if it
+	 * finished, or says why it was abandoned.
+	 */
+	virtual void OnComplete(const std::string& error) {}
+};
+
+/* An SNMPCallback that collects the varbinds of a table walk and lines them
+ * up into an SNMPTable.
+ */
+class SNMPTableBuilder : public SNMPCallback {
+public:
+	SNMPTableBuilder(const std::vector< SNMPOid >& columns);
+
+	virtual void OnVarBind(const SNMPVarBind& vb);
+	// Fills table with everything collected so far.
+	void Finish(SNMPTable& table) const;
+
+private:
+	std::vector< SNMPOid > m_columns;
+	std::vector< std::vector< SNMPVarBind > > m_found;
+};
+
+/* How big a GETBULK an agent gets, learned as walks go along and kept per
+ * agent for the life of the process. max_repetitions grows by a quarter
+ * after each full response that came back quickly and would still fit one
+ * Ethernet frame when grown. It halves after a retransmission or a timeout,
+ * and after tooBig, which also caps it from then on.
+ */
+struct SNMPTuning {
+	int max_repetitions;
+	// The most the agent has coped with; tooBig lowers it.
+	int ceiling;
+	// Smoothed round trip time of GETBULKs, in milliseconds.
+	long long rtt_ms;
+	// The size of the last GETBULK response, in bytes.
+	size_t response_bytes;
+
+	SNMPTuning();
+
+	/* The tuning for the agent at ip, created (starting from
+	 * max_repetitions, if that's positive) the first time it's asked for.
+	 */
+	static SNMPTuning& For(const std::string& ip, int max_repetitions = 0);
+	static std::map< std::string, SNMPTuning >* GetTunings();
+
+	/* Takes the outcome of a GETBULK that asked for max_repetitions asked:
+	 * full if it returned as many rows as asked for, after attempts sends.
+	 */
+	void OnResponse(int asked, bool full, int attempts, long long rtt,
+	size_t bytes);
+	void OnTooBig(int asked);
+	void OnTimeout(int asked);
+};
+
+/* A built-in SNMPv1/v2c client talking to one agent over UDP. Walks use
+ * GETBULK (GETNEXT for version 1), sized by the agent's SNMPTuning.
+ * Requests are retransmitted on timeout, and a reply that carries another
+ * request's id (a late answer to an earlier retransmission) is ignored.
+ */
+class SNMPSession {
+public:
+	SNMPSession(int version, const std::string& community,
+	const std::string& ip, int port = 161);
+	~SNMPSession();
+
+	/* GETs oids, appending their varbinds to vbs in the same order. Many
+	 * oids are split over several requests.
+	 */
+	void Get(const std::vector< SNMPOid >& oids, std::vector< SNMPVarBind >& vbs);
+	/* SETs every varbind's oid to its value. As many go in each request as
+	 * fit in a frame, so a long list is not set atomically; the first SET
+	 * that fails throws, leaving the later ones unsent. If set_count is
+	 * given, it is kept at how many of vbs, from the first, have been set,
+	 * so that it still tells after a throw.
+	 */
+	void Set(const std::vector< SNMPVarBind >& vbs, size_t* set_count = 0);
+	/* How many sends the last request took: more than one means that an
+	 * earlier send may have reached the agent, and a SET may have been
+	 * applied, even though its response was lost.
+	 */
+	int LastAttempts() const {
+		return this->m_last_attempts;
+	}
+	// Calls scb for every varbind below root, in order.
+	void Walk(const SNMPOid& root, SNMPCallback* scb);
+	/* Walks several columns of a table side by side: every GETBULK asks for
+	 * the next rows of all the columns still in progress, so the whole table
+	 * takes one sequence of round trips rather than one per column.
+	 */
+	void WalkTable(const std::vector< SNMPOid >& columns, SNMPTable& table);
+	/* The same walk, with the varbinds going to scb as they arrive. The
+	 * first scalars columns are scalars instead, asked for once as the first
+	 * GETBULK's non-repeaters.
+	 */
+	void WalkTable(const std::vector< SNMPOid >& columns, SNMPCallback* scb,
+	size_t scalars = 0);
+
+private:
+	friend class SNMPGetter;
+
+	// Not copyable; the socket belongs to exactly one session.
+	SNMPSession(const SNMPSession&);
+	SNMPSession& operator = (const SNMPSession&);
+
+	unsigned int NextRequestId();
+	/* Sends packet, which carries request_id, until a response to it
+	 * arrives, and returns the response's length. The response is left in
+	 * buf, and how many sends it took in *attempts.
+	 */
+	size_t Transact(const std::string& packet, unsigned int request_id,
+	unsigned char* buf, size_t size, int* attempts = 0);
+
+	/* Sends a PDU and waits for its response, retrying on timeout, and
+	 * returns the response's error-status (and error-index, if asked). The
+	 * varbinds are appended to vbs.
+	 */
+	int Request(unsigned char pdu_type, const std::vector< SNMPOid >& oids,
+	int non_repeaters, int max_repetitions, std::vector< SNMPVarBind >& vbs,
+	int* error_index = 0);
+	// The same, for count varbinds already encoded.
+	int Exchange(unsigned char pdu_type, const std::string& varbinds,
+	size_t count, int non_repeaters, int max_repetitions,
+	std::vector< SNMPVarBind >& vbs, int* error_index = 0);
+
+	int m_version;
+	std::string m_community;
+	std::string m_ip;
+	struct sockaddr_in m_addr;
+#ifdef WIN32
+	SOCKET m_sock;
+#else
+	int m_sock;
+#endif
+	unsigned int m_request_id;
+	SNMPTuning& m_tuning;
+	int m_last_attempts;
 };
 
+/* Reads the same instances again and again, as cheaply as possible. The GET
+ * requests are encoded once, up front; each Sample() only stamps a fresh
+ * request-id into them and decodes the responses in place, so after the
+ * first it allocates nothing.
+ *
+ * values[i] gets the value at oids[i] as a number (see SNMPValue::Number()),
+ * and present[i] says whether there was one: an instance the agent doesn't
+ * have, or one that isn't a number, leaves it false.
+ */
+class SNMPGetter {
+public:
+	SNMPGetter(SNMPSession& session, const std::vector< SNMPOid >& oids);
+
+	size_t Size() const {
+		return (m_oid_offsets.size() - 1);
+	}
+	void Sample(std::vector< unsigned long long >& values,
+	std::vector< bool >& present);
+
+private:
+	struct Request {
+		std::string packet;
+		size_t id_offset;
+		size_t first;
+		size_t count;
+	};
+
+	// (Re-)encodes the requests, m_per_request varbinds to each.
+	void Prepare();
+
+	SNMPSession& m_session;
+	std::vector< SNMPOid > m_oids;
+	// The encoded OIDs end to end, to check responses against.
+	std::string m_oid_octets;
+	std::vector< size_t > m_oid_offsets;
+	size_t m_per_request;
+	std::vector< Request > m_requests;
+};
+
+/* Remembers the table columns walked from one agent, so that the ones that
+ * hardly ever change (ifName, say) needn't be walked every time. Each column
+ * has a TTL in seconds, 0 meaning it is always walked.
+ *
+ * Every walk through the cache also fetches sysUpTime and
+ * ifTableLastChange. If the agent has restarted or its interface table has
+ * changed since the columns in the cache were walked, they are all thrown
+ * away. A walk goes like this, with any blocking or asynchronous walker:
+ *
+ *   do
+ *       walk cache.Begin(), with cache.Stamps() scalars, passing each
+ *       varbind to cache.OnVarBind()
+ *   while (!cache.Finish(table));
+ */
+class SNMPTableCache : public SNMPCallback {
+public:
+	SNMPTableCache(const std::vector< SNMPOid >& columns,
+	const std::vector< int >& ttls);
+
+	/* Returns the columns to walk now: the stamps, which are scalars, then
+	 * the stale columns.
+	 */
+	std::vector< SNMPOid > Begin();
+	// How many of Begin()'s columns are stamps, for WalkTable()'s scalars.
+	size_t Stamps() const {
+		return 2;
+	}
+	virtual void OnVarBind(const SNMPVarBind& vb);
+	/* Fills table with every column, walked or cached, as
+	 * SNMPSession::WalkTable() would. Returns false instead if the stamps
+	 * show that the cached columns are out of date; they have been dropped,
+	 * and the walk has to be done again.
+	 */
+	bool Finish(SNMPTable& table);
+	void Clear();
+
+private:
+	struct Column {
+		SNMPOid oid;
+		int ttl;
+		// When vbs was walked; 0 if it hasn't been.
+		time_t walked;
+		std::vector< SNMPVarBind > vbs;
+		bool walking;
+	};
+
+	std::vector< Column > m_columns;
+	SNMPOid m_uptime_oid;
+	SNMPOid m_last_change_oid;
+	// The stamps as of the cached columns, and as of the walk in progress.
+	SNMPValue m_uptime;
+	SNMPValue m_last_change;
+	time_t m_stamped;
+	SNMPValue m_walk_uptime;
+	SNMPValue m_walk_last_change;
+};
+
+struct SNMPPollerWalk;
+
+/* Runs table walks against many agents at once, all from one UDP socket.
+ * Every request gets a request-id unique within the poller, which is how a
+ * response finds its way back to its walk; requests that go unanswered are
+ * retransmitted on a timer. Each walk has one request outstanding at a
+ * time, at most max_walks walks run at once (the rest queue), and
+ * consecutive requests to any one agent are at least host_interval_ms
+ * apart.
+ *
+ * Varbinds go to each walk's SNMPCallback::OnVarBind() as they arrive,
+ * followed by one OnComplete(). A walk that fails (a timeout, an SNMP
+ * error) reports it through OnComplete() without disturbing the others.
+ */
+class SNMPPoller {
+public:
+	SNMPPoller(size_t max_walks = 256, int host_interval_ms = 0);
+	~SNMPPoller();
+
+	void AddWalk(int version, const std::string& community,
+	const std::string& ip, const std::vector< SNMPOid >& columns,
+	SNMPCallback* scb, int port = 161, size_t scalars = 0);
+	// Runs until every walk added so far has completed.
+	void Run();
+
+private:
+	// Not copyable; the socket belongs to exactly one poller.
+	SNMPPoller(const SNMPPoller&);
+	SNMPPoller& operator = (const SNMPPoller&);
+
+	void Start(SNMPPollerWalk* walk);
+	void Send(SNMPPollerWalk* walk, long long now);
+	void Receive();
+	void Complete(SNMPPollerWalk* walk, const std::string& error);
+
+	size_t m_max_walks;
+	int m_host_interval_ms;
+#ifdef WIN32
+	SOCKET m_sock;
+#else
+	int m_sock;
+#endif
+	unsigned int m_request_id;
+	std::deque< SNMPPollerWalk* > m_queued;
+	std::vector< SNMPPollerWalk* > m_running;
+	// Outstanding request-ids, and when each agent may next be sent to.
+	std::map< unsigned int, SNMPPollerWalk* > m_requests;
+	std::map< unsigned long, long long > m_host_ready;
+};
+
+/* Walks oid (as snmpbulkwalk would) with a one-off session. */
 void SNMPWalk(int version, const std::string& community, const std::string& ip,
 const std::string& oid, SNMPCallback* scb = 0);
+/* Walks the given columns with WalkTable() and a one-off session. */
+void SNMPWalkTable(int version, const std::string& community,
+const std::string& ip, const std::vector< std::string >& columns,
+SNMPTable& table);
 std::string SNMPUnSTRING(const std::string& value);
 
+/* Port and VLAN bitmaps (PortList, the CISCO-VTP-MIB VLAN lists) number
+ * their bits from the most significant bit of the first octet.
+ */
+inline bool SNMPBitmapTest(const std::string& octets, unsigned int bit) {
+	return (bit / 8 < octets.length()
+	&& (static_cast< unsigned char >(octets[bit / 8]) & (0x80 >> (bit % 8))));
+}
+// Sets or clears a bit, lengthening octets (with zeros) to reach it.
+inline void SNMPBitmapSet(std::string& octets, unsigned int bit, bool on) {
+	if (bit / 8 >= octets.length())
+		octets.resize(bit / 8 + 1, '\0');
+	if (on)
+		octets[bit / 8] |= static_cast< char >(0x80 >> (bit % 8));
+	else
+		octets[bit / 8] &= static_cast< char >(~(0x80 >> (bit % 8)));
+}
+/* Appends base + the number of every bit set in octets to bits, in order.
+ * Works a 64-bit word at a time, so long runs of clear bits cost next to
+ * nothing.
+ */
+void SNMPBitmapBits(const std::string& octets, unsigned int base,
+std::vector< unsigned int >& bits);
+
 
 #endif
@@ -0,0 +1,214 @@
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "snmp.hpp"
+#include "snmpber.hpp"
+
+
+void BerAppendLength(std::string& out, size_t len) {
+	if (len < 0x80) {
+		out += static_cast< char >(len);
+		return;
+	}
+	unsigned char buf[sizeof(size_t)];
+	int n = 0;
+	for (; len > 0; len >>= 8)
+		buf[n++] = static_cast< unsigned char >(len & 0xff);
+	out += static_cast< char >(0x80 | n);
+	while (n > 0)
+		out += static_cast< char >(buf[--n]);
+}
+
+void BerAppendTLV(std::string& out, unsigned char tag,
+const std::string& content) {
+	out += static_cast< char >(tag);
+	BerAppendLength(out, content.length());
+	out += content;
+}
+
+void BerAppendInteger(std::string& out, long long val) {
+	// Shortest two's complement form, most significant byte first.
+	unsigned char buf[sizeof(long long)];
+	int n = 0;
+	while (true) {
+		buf[n++] = static_cast< unsigned char >(val & 0xff);
+		val >>= 8;
+		if ((val == 0 && !(buf[n - 1] & 0x80))
+		|| (val == -1 && (buf[n - 1] & 0x80))
+		|| n == static_cast< int >(sizeof(buf)))
+			break;
+	}
+	std::string content;
+	while (n > 0)
+		content += static_cast< char >(buf[--n]);
+	BerAppendTLV(out, SNMP_INTEGER, content);
+}
+
+static void BerAppendSubId(std::string& out, unsigned int subid) {
+	unsigned char buf[5];
+	int n = 0;
+	do {
+		buf[n++] = static_cast< unsigned char >(subid & 0x7f);
+		subid >>= 7;
+	} while (subid > 0);
+	while (n > 1)
+		out += static_cast< char >(buf[--n] | 0x80);
+	out += static_cast< char >(buf[0]);
+}
+
+void BerAppendOidContent(std::string& out, const SNMPOid& oid) {
+	if (oid.size() < 2 || oid[0] > 2)
+		throw fmt("Invalid OID: %s", SNMPFormatOid(oid).c_str());
+	BerAppendSubId(out, oid[0] * 40 + oid[1]);
+	for (size_t i = 2; i < oid.size(); ++i)
+		BerAppendSubId(out, oid[i]);
+}
+
+void BerAppendOid(std::string& out, const SNMPOid& oid) {
+	std::string content;
+	BerAppendOidContent(content, oid);
+	BerAppendTLV(out, SNMP_OBJECT_ID, content);
+}
+
+
+static void DecodeVarBind(BerReader& list, SNMPVarBind& vb) {
+	BerReader seq = list.Expect(BER_SEQUENCE);
+	seq.Expect(SNMP_OBJECT_ID).Oid(vb.oid);
+	unsigned char tag;
+	BerReader val = seq.Read(&tag);
+	vb.type = static_cast< SNMPType >(tag);
+	switch (tag) {
+		case SNMP_INTEGER:
+			vb.integer = val.Integer();
+			break;
+		case SNMP_COUNTER32:
+		case SNMP_GAUGE32:
+		case SNMP_TIMETICKS:
+		case SNMP_COUNTER64:
+			vb.counter = val.Unsigned();
+			break;
+		case SNMP_OBJECT_ID:
+			val.Oid(vb.oid_value);
+			break;
+		case SNMP_NULL:
+		case SNMP_NO_SUCH_OBJECT:
+		case SNMP_NO_SUCH_INSTANCE:
+		case SNMP_END_OF_MIB_VIEW:
+			break;
+		default:
+			vb.octets = val.Octets();
+			break;
+	}
+}
+
+BerReader DecodeResponseHeader(const unsigned char* buf, size_t len,
+unsigned int* request_id, int* error_status, int* error_index) {
+	BerReader packet(buf, buf + len);
+	BerReader msg = packet.Expect(BER_SEQUENCE);
+	msg.Expect(SNMP_INTEGER);
+	msg.Expect(SNMP_OCTET_STRING);
+	BerReader pdu = msg.Expect(PDU_RESPONSE);
+	*request_id = static_cast< unsigned int >(pdu.Expect(SNMP_INTEGER).Integer());
+	*error_status = static_cast< int >(pdu.Expect(SNMP_INTEGER).Integer());
+	*error_index = static_cast< int >(pdu.Expect(SNMP_INTEGER).Integer());
+	return pdu.Expect(BER_SEQUENCE);
+}
+
+void DecodeResponse(const unsigned char* buf, size_t len,
+unsigned int* request_id, int* error_status, int* error_index,
+std::vector< SNMPVarBind >& vbs) {
+	BerReader list = DecodeResponseHeader(buf, len, request_id, error_status,
+	error_index);
+	while (!list.AtEnd()) {
+		vbs.push_back(SNMPVarBind());
+		DecodeVarBind(list, vbs.back());
+	}
+}
+
+static void BerAppendUnsigned(std::string& out, unsigned char tag,
+unsigned long long val) {
+	unsigned char buf[sizeof(val) + 1];
+	int n = 0;
+	do {
+		buf[n++] = static_cast< unsigned char >(val & 0xff);
+		val >>= 8;
+	} while (val > 0);
+	// A leading zero octet keeps it from reading as negative.
+	if (buf[n - 1] & 0x80)
+		buf[n++] = 0;
+	std::string content;
+	while (n > 0)
+		content += static_cast< char >(buf[--n]);
+	BerAppendTLV(out, tag, content);
+}
+
+void BerAppendValue(std::string& out, const SNMPValue& val) {
+	switch (val.type) {
+		case SNMP_INTEGER:
+			BerAppendInteger(out, val.integer);
+			break;
+		case SNMP_COUNTER32:
+		case SNMP_GAUGE32:
+		case SNMP_TIMETICKS:
+		case SNMP_COUNTER64:
+			BerAppendUnsigned(out, val.type, val.counter);
+			break;
+		case SNMP_OBJECT_ID:
+			BerAppendOid(out, val.oid_value);
+			break;
+		case SNMP_OCTET_STRING:
+		case SNMP_IPADDRESS:
+		case SNMP_OPAQUE:
+			BerAppendTLV(out, val.type, val.octets);
+			break;
+		default:
+			BerAppendTLV(out, val.type, std::string());
+			break;
+	}
+}
+
+void BerAppendVarBind(std::string& out, const SNMPOid& oid,
+const SNMPValue* val) {
+	std::string vb;
+	BerAppendOid(vb, oid);
+	if (val)
+		BerAppendValue(vb, *val);
+	else
+		BerAppendTLV(vb, SNMP_NULL, std::string());
+	BerAppendTLV(out, BER_SEQUENCE, vb);
+}
+
+std::string EncodeMessage(int version, const std::string& community,
+unsigned char pdu_type, unsigned int request_id, int non_repeaters,
+int max_repetitions, const std::string& varbinds, size_t* id_offset) {
+	std::string pdu;
+	BerAppendInteger(pdu, request_id);
+	BerAppendInteger(pdu, non_repeaters);
+	BerAppendInteger(pdu, max_repetitions);
+	BerAppendTLV(pdu, BER_SEQUENCE, varbinds);
+	std::string msg;
+	BerAppendInteger(msg, version - 1);
+	BerAppendTLV(msg, SNMP_OCTET_STRING, community);
+	BerAppendTLV(msg, pdu_type, pdu);
+	std::string packet;
+	BerAppendTLV(packet, BER_SEQUENCE, msg);
+	if (id_offset) {
+		// The PDU comes last, and the request-id's TLV first within it.
+		*id_offset = packet.length() - pdu.length() + 2;
+	}
+	return packet;
+}
+
+std::string EncodeRequest(int version, const std::string& community,
+unsigned char pdu_type, unsigned int request_id,
+const std::vector< SNMPOid >& oids, int non_repeaters, int max_repetitions,
+size_t* id_offset) {
+	std::string varbinds;
+	for (std::vector< SNMPOid >::const_iterator it = oids.begin();
+	it != oids.end();
+	++it)
+		BerAppendVarBind(varbinds, *it);
+	return EncodeMessage(version, community, pdu_type, request_id,
+	non_repeaters, max_repetitions, varbinds, id_offset);
+}
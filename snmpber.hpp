@@ -0,0 +1,147 @@
+#ifndef SNMPBER_HPP_INC
+#define SNMPBER_HPP_INC
+
+
+#include <string>
+#include <vector>
+
+#include "snmp.hpp"
+
+
+/* The BER encoding of SNMP messages, as SNMPSession and SNMPPoller send
+ * and receive them. Messages are small, so each TLV is built as a string
+ * and wrapped by its parent; responses are read in place.
+ */
+
+static const unsigned char BER_SEQUENCE = 0x30;
+static const unsigned char PDU_GET = 0xa0;
+static const unsigned char PDU_GETNEXT = 0xa1;
+static const unsigned char PDU_RESPONSE = 0xa2;
+static const unsigned char PDU_GETBULK = 0xa5;
+static const unsigned char PDU_SET = 0xa3;
+
+// A length in the short form below 128, else the shortest long form.
+void BerAppendLength(std::string& out, size_t len);
+void BerAppendTLV(std::string& out, unsigned char tag,
+const std::string& content);
+void BerAppendInteger(std::string& out, long long val);
+// The content octets of an OID, without the tag and length.
+void BerAppendOidContent(std::string& out, const SNMPOid& oid);
+void BerAppendOid(std::string& out, const SNMPOid& oid);
+void BerAppendValue(std::string& out, const SNMPValue& val);
+// One varbind, with a NULL value unless one is given.
+void BerAppendVarBind(std::string& out, const SNMPOid& oid,
+const SNMPValue* val = 0);
+
+/* BER decoding, over a [p, end) window of the received datagram. Anything
+ * that doesn't fit the window throws rather than reading past it.
+ */
+struct BerReader {
+	const unsigned char* p;
+	const unsigned char* end;
+
+	BerReader(const unsigned char* b, const unsigned char* e)
+	 : p(b),
+	 end(e)
+	{}
+
+	bool AtEnd() const {
+		return (this->p >= this->end);
+	}
+
+	// Reads one TLV header and returns a reader over its content.
+	BerReader Read(unsigned char* tag) {
+		if (this->end - this->p < 2)
+			throw std::string("Malformed SNMP response");
+		*tag = *(this->p++);
+		size_t len = *(this->p++);
+		if (len & 0x80) {
+			size_t n = len & 0x7f;
+			if (n == 0 || n > sizeof(size_t)
+			|| static_cast< size_t >(this->end - this->p) < n)
+				throw std::string("Malformed SNMP response");
+			for (len = 0; n > 0; --n)
+				len = (len << 8) | *(this->p++);
+		}
+		if (static_cast< size_t >(this->end - this->p) < len)
+			throw std::string("Malformed SNMP response");
+		BerReader content(this->p, this->p + len);
+		this->p += len;
+		return content;
+	}
+
+	BerReader Expect(unsigned char tag) {
+		unsigned char got;
+		BerReader content = this->Read(&got);
+		if (got != tag)
+			throw std::string("Malformed SNMP response");
+		return content;
+	}
+
+	long long Integer() const {
+		if (this->AtEnd())
+			return 0;
+		long long val = (*(this->p) & 0x80) ? -1 : 0;
+		for (const unsigned char* c = this->p; c < this->end; ++c)
+			val = (val << 8) | *c;
+		return val;
+	}
+
+	unsigned long long Unsigned() const {
+		unsigned long long val = 0;
+		for (const unsigned char* c = this->p; c < this->end; ++c)
+			val = (val << 8) | *c;
+		return val;
+	}
+
+	void Oid(SNMPOid& oid) const {
+		oid.clear();
+		unsigned int subid = 0;
+		for (const unsigned char* c = this->p; c < this->end; ++c) {
+			subid = (subid << 7) | (*c & 0x7f);
+			if (*c & 0x80)
+				continue;
+			if (oid.empty()) {
+				unsigned int first = (subid < 80 ? subid / 40 : 2);
+				oid.push_back(first);
+				oid.push_back(subid - first * 40);
+			} else
+				oid.push_back(subid);
+			subid = 0;
+		}
+	}
+
+	std::string Octets() const {
+		return std::string(reinterpret_cast< const char* >(this->p),
+		this->end - this->p);
+	}
+};
+
+/* Decodes the header of a Response-PDU and returns a reader over its
+ * varbind list, without copying anything out of buf. Throws if the datagram
+ * is malformed or isn't a response; the caller still has to check
+ * request_id.
+ */
+BerReader DecodeResponseHeader(const unsigned char* buf, size_t len,
+unsigned int* request_id, int* error_status, int* error_index);
+// The same, appending the varbinds to vbs.
+void DecodeResponse(const unsigned char* buf, size_t len,
+unsigned int* request_id, int* error_status, int* error_index,
+std::vector< SNMPVarBind >& vbs);
+
+/* Wraps an encoded varbind list into a request. If id_offset is given,
+ * it's set to where the request-id's value starts in the packet, so that
+ * the same packet can be sent again under another id of the same encoded
+ * length.
+ */
+std::string EncodeMessage(int version, const std::string& community,
+unsigned char pdu_type, unsigned int request_id, int non_repeaters,
+int max_repetitions, const std::string& varbinds, size_t* id_offset = 0);
+// A request for oids, with NULL values.
+std::string EncodeRequest(int version, const std::string& community,
+unsigned char pdu_type, unsigned int request_id,
+const std::vector< SNMPOid >& oids, int non_repeaters, int max_repetitions,
+size_t* id_offset = 0);
+
+
+#endif
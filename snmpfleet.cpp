@@ -0,0 +1,252 @@
+#include <cstdlib>
+#include <ctime>
+
+#include "host.hpp"
+#include "ifcounters.hpp"
+#include "snmpfleet.hpp"
+
+
+/* A pseudo-host standing for many SNMP-backed switches, polled together by
+ * one SNMPPoller. Its phost lists them under "hosts", keyed by any name the
+ * boss likes, each with the type, hostname and SNMP settings it would have
+ * as a host of its own:
+ *
+ *   { "type": "snmpfleet",
+ *     "max-walks": 256, "host-interval-ms": 0,
+ *     "hosts": { "sw1": { "type": "ciscoios", "hostname": "10.0.0.1",
+ *                         "proto-snmp2": "public", "snmp-port": 161 },
+ *                ... } }
+ *
+ * list-ifaces (and so watch-ifaces) returns each switch's interfaces under
+ * its name, at the detail level asked for. A switch that can't be polled is
+ * reported with a (non-fatal) error and left out. Columns that hardly change
+ * are kept in each switch's walk cache between polls (see
+ * SNMPIfaceLister::TTL()).
+ */
+class SNMPFleet : public Host {
+public:
+	SNMPFleet(const Boss& boss, const PropTree& phost);
+	virtual ~SNMPFleet();
+
+	virtual void Execute(const std::string& cmd, const std::string& args);
+
+private:
+	virtual void ListIfaces(PropTree& ifaces_tree, IfaceDetail detail);
+};
+
+static HostFactoryRegistrant< SNMPFleet > r("snmpfleet");
+
+
+/* Starts the agent's GETBULK sizing from the phost's
+ * "snmp-max-repetitions", if it has one: the boss can hand back what
+ * snmp-tuning reported last time, so that a new process needn't learn it
+ * all over again.
+ */
+static void SeedTuning(const PropTree& phost, const std::string& ip) {
+	SNMPTuning::For(ip,
+	static_cast< int >(phost["snmp-max-repetitions"].GetInt()));
+}
+
+
+std::map< std::string, SNMPIfaceLister* >* SNMPIfaceLister::GetListers() {
+	static std::map< std::string, SNMPIfaceLister* > listers;
+	return &listers;
+}
+
+void SNMPIfaceLister::ListIfaces(const PropTree& phost,
+PropTree& ifaces_tree, IfaceDetail detail) const {
+	std::string community = this->Community(phost);
+	std::string ip = phost["hostname"];
+	if (ip.length() <= 0)
+		throw fmt("Must supply a hostname or IP address for %s",
+		phost["type"].GetData().c_str());
+	int port = this->Port(phost);
+	SeedTuning(phost, ip);
+	SNMPSession session(2, community, ip, port);
+	SNMPTableCache& cache = this->Cache(ip, community, port, detail);
+	SNMPTable table;
+	do {
+		session.WalkTable(cache.Begin(), &cache, cache.Stamps());
+	} while (!cache.Finish(table));
+	this->BuildIfaces(table, ifaces_tree);
+}
+
+int SNMPIfaceLister::Port(const PropTree& phost) const {
+	if (!phost.ChildExists("snmp-port"))
+		return 161;
+	long long port = phost["snmp-port"].GetInt();
+	if (port <= 0 || port > 65535)
+		throw fmt("Invalid snmp-port: %s", phost["snmp-port"].GetData().c_str());
+	return static_cast< int >(port);
+}
+
+bool SNMPIfaceLister::CacheKey::operator < (const CacheKey& other) const {
+	if (ip != other.ip)
+		return ip < other.ip;
+	if (community != other.community)
+		return community < other.community;
+	if (port != other.port)
+		return port < other.port;
+	return columns < other.columns;
+}
+
+SNMPTableCache& SNMPIfaceLister::Cache(const std::string& ip,
+const std::string& community, int port, IfaceDetail detail) const {
+	CacheKey key;
+	key.ip = ip;
+	key.community = community;
+	key.port = port;
+	key.columns = this->ColumnCount(detail);
+	std::map< CacheKey, SNMPTableCache >::iterator fd = m_caches.find(key);
+	if (fd != m_caches.end())
+		return fd->second;
+	std::vector< SNMPOid > columns = this->Columns();
+	columns.resize(key.columns);
+	std::vector< int > ttls;
+	for (size_t c = 0; c < columns.size(); ++c)
+		ttls.push_back(this->TTL(c));
+	return m_caches.insert(
+		std::make_pair(key, SNMPTableCache(columns, ttls))
+	).first->second;
+}
+
+void SNMPIfaceLister::PollCounters(const Boss& boss, const PropTree& phost,
+const std::string& args) const {
+	char* end;
+	long interval = strtol(args.c_str(), &end, 10);
+	long polls = strtol(end, &end, 10);
+	if (args.length() <= 0)
+		interval = 1;
+	if (interval <= 0 || polls < 0 || *end != '\0')
+		throw fmt("Invalid poll-counters arguments: %s", args.c_str());
+	std::string community = this->Community(phost);
+	std::string ip = phost["hostname"];
+	if (ip.length() <= 0)
+		throw fmt("Must supply a hostname or IP address for %s",
+		phost["type"].GetData().c_str());
+	int port = this->Port(phost);
+	SeedTuning(phost, ip);
+	IfCounterPoller poller(2, community, ip, port);
+	PropTree ifaces_tree;
+	for (size_t i = 0; i < poller.Size(); ++i)
+		ifaces_tree[fmt("%u", poller.IfIndex(i))] = poller.Name(i);
+	boss.SendPropTree("counter-ifaces", ifaces_tree);
+
+	// Sized once, so that polling doesn't allocate.
+	std::string msg;
+	msg.reserve(poller.FormatSize() + 32);
+	time_t next = time(0);
+	for (long poll = 0; polls == 0 || poll < polls; ++poll) {
+		time_t now = time(0);
+		if (poll > 0 && boss.WaitForInput(next > now ? next - now : 0))
+			break;
+		next += interval;
+		if (!poller.Poll())
+			continue;
+		msg = "{\"counter-rates\": ";
+		poller.Format(msg);
+		msg += '}';
+		boss.SendMessage(msg);
+	}
+	boss.SendOutputFinished();
+}
+
+
+/* One switch's walk in a fleet poll, through the switch's cache. If the
+ * cache turns out to be stale, the walk is queued again on the same poller.
+ */
+struct FleetWalkCB : public SNMPCallback {
+	const Boss& boss;
+	SNMPPoller& poller;
+	std::string name;
+	const SNMPIfaceLister* lister;
+	std::string community;
+	std::string ip;
+	int port;
+	SNMPTableCache& cache;
+	PropTree& fleet_tree;
+	FleetWalkCB(const Boss& b, SNMPPoller& p, const std::string& n,
+	const SNMPIfaceLister* l, const std::string& c, const std::string& i,
+	int o, IfaceDetail d, PropTree& t)
+	 : boss(b),
+	 poller(p),
+	 name(n),
+	 lister(l),
+	 community(c),
+	 ip(i),
+	 port(o),
+	 cache(l->Cache(i, c, o, d)),
+	 fleet_tree(t)
+	{}
+	void Walk() {
+		poller.AddWalk(2, community, ip, cache.Begin(), this, port,
+		cache.Stamps());
+	}
+	virtual void OnVarBind(const SNMPVarBind& vb) {
+		cache.OnVarBind(vb);
+	}
+	virtual void OnComplete(const std::string& error) {
+		if (error.length() > 0) {
+			boss.SendError(fmt("%s: %s", name.c_str(), error.c_str()));
+			return;
+		}
+		SNMPTable table;
+		if (!cache.Finish(table)) {
+			this->Walk();
+			return;
+		}
+		lister->BuildIfaces(table, fleet_tree[name]);
+	}
+};
+
+
+SNMPFleet::SNMPFleet(const Boss& boss, const PropTree& phost)
+	: Host(boss, phost)
+{
+}
+SNMPFleet::~SNMPFleet() {
+}
+
+void SNMPFleet::Execute(const std::string& cmd, const std::string& args) {
+	throw fmt("Not implemented: %s", cmd.c_str());
+}
+
+void SNMPFleet::ListIfaces(PropTree& ifaces_tree, IfaceDetail detail) {
+	long long max_walks = m_phost["max-walks"].GetInt();
+	SNMPPoller poller(
+		max_walks > 0 ? static_cast< size_t >(max_walks) : 256,
+		static_cast< int >(m_phost["host-interval-ms"].GetInt())
+	);
+	std::vector< FleetWalkCB* > callbacks;
+	const PropTree& hosts = m_phost["hosts"];
+	for (PropTree::const_iterator it = hosts.Begin(); it != hosts.End(); ++it) {
+		std::map< std::string, SNMPIfaceLister* >::const_iterator fd
+		= SNMPIfaceLister::GetListers()->find((*it)["type"]);
+		try {
+			if (fd == SNMPIfaceLister::GetListers()->end()) {
+				throw fmt("No SNMP interface listing for switch type '%s'",
+				(*it)["type"].GetData().c_str());
+			}
+			std::string community = fd->second->Community(*it);
+			std::string ip = (*it)["hostname"];
+			if (ip.length() <= 0)
+				throw std::string("Must supply a hostname or IP address");
+			int port = fd->second->Port(*it);
+			SeedTuning(*it, ip);
+			callbacks.push_back(new FleetWalkCB(m_boss, poller, it.GetKey(),
+			fd->second, community, ip, port, detail, ifaces_tree));
+			callbacks.back()->Walk();
+		} catch (std::string& e) {
+			m_boss.SendError(fmt("%s: %s", it.GetKey().c_str(), e.c_str()));
+		}
+	}
+	try {
+		poller.Run();
+	} catch (...) {
+		for (size_t i = 0; i < callbacks.size(); ++i)
+			delete callbacks[i];
+		throw;
+	}
+	for (size_t i = 0; i < callbacks.size(); ++i)
+		delete callbacks[i];
+}
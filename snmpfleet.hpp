@@ -0,0 +1,87 @@
+#ifndef SNMPFLEET_HPP_INC
+#define SNMPFLEET_HPP_INC
+
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "common.hpp"
+#include "host.hpp"
+#include "snmp.hpp"
+
+
+/* How an SNMP-backed switch type lists its interfaces: which columns to walk
+ * and how to turn the table into the list-ifaces tree. Each type registers
+ * one under its switch type name (by constructing it as a static), so that
+ * the same code serves the type's own list-ifaces and an "snmpfleet" poll of
+ * many switches of mixed types at once. It also knows the community to use,
+ * which is all that poll-counters needs.
+ */
+struct SNMPIfaceLister {
+	static std::map< std::string, SNMPIfaceLister* >* GetListers();
+
+	SNMPIfaceLister(const std::string& switchtype) {
+		GetListers()->insert(std::pair< std::string, SNMPIfaceLister* >(
+			switchtype,
+			this
+		));
+	}
+	virtual ~SNMPIfaceLister() {}
+
+	// Returns phost's SNMPv2c community, or throws if it hasn't got one.
+	virtual std::string Community(const PropTree& phost) const = 0;
+	// Returns phost's "snmp-port", or 161 if it hasn't got one.
+	int Port(const PropTree& phost) const;
+	virtual std::vector< SNMPOid > Columns() const = 0;
+	/* How many of Columns(), from the first, list-ifaces needs at the given
+	 * detail level; by default, all of them. BuildIfaces() gets a table of
+	 * just those.
+	 */
+	virtual size_t ColumnCount(IfaceDetail detail) const {
+		return this->Columns().size();
+	}
+	/* How many seconds Columns()[column] may be served from the host's walk
+	 * cache; by default, none.
+	 */
+	virtual int TTL(size_t column) const {
+		return 0;
+	}
+	virtual void BuildIfaces(const SNMPTable& table,
+	PropTree& ifaces_tree) const = 0;
+
+	/* The walk cache for the agent at ip:port, as seen with community, and
+	 * the columns detail needs; kept for as long as the lister is.
+	 */
+	SNMPTableCache& Cache(const std::string& ip, const std::string& community,
+	int port, IfaceDetail detail) const;
+	// Walks the one switch described by phost, through its cache.
+	void ListIfaces(const PropTree& phost, PropTree& ifaces_tree,
+	IfaceDetail detail = IFACE_DETAIL_MEDIA) const;
+	/* Runs poll-counters against the switch described by phost: sends its
+	 * interfaces' names by ifIndex ("counter-ifaces"), then the rates from
+	 * IfCounterPoller after every poll ("counter-rates"). Args are
+	 * "<interval> [<polls>]", interval in seconds; as with watch-ifaces, with
+	 * no poll limit it stops when the boss sends its next op.
+	 */
+	void PollCounters(const Boss& boss, const PropTree& phost,
+	const std::string& args) const;
+
+private:
+	/* A community can be given a different view of the agent, so it's as
+	 * much part of the key as where the agent is.
+	 */
+	struct CacheKey {
+		std::string ip;
+		std::string community;
+		int port;
+		size_t columns;
+		bool operator < (const CacheKey& other) const;
+	};
+
+	// Filled in lazily by the const Cache().
+	mutable std::map< CacheKey, SNMPTableCache > m_caches;
+};
+
+
+#endif
@@ -12,10 +12,14 @@ extern "C" {
 #endif
 }
 
+#include <cstdlib>
+
 #include "terminal.hpp"
 
 
 const int NETWK_TIMEOUT_SECONDS = 30;
+// How much of a NETCONF reply to gather before handing it to a streaming dcb.
+const size_t NETCONF_CHUNK_SIZE = 4096;
 
 static const telnet_telopt_t my_telopts[] = {
 	{TELNET_TELOPT_ECHO, TELNET_WONT, TELNET_DO},
@@ -63,9 +67,11 @@ const std::string& continuation_regex)
 	m_sock(0),
 	m_ssh_session(0),
 	m_ssh_channel(0),
-	m_tel(0)
+	m_tel(0),
+	m_message_id(0),
+	m_request_open(false)
 {
-	PropTree auth_tree = p_auth;
+	const PropTree& auth_tree = p_auth;
 	if (proto != PROTO_NETCONF_SSH && prompt_regex.length() <= 0)
 		throw std::string("Must supply a prompt regex");
 
@@ -74,7 +80,7 @@ const std::string& continuation_regex)
 	sin.sin_family = AF_INET;
 	int portnum = 23;
 	if (auth_tree.ChildExists("port"))
-		portnum = atoi(auth_tree["port"].GetData().c_str());
+		portnum = static_cast< int >(auth_tree["port"].GetInt());
 	else if (proto == PROTO_SSH)
 		portnum = 22;
 	else if (proto == PROTO_NETCONF_SSH)
@@ -173,24 +179,8 @@ void Terminal::SetContinuationRegex(const std::string& reg) {
 
 void Terminal::Execute(const std::string& cmd, DataCallback* dcb) {
 	if (m_proto == PROTO_NETCONF_SSH) {
-		SendTerm(cmd + "]]>]]>");
-		std::string buf;
-		size_t blen;
-		while (true) {
-			buf += GetChar();
-			blen = buf.length();
-			if (blen >= 6
-			&& buf[blen - 6] == ']'
-			&& buf[blen - 5] == ']'
-			&& buf[blen - 4] == '>'
-			&& buf[blen - 3] == ']'
-			&& buf[blen - 2] == ']'
-			&& buf[blen - 1] == '>')
-				break;
-		}
-		buf.erase(blen - 6);
-		if (dcb)
-			dcb->OnData(buf);
+		this->Send(cmd, dcb);
+		this->Flush();
 	} else {
 		SendTerm(cmd + "\r");
 		while (GetChar() != '\n')
@@ -225,6 +215,141 @@ void Terminal::Execute(const std::string& cmd, DataCallback* dcb) {
 	}
 }
 
+void Terminal::Write(const std::string& piece) {
+	if (m_proto == PROTO_NETCONF_SSH)
+		this->SendRequestPiece(piece);
+	else
+		SendTerm(piece);
+}
+
+void Terminal::Send(const std::string& cmd, DataCallback* dcb) {
+	if (m_proto != PROTO_NETCONF_SSH)
+		throw std::string("Only NETCONF requests can be pipelined");
+	this->SendRequestPiece(cmd + "]]>]]>");
+	m_outstanding.push_back(std::make_pair(
+		m_request_open ? m_message_id : 0,
+		dcb
+	));
+	m_request_open = false;
+}
+
+void Terminal::Receive() {
+	std::string error;
+	if (!this->ReadReply(error))
+		throw error;
+}
+
+void Terminal::Flush() {
+	std::string first_error;
+	bool ok = true;
+	while (!m_outstanding.empty()) {
+		std::string error;
+		if (!this->ReadReply(error) && ok) {
+			first_error = error;
+			ok = false;
+		}
+	}
+	if (!ok)
+		throw first_error;
+}
+
+// Sends a piece of a NETCONF request, tagging it if it's the start of an <rpc>.
+void Terminal::SendRequestPiece(const std::string& piece) {
+	if (m_request_open || (piece.compare(0, 5, "<rpc>") != 0
+	&& piece.compare(0, 5, "<rpc ") != 0)) {
+		SendTerm(piece);
+		return;
+	}
+	m_request_open = true;
+	++m_message_id;
+	SendTerm(std::string("<rpc message-id=\"") + fmt("%lu", m_message_id)
+	+ "\"" + piece.substr(4));
+}
+
+/* Throws if a reply's <rpc-reply> says it answers a message-id other than
+ * id. One that doesn't say is taken on trust.
+ */
+static void CheckMessageId(const std::string& reply, unsigned long id) {
+	size_t tag = reply.find("<rpc-reply");
+	if (tag == std::string::npos)
+		return;
+	size_t tag_end = reply.find('>', tag);
+	size_t attr = reply.find("message-id=", tag);
+	if (tag_end == std::string::npos || attr == std::string::npos
+	|| attr > tag_end || attr + 12 >= tag_end)
+		return;
+	attr += 11;
+	size_t close = reply.find(reply[attr], attr + 1);
+	if (close == std::string::npos || close > tag_end)
+		return;
+	std::string got = reply.substr(attr + 1, close - attr - 1);
+	if (got != fmt("%lu", id)) {
+		throw fmt("NETCONF reply to message-id %s, where %lu was expected",
+		got.c_str(), id);
+	}
+}
+
+/* Reads the oldest outstanding NETCONF reply into its dcb. Returns false,
+ * with error set, if the dcb threw; the reply is read to its end anyway, so
+ * the replies after it aren't thrown out of step. Anything else (the
+ * connection failing, a reply to the wrong message-id) is thrown.
+ */
+bool Terminal::ReadReply(std::string& error) {
+	if (m_outstanding.empty())
+		throw std::string("No NETCONF reply is awaited");
+	unsigned long id = m_outstanding.front().first;
+	DataCallback* dcb = m_outstanding.front().second;
+	m_outstanding.pop_front();
+	bool streaming = (dcb && dcb->Streaming());
+	bool checked = (id == 0);
+	bool failed = false;
+	std::string buf;
+	size_t blen;
+	while (true) {
+		buf += GetChar();
+		blen = buf.length();
+		if (blen >= 6
+		&& buf[blen - 6] == ']'
+		&& buf[blen - 5] == ']'
+		&& buf[blen - 4] == '>'
+		&& buf[blen - 3] == ']'
+		&& buf[blen - 2] == ']'
+		&& buf[blen - 1] == '>')
+			break;
+		// Pass it on, all but what may be the start of the delimiter.
+		if (streaming && blen >= NETCONF_CHUNK_SIZE) {
+			if (!checked) {
+				CheckMessageId(buf, id);
+				checked = true;
+			}
+			try {
+				if (!failed)
+					dcb->OnChunk(buf.data(), blen - 5);
+			} catch (std::string& e) {
+				error = e;
+				failed = true;
+			}
+			buf.erase(0, blen - 5);
+		}
+	}
+	buf.erase(blen - 6);
+	if (!checked)
+		CheckMessageId(buf, id);
+	if (failed)
+		return false;
+	try {
+		if (streaming) {
+			dcb->OnChunk(buf.data(), buf.length());
+			dcb->OnEnd();
+		} else if (dcb)
+			dcb->OnData(buf);
+	} catch (std::string& e) {
+		error = e;
+		return false;
+	}
+	return true;
+}
+
 char Terminal::GetChar() {
 	if (m_proto == PROTO_SSH || m_proto == PROTO_NETCONF_SSH) {
 		int tmp;
@@ -9,6 +9,7 @@
 
 #include <cstdio>
 #include <queue>
+#include <deque>
 #include <pcrecpp.h>
 extern "C" {
 #include <libssh2.h>
@@ -20,6 +21,15 @@ extern "C" {
 struct DataCallback {
 	virtual ~DataCallback() {}
 	virtual void OnData(const std::string& data) = 0;
+	/* For NETCONF: if this returns true, the reply is given to OnChunk() in
+	 * pieces as it arrives, followed by a call to OnEnd(), instead of all at
+	 * once to OnData().
+	 */
+	virtual bool Streaming() const {
+		return false;
+	}
+	virtual void OnChunk(const char* data, size_t len) {}
+	virtual void OnEnd() {}
 };
 
 class Terminal {
@@ -34,10 +44,29 @@ public:
 	void SetPromptRegex(const std::string& reg);
 	void SetContinuationRegex(const std::string& reg);
 	void Execute(const std::string& cmd, DataCallback* dcb = 0);
+	/* Sends the start of a command without running it, so that a big NETCONF
+	 * request needn't be built whole: Write() it a piece at a time, then
+	 * Execute() (or Send()) the last piece.
+	 */
+	void Write(const std::string& piece);
+
+	/* NETCONF pipelining. Send() writes a request without waiting for its
+	 * reply; an <rpc> is tagged with the next message-id. The server answers
+	 * in the order sent, and Receive() reads the oldest reply outstanding
+	 * into the dcb it was sent with (with none, the reply is thrown away),
+	 * after checking it answers that message-id. Flush() receives all of
+	 * them, throwing the first dcb's error only once every reply is read.
+	 * Execute() is Send() then Flush().
+	 */
+	void Send(const std::string& cmd, DataCallback* dcb = 0);
+	void Receive();
+	void Flush();
 
 private:
 	char GetChar();
 	void SendTerm(const std::string& snd);
+	void SendRequestPiece(const std::string& piece);
+	bool ReadReply(std::string& error);
 
 	static int s_libssh_init_ct;
 
@@ -53,6 +82,11 @@ private:
 	LIBSSH2_CHANNEL* m_ssh_channel;
 	telnet_t* m_tel;
 	std::queue< char > m_telbuffer;
+	// The message-id of the last <rpc> sent, and if one is partly written.
+	unsigned long m_message_id;
+	bool m_request_open;
+	// Sent and not yet received, oldest first, with message-id 0 if untagged.
+	std::deque< std::pair< unsigned long, DataCallback* > > m_outstanding;
 };
 
 
@@ -0,0 +1,137 @@
+/* File: tests/propsnapshot_test.cpp
+ *
+ * Writes inventories to snapshot files and reads them back, both through
+ * node views and whole, and checks that corrupt files are refused. Run by
+ * "make test"; exits non-zero on the first failure.
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <string>
+
+#include "common.hpp"
+#include "propdiff.hpp"
+#include "propsnapshot.hpp"
+
+
+static const char* const SNAPSHOT_FILE = "propsnapshot_test.snap";
+
+// Normally main.cpp's; the test links without it.
+std::string fmt(const char* msg, ...) {
+	char buf[1024];
+	va_list ap;
+	va_start(ap, msg);
+	vsnprintf(buf, sizeof(buf), msg, ap);
+	va_end(ap);
+	return std::string(buf);
+}
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+			throw fmt("%s:%d: check failed: %s", __FILE__, __LINE__, #cond); \
+	} while (0)
+
+
+/* An inventory shaped like list-ifaces', with enough interfaces that the
+ * snapshot's sorted child index is used, plus every scalar type.
+ */
+static PropTree BuildInventory() {
+	PropTree inventory;
+	for (int i = 0; i < 1200; ++i) {
+		PropTree& iface = inventory[fmt("ge-0/0/%d", i)];
+		iface["description"] = fmt("port %d", i);
+		iface["speed"].SetInt(i % 2 ? 1000 : 10000);
+		iface["members"] = "";
+		iface["combiner"] = (i < 4 ? "erp:ring1" : "");
+	}
+	PropTree& ae = inventory["ae0"];
+	ae["members"].ArrayPushBack(PropTree("ge-0/0/1"));
+	ae["members"].ArrayPushBack(PropTree("ge-0/0/2"));
+	ae["speed"].SetInt(20000);
+	ae["load"].SetDouble(0.25);
+	ae["up"].SetBool(true);
+	ae["mtu"].SetNull();
+	ae["vlans"].SetArray();
+	// Shared copy-on-write, so written to the snapshot only once.
+	inventory["ae1"] = ae;
+	return inventory;
+}
+
+static void TestRoundTrip() {
+	PropTree inventory = BuildInventory();
+	PropSnapshot::Write(SNAPSHOT_FILE, inventory);
+	PropSnapshot snap(SNAPSHOT_FILE);
+
+	PropSnapshotNode root = snap.Root();
+	CHECK(root.Size() == inventory.Size());
+	CHECK(root["ge-0/0/777"]["description"].GetData() == "port 777");
+	CHECK(root["ge-0/0/777"]["speed"].GetInt() == 1000);
+	CHECK(root["ae0"]["members"].IsArray());
+	CHECK(root["ae0"]["members"].Size() == 2);
+	CHECK(root["ae0"]["members"][1].GetData() == "ge-0/0/2");
+	CHECK(root["ae1"]["load"].GetDouble() == 0.25);
+	CHECK(root["ae1"]["up"].GetBool());
+	CHECK(root["ae1"]["mtu"].GetType() == PROPTREE_NULL);
+	CHECK(!root["ge-9/9/9"].Exists());
+	CHECK(!root["ae0"]["nope"]["deeper"].Exists());
+
+	PropTree loaded = snap.Load();
+	CHECK(PropDiff::Diff(inventory, loaded).Size() == 0);
+	CHECK(PropDiff::Diff(loaded, inventory).Size() == 0);
+	CHECK(loaded["ae0"]["vlans"].IsArray());
+}
+
+static void TestTruncated() {
+	std::string encoded = PropSnapshot::Encode(BuildInventory());
+	FILE* f = fopen(SNAPSHOT_FILE, "wb");
+	CHECK(f != 0);
+	fwrite(encoded.data(), 1, encoded.length() / 2, f);
+	fclose(f);
+	bool refused = false;
+	try {
+		PropSnapshot snap(SNAPSHOT_FILE);
+	} catch (std::string& e) {
+		refused = true;
+	}
+	CHECK(refused);
+}
+
+static void TestChildBeforeParent() {
+	PropTree tree;
+	tree["a"]["b"] = "c";
+	std::string encoded = PropSnapshot::Encode(tree);
+	// Point the root's only child back at the root itself.
+	unsigned int root;
+	memcpy(&root, encoded.data() + 16, 4);
+	memcpy(&encoded[root + 16], &root, 4);
+	FILE* f = fopen(SNAPSHOT_FILE, "wb");
+	CHECK(f != 0);
+	fwrite(encoded.data(), 1, encoded.length(), f);
+	fclose(f);
+	PropSnapshot snap(SNAPSHOT_FILE);
+	bool refused = false;
+	try {
+		snap.Load();
+	} catch (std::string& e) {
+		refused = (e.find("Corrupt snapshot") == 0);
+	}
+	CHECK(refused);
+}
+
+
+int main() {
+	try {
+		TestRoundTrip();
+		TestTruncated();
+		TestChildBeforeParent();
+	} catch (std::string& e) {
+		remove(SNAPSHOT_FILE);
+		fprintf(stderr, "%s\n", e.c_str());
+		return 1;
+	}
+	remove(SNAPSHOT_FILE);
+	puts("propsnapshot_test: ok");
+	return 0;
+}
@@ -0,0 +1,258 @@
+/* File: tests/snmpber_test.cpp
+ *
+ * Encodes SNMP values and whole Response-PDUs with the BerAppend*()
+ * functions, decodes them again with BerReader and DecodeResponse(), and
+ * checks that everything survives the trip, byte for byte where the
+ * encoding is fixed. Run by "make test"; exits non-zero on the first
+ * failure.
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "snmp.hpp"
+#include "snmpber.hpp"
+
+
+// Normally main.cpp's; the test links without it.
+std::string fmt(const char* msg, ...) {
+	char buf[1024];
+	va_list ap;
+	va_start(ap, msg);
+	vsnprintf(buf, sizeof(buf), msg, ap);
+	va_end(ap);
+	return std::string(buf);
+}
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+			throw fmt("%s:%d: check failed: %s", __FILE__, __LINE__, #cond); \
+	} while (0)
+
+
+static std::string Bytes(const char* hex) {
+	std::string out;
+	unsigned int byte;
+	for (const char* c = hex; sscanf(c, "%2x", &byte) == 1; c += 2)
+		out += static_cast< char >(byte);
+	return out;
+}
+
+static BerReader Reader(const std::string& encoded) {
+	const unsigned char* p
+	= reinterpret_cast< const unsigned char* >(encoded.data());
+	return BerReader(p, p + encoded.length());
+}
+
+static bool Malformed(const std::string& encoded) {
+	try {
+		unsigned char tag;
+		Reader(encoded).Read(&tag);
+	} catch (std::string& e) {
+		return (e == "Malformed SNMP response");
+	}
+	return false;
+}
+
+// Short lengths take one octet, longer ones 0x80 | n and then n octets.
+static void TestLengths() {
+	const size_t lengths[] = { 0, 1, 127, 128, 255, 256, 65535, 65536 };
+	const char* const headers[] = {
+		"0400", "0401", "047f", "048180", "0481ff", "04820100", "0482ffff",
+		"0483010000"
+	};
+	for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+		std::string content(lengths[i], 'x');
+		std::string encoded;
+		BerAppendTLV(encoded, SNMP_OCTET_STRING, content);
+		CHECK(encoded.compare(0, encoded.length() - lengths[i],
+		Bytes(headers[i])) == 0);
+		CHECK(encoded.length() - lengths[i] == Bytes(headers[i]).length());
+		unsigned char tag;
+		BerReader reader = Reader(encoded);
+		CHECK(reader.Read(&tag).Octets() == content);
+		CHECK(tag == SNMP_OCTET_STRING);
+		CHECK(reader.AtEnd());
+	}
+	// Content shorter than its length, or a length with no octets.
+	CHECK(Malformed(Bytes("0405616263")));
+	CHECK(Malformed(Bytes("048201")));
+	CHECK(Malformed(Bytes("0480")));
+	CHECK(Malformed(Bytes("04")));
+}
+
+// The shortest two's complement form, however big or negative.
+static void TestIntegers() {
+	const long long values[] = {
+		0, 1, 127, 128, 255, 256, -1, -128, -129, -256, 2147483647LL,
+		-2147483647LL - 1, 4294967296LL, 9223372036854775807LL,
+		-9223372036854775807LL - 1
+	};
+	const char* const encodings[] = {
+		"020100", "020101", "02017f", "02020080", "020200ff", "02020100",
+		"0201ff", "020180", "0202ff7f", "0202ff00", "02047fffffff",
+		"020480000000", "02050100000000", "02087fffffffffffffff",
+		"02088000000000000000"
+	};
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+		std::string encoded;
+		BerAppendInteger(encoded, values[i]);
+		CHECK(encoded == Bytes(encodings[i]));
+		CHECK(Reader(encoded).Expect(SNMP_INTEGER).Integer() == values[i]);
+	}
+}
+
+// Unsigned types get a leading zero octet where the top bit is set.
+static void TestCounters() {
+	const SNMPType types[] = {
+		SNMP_COUNTER32, SNMP_GAUGE32, SNMP_TIMETICKS, SNMP_COUNTER64,
+		SNMP_COUNTER64, SNMP_COUNTER64
+	};
+	const unsigned long long values[] = {
+		0, 4294967295ULL, 128, 4294967296ULL, 9223372036854775808ULL,
+		18446744073709551615ULL
+	};
+	const char* const encodings[] = {
+		"410100", "420500ffffffff", "43020080", "46050100000000",
+		"4609008000000000000000", "460900ffffffffffffffff"
+	};
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+		SNMPValue val;
+		val.type = types[i];
+		val.counter = values[i];
+		std::string encoded;
+		BerAppendValue(encoded, val);
+		CHECK(encoded == Bytes(encodings[i]));
+		CHECK(Reader(encoded).Expect(types[i]).Unsigned() == values[i]);
+	}
+}
+
+static void TestOids() {
+	const char* const oids[] = {
+		".0.0", ".1.3", ".1.3.6.1.2.1.1.3.0", ".2.999.3",
+		".1.3.6.1.4.1.9.9.46.1.6.1.1.4.4294967295"
+	};
+	for (size_t i = 0; i < sizeof(oids) / sizeof(oids[0]); ++i) {
+		std::string encoded;
+		BerAppendOid(encoded, SNMPParseOid(oids[i]));
+		SNMPOid decoded;
+		Reader(encoded).Expect(SNMP_OBJECT_ID).Oid(decoded);
+		CHECK(SNMPFormatOid(decoded) == oids[i]);
+	}
+	std::string encoded;
+	BerAppendOid(encoded, SNMPParseOid(".1.3.6.1.2.1.1.3.0"));
+	CHECK(encoded == Bytes("06082b06010201010300"));
+}
+
+/* A whole GETBULK response: every value type, including the exceptions
+ * that end a walk, under a request-id, error-status and error-index.
+ */
+static void TestResponse() {
+	std::vector< SNMPVarBind > sent;
+	SNMPVarBind vb;
+	vb.oid = SNMPParseOid(".1.3.6.1.2.1.2.2.1.1.1");
+	vb.type = SNMP_INTEGER;
+	vb.integer = -40000;
+	sent.push_back(vb);
+	vb = SNMPVarBind();
+	vb.oid = SNMPParseOid(".1.3.6.1.2.1.31.1.1.1.1.1");
+	vb.type = SNMP_OCTET_STRING;
+	vb.octets = std::string(200, 'g') + std::string(1, '\0');
+	sent.push_back(vb);
+	vb = SNMPVarBind();
+	vb.oid = SNMPParseOid(".1.3.6.1.2.1.1.2.0");
+	vb.type = SNMP_OBJECT_ID;
+	vb.oid_value = SNMPParseOid(".1.3.6.1.4.1.9.1.1208");
+	sent.push_back(vb);
+	vb = SNMPVarBind();
+	vb.oid = SNMPParseOid(".1.3.6.1.2.1.4.20.1.1.10.0.0.1");
+	vb.type = SNMP_IPADDRESS;
+	vb.octets = Bytes("0a000001");
+	sent.push_back(vb);
+	vb = SNMPVarBind();
+	vb.oid = SNMPParseOid(".1.3.6.1.2.1.31.1.1.1.6.1");
+	vb.type = SNMP_COUNTER64;
+	vb.counter = 18446744073709551615ULL;
+	sent.push_back(vb);
+	const SNMPType exceptions[] = {
+		SNMP_NO_SUCH_OBJECT, SNMP_NO_SUCH_INSTANCE, SNMP_END_OF_MIB_VIEW
+	};
+	for (size_t i = 0; i < 3; ++i) {
+		vb = SNMPVarBind();
+		vb.oid = SNMPParseOid(".1.3.6.1.2.1.31.1.1.1.18.1");
+		vb.type = exceptions[i];
+		sent.push_back(vb);
+	}
+	std::string varbinds;
+	for (size_t i = 0; i < sent.size(); ++i)
+		BerAppendVarBind(varbinds, sent[i].oid, &sent[i]);
+	// A Response-PDU has error-status and error-index where GETBULK has
+	// non-repeaters and max-repetitions.
+	std::string packet = EncodeMessage(2, "public", PDU_RESPONSE, 0x7fffffff,
+	13, 2, varbinds);
+
+	unsigned int request_id;
+	int error_status;
+	int error_index;
+	std::vector< SNMPVarBind > got;
+	DecodeResponse(reinterpret_cast< const unsigned char* >(packet.data()),
+	packet.length(), &request_id, &error_status, &error_index, got);
+	CHECK(request_id == 0x7fffffff);
+	CHECK(error_status == 13);
+	CHECK(error_index == 2);
+	CHECK(got.size() == sent.size());
+	for (size_t i = 0; i < sent.size(); ++i) {
+		CHECK(got[i].oid == sent[i].oid);
+		CHECK(got[i].type == sent[i].type);
+		CHECK(got[i].integer == sent[i].integer);
+		CHECK(got[i].counter == sent[i].counter);
+		CHECK(got[i].octets == sent[i].octets);
+		CHECK(got[i].oid_value == sent[i].oid_value);
+		CHECK(got[i].Exists() == (i < 5));
+	}
+	CHECK(got[6].Format().length() > 0);
+
+	// Any truncation of it is refused rather than read past.
+	for (size_t len = 0; len < packet.length(); len += 7) {
+		got.clear();
+		bool refused = false;
+		try {
+			DecodeResponse(reinterpret_cast< const unsigned char* >(packet.data()),
+			len, &request_id, &error_status, &error_index, got);
+		} catch (std::string& e) {
+			refused = true;
+		}
+		CHECK(refused);
+	}
+	// As is a request, which isn't a response.
+	std::vector< SNMPOid > oids(1, SNMPParseOid(".1.3.6.1.2.1.1.3.0"));
+	std::string request = EncodeRequest(2, "public", PDU_GET, 1, oids, 0, 0);
+	bool refused = false;
+	try {
+		DecodeResponse(reinterpret_cast< const unsigned char* >(request.data()),
+		request.length(), &request_id, &error_status, &error_index, got);
+	} catch (std::string& e) {
+		refused = true;
+	}
+	CHECK(refused);
+}
+
+
+int main() {
+	try {
+		TestLengths();
+		TestIntegers();
+		TestCounters();
+		TestOids();
+		TestResponse();
+	} catch (std::string& e) {
+		fprintf(stderr, "%s\n", e.c_str());
+		return 1;
+	}
+	puts("snmpber_test: ok");
+	return 0;
+}
@@ -0,0 +1,216 @@
+/* File: tests/xmlstream_test.cpp
+ *
+ * Reads a Junos reply through XMLRecordReader whole, a byte at a time and
+ * in random pieces, and checks that every way gives the same records and
+ * rpc-error message: references, markup terminators and CDATA split across
+ * Feed() calls mustn't change what comes out. Run by "make test"; exits
+ * non-zero on the first failure.
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "common.hpp"
+#include "xmlstream.hpp"
+
+
+// Normally main.cpp's; the test links without it.
+std::string fmt(const char* msg, ...) {
+	char buf[1024];
+	va_list ap;
+	va_start(ap, msg);
+	vsnprintf(buf, sizeof(buf), msg, ap);
+	va_end(ap);
+	return std::string(buf);
+}
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+			throw fmt("%s:%d: check failed: %s", __FILE__, __LINE__, #cond); \
+	} while (0)
+
+
+/* A get-interface-information reply with a bit of everything: a prolog,
+ * a comment holding near-terminators, attribute values holding '>', entity
+ * and character references, CDATA, empty fields and two rpc-errors.
+ */
+static const char* const REPLY =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<!-- a > b, ]]> and -> are not the end of this -->\n"
+	"<rpc-reply xmlns:junos=\"http://xml.juniper.net/junos/*/junos\""
+	" message-id=\"7\">\n"
+	"<interface-information junos:style=\"normal\">\n"
+	"<physical-interface>\n"
+	"<name>\n"
+	"ge-0/0/0\n"
+	"</name>\n"
+	"<description>uplink &amp; \"core\" &lt;1&gt; &#65;&#x42;</description>\n"
+	"<logical-interface><name>ge-0/0/0.0</name></logical-interface>\n"
+	"<logical-interface><name>ge-0/0/0.32767</name></logical-interface>\n"
+	"</physical-interface>\n"
+	"<physical-interface junos:note=\"a > b\" other='x>\"y\"'>\n"
+	"<name junos:format=\"ae0 -> core\">ae0</name>\n"
+	"<description><![CDATA[lag <to> & ]] core]]></description>\n"
+	"<description/>\n"
+	"<logical-interface><name></name></logical-interface>\n"
+	"</physical-interface>\n"
+	"</interface-information>\n"
+	"<rpc-error>\n"
+	"<error-severity>error</error-severity>\n"
+	"<error-message>\n"
+	"syntax error, expecting &lt;vlan-name&gt;\n"
+	"</error-message>\n"
+	"</rpc-error>\n"
+	"<rpc-error><error-message>second</error-message></rpc-error>\n"
+	"</rpc-reply>\n";
+
+static const char* const EXPECTED_RECORDS =
+	"ge-0/0/0|uplink & \"core\" <1> AB|ge-0/0/0.0,ge-0/0/0.32767\n"
+	"ae0|lag <to> & ]] core|\n";
+
+static const char* const EXPECTED_ERROR =
+	"syntax error, expecting <vlan-name>";
+
+static const char* const FIELDS[] = {
+	"name",
+	"description",
+	"logical-interface/name"
+};
+
+// Writes each record out as a line: its name, description and units.
+class InterfaceReader : public XMLRecordReader {
+public:
+	InterfaceReader()
+	 : XMLRecordReader("interface-information/physical-interface", FIELDS,
+		sizeof(FIELDS) / sizeof(FIELDS[0]))
+	{}
+
+	std::string records;
+
+protected:
+	virtual void OnRecord() {
+		this->records += this->Value(0) + "|";
+		for (size_t n = 0; n < this->Count(1); ++n)
+			this->records += this->Value(1, n);
+		this->records += "|";
+		for (size_t n = 0; n < this->Count(2); ++n)
+			this->records += (n > 0 ? "," : "") + this->Value(2, n);
+		this->records += "\n";
+	}
+};
+
+/* Feeds REPLY to reader in pieces of the given lengths (repeating the
+ * last), and checks what it read.
+ */
+static void CheckRead(InterfaceReader& reader, const size_t* lengths,
+size_t length_count) {
+	size_t len = strlen(REPLY);
+	size_t pos = 0;
+	for (size_t i = 0; pos < len; ++i) {
+		size_t piece = lengths[i < length_count ? i : length_count - 1];
+		if (piece > len - pos)
+			piece = len - pos;
+		reader.Feed(REPLY + pos, piece);
+		pos += piece;
+	}
+	reader.Finish();
+	if (reader.records != EXPECTED_RECORDS)
+		throw fmt("Records differ:\n%s", reader.records.c_str());
+	CHECK(reader.Records() == 2);
+	CHECK(reader.ErrorMessage() == EXPECTED_ERROR);
+	CHECK(!reader.Ok());
+}
+
+static void TestWhole() {
+	InterfaceReader reader;
+	size_t whole = strlen(REPLY);
+	CheckRead(reader, &whole, 1);
+}
+
+static void TestByteByByte() {
+	InterfaceReader reader;
+	size_t one = 1;
+	CheckRead(reader, &one, 1);
+}
+
+static void TestRandomSplits() {
+	srand(1);
+	for (int run = 0; run < 500; ++run) {
+		size_t lengths[64];
+		for (size_t i = 0; i < 64; ++i)
+			lengths[i] = 1 + rand() % (run % 2 ? 8 : 64);
+		InterfaceReader reader;
+		CheckRead(reader, lengths, 64);
+	}
+}
+
+/* Splits at the places most likely to go wrong: inside a reference, and
+ * between the characters of a terminator after the search for it has
+ * already covered the rest of the comment.
+ */
+static void TestAwkwardSplits() {
+	const char* const pieces[] = {
+		"<rpc-reply><!-- comment ", "of some length -", "-", ">",
+		"<rpc-error><error-message>a &a", "mp", "; b &#6", "6;",
+		"<![CDATA[ x ]", "]", "> &lt", ";</error-message></rpc-error>",
+		"</rpc-reply>"
+	};
+	InterfaceReader reader;
+	for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); ++i)
+		reader.Feed(pieces[i], strlen(pieces[i]));
+	reader.Finish();
+	CHECK(reader.ErrorMessage() == "a & b B x <");
+}
+
+// The same reader goes on to the next reply after Finish().
+static void TestNextReply() {
+	InterfaceReader reader;
+	size_t whole = strlen(REPLY);
+	CheckRead(reader, &whole, 1);
+	const char* ok = "<rpc-reply message-id=\"8\">\n<ok/>\n</rpc-reply>\n";
+	reader.Feed(ok, strlen(ok));
+	reader.Finish();
+	CHECK(reader.Ok());
+	CHECK(reader.Records() == 0);
+	CHECK(reader.ErrorMessage().length() == 0);
+}
+
+static bool Refused(const char* xml) {
+	InterfaceReader reader;
+	try {
+		reader.Feed(xml, strlen(xml));
+		reader.Finish();
+	} catch (std::string& e) {
+		return (e.find("XML error: ") == 0);
+	}
+	return false;
+}
+
+static void TestMalformed() {
+	CHECK(Refused("<rpc-reply>&nbsp;</rpc-reply>"));
+	CHECK(Refused("<rpc-reply><ok/></rpc-error>"));
+	CHECK(Refused("<rpc-reply><!-- unfinished </rpc-reply>"));
+	CHECK(Refused("<rpc-reply/><rpc-reply/>"));
+	CHECK(Refused("<rpc-reply>"));
+}
+
+
+int main() {
+	try {
+		TestWhole();
+		TestByteByByte();
+		TestRandomSplits();
+		TestAwkwardSplits();
+		TestNextReply();
+		TestMalformed();
+	} catch (std::string& e) {
+		fprintf(stderr, "%s\n", e.c_str());
+		return 1;
+	}
+	puts("xmlstream_test: ok");
+	return 0;
+}
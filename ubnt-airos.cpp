@@ -19,6 +19,8 @@ private:
 
 static HostFactoryRegistrant< AirOS > r("airos");
 
+static const PropPath PATH_SSH_AUTH("proto-ssh.auth");
+
 
 struct AirOSCommandCB : public DataCallback {
 	const Boss& boss;
@@ -60,7 +62,7 @@ void AirOS::Execute(const std::string& cmd, const std::string& args) {
 void AirOS::GetTerminal() {
 	if (m_term)
 		return;
-	if (m_phost["proto-ssh"]["auth"].GetData() != "userpass")
+	if (PATH_SSH_AUTH.Get(m_phost).GetData() != "userpass")
 		throw std::string("Must use proto-ssh with auth \"userpass\" for Calix AE ONT");
 	m_term = new Terminal(PROTO_SSH, m_phost["hostname"].GetData(),
 	m_phost["proto-ssh"], "[^#]+# ", "--MORE--");
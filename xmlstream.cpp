@@ -0,0 +1,380 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "common.hpp"
+#include "xmlstream.hpp"
+
+
+static bool IsXMLSpace(char c) {
+	return (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+// Trims s and turns every run of white space within it into one space.
+static void CondenseWhiteSpace(std::string& s) {
+	size_t out = 0;
+	bool space = false;
+	for (size_t in = 0; in < s.length(); ++in) {
+		if (IsXMLSpace(s[in])) {
+			space = (out > 0);
+			continue;
+		}
+		if (space)
+			s[out++] = ' ';
+		space = false;
+		s[out++] = s[in];
+	}
+	s.erase(out);
+}
+
+static void AppendUTF8(std::string& out, unsigned long cp) {
+	if (cp < 0x80)
+		out += static_cast< char >(cp);
+	else if (cp < 0x800) {
+		out += static_cast< char >(0xc0 | (cp >> 6));
+		out += static_cast< char >(0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		out += static_cast< char >(0xe0 | (cp >> 12));
+		out += static_cast< char >(0x80 | ((cp >> 6) & 0x3f));
+		out += static_cast< char >(0x80 | (cp & 0x3f));
+	} else {
+		out += static_cast< char >(0xf0 | (cp >> 18));
+		out += static_cast< char >(0x80 | ((cp >> 12) & 0x3f));
+		out += static_cast< char >(0x80 | ((cp >> 6) & 0x3f));
+		out += static_cast< char >(0x80 | (cp & 0x3f));
+	}
+}
+
+void XMLAppendEscaped(std::string& out, const std::string& text) {
+	for (size_t i = 0; i < text.length(); ++i) {
+		switch (text[i]) {
+			case '<': out += "&lt;"; break;
+			case '>': out += "&gt;"; break;
+			case '&': out += "&amp;"; break;
+			case '"': out += "&quot;"; break;
+			case '\'': out += "&apos;"; break;
+			default: out += text[i]; break;
+		}
+	}
+}
+
+
+XMLStreamParser::XMLStreamParser(XMLStreamCallback* xcb)
+ : m_xcb(xcb),
+ m_pos(0),
+ m_scan(0),
+ m_depth(0),
+ m_seen_root(false)
+{
+}
+
+void XMLStreamParser::Feed(const char* data, size_t len) {
+	m_buf.append(data, len);
+	this->Parse();
+	// Only an unfinished token is kept.
+	if (m_pos > 0) {
+		m_buf.erase(0, m_pos);
+		m_scan = (m_scan > m_pos ? m_scan - m_pos : 0);
+		m_pos = 0;
+	}
+}
+
+void XMLStreamParser::Finish() {
+	bool complete = (m_seen_root && m_depth == 0);
+	for (size_t i = m_pos; complete && i < m_buf.length(); ++i)
+		complete = IsXMLSpace(m_buf[i]);
+	m_buf.clear();
+	m_pos = 0;
+	m_scan = 0;
+	m_depth = 0;
+	m_seen_root = false;
+	if (!complete)
+		throw std::string("XML error: Unexpected end of document");
+}
+
+void XMLStreamParser::Parse() {
+	while (m_pos < m_buf.length()) {
+		if (m_buf[m_pos] == '<') {
+			if (!this->ParseMarkup())
+				return;
+			continue;
+		}
+		size_t lt = m_buf.find('<', m_pos);
+		size_t end = lt;
+		if (lt == std::string::npos) {
+			// Hold back a reference that might be finished by the next piece.
+			end = m_buf.length();
+			size_t amp = m_buf.rfind('&');
+			if (amp != std::string::npos && amp >= m_pos
+			&& m_buf.find(';', amp) == std::string::npos)
+				end = amp;
+		}
+		if (end > m_pos)
+			this->DecodeText(m_pos, end);
+		m_pos = end;
+		if (lt == std::string::npos)
+			return;
+	}
+}
+
+/* Parses the markup at m_pos if it's all there, and returns whether it was.
+ */
+bool XMLStreamParser::ParseMarkup() {
+	const char* p = m_buf.data() + m_pos;
+	size_t avail = m_buf.length() - m_pos;
+	const char* term = ">";
+	size_t skip = 1;
+	bool cdata = false;
+	if (avail < 2)
+		return false;
+	if (p[1] == '?') {
+		term = "?>";
+		skip = 2;
+	} else if (p[1] == '!') {
+		if (avail < 3 || avail < (p[2] == '[' ? 9u : 4u))
+			return false;
+		if (strncmp(p, "<!--", 4) == 0) {
+			term = "-->";
+			skip = 4;
+		} else if (strncmp(p, "<![CDATA[", 9) == 0) {
+			term = "]]>";
+			skip = 9;
+			cdata = true;
+		}
+	} else {
+		// A tag, whose attribute values may hold a '>'.
+		char quote = 0;
+		for (size_t i = m_pos + 1; i < m_buf.length(); ++i) {
+			char c = m_buf[i];
+			if (quote) {
+				if (c == quote)
+					quote = 0;
+			} else if (c == '"' || c == '\'')
+				quote = c;
+			else if (c == '>') {
+				this->ParseTag(m_pos + 1, i);
+				m_pos = i + 1;
+				return true;
+			}
+		}
+		return false;
+	}
+	size_t found = m_buf.find(term, std::max(m_scan, m_pos + skip));
+	if (found == std::string::npos) {
+		// Don't search what's been searched again, short of a split terminator.
+		size_t term_len = strlen(term);
+		m_scan = std::max(m_pos + skip, m_buf.length() - (term_len - 1));
+		return false;
+	}
+	if (cdata && m_depth > 0) {
+		m_text.assign(m_buf, m_pos + skip, found - (m_pos + skip));
+		m_xcb->OnText(m_text);
+	}
+	m_pos = found + strlen(term);
+	m_scan = 0;
+	return true;
+}
+
+// The tag between m_buf[begin] and m_buf[end], less its angle brackets.
+void XMLStreamParser::ParseTag(size_t begin, size_t end) {
+	bool closing = (m_buf[begin] == '/');
+	if (closing)
+		++begin;
+	bool empty = (!closing && end > begin && m_buf[end - 1] == '/');
+	size_t name_end = begin;
+	while (name_end < end && !IsXMLSpace(m_buf[name_end])
+	&& m_buf[name_end] != '/')
+		++name_end;
+	if (name_end == begin)
+		throw std::string("XML error: Tag without a name");
+	m_name.assign(m_buf, begin, name_end - begin);
+	if (closing) {
+		if (m_depth == 0 || m_open[m_depth - 1] != m_name)
+			throw fmt("XML error: Unexpected </%s>", m_name.c_str());
+		--m_depth;
+		m_xcb->OnEndElement(m_name);
+		return;
+	}
+	if (m_depth == 0 && m_seen_root)
+		throw fmt("XML error: <%s> after the root element", m_name.c_str());
+	m_seen_root = true;
+	if (m_open.size() <= m_depth)
+		m_open.push_back(m_name);
+	else
+		m_open[m_depth] = m_name;
+	++m_depth;
+	m_xcb->OnStartElement(m_name);
+	if (empty) {
+		--m_depth;
+		m_xcb->OnEndElement(m_name);
+	}
+}
+
+void XMLStreamParser::DecodeText(size_t begin, size_t end) {
+	if (m_depth == 0) {
+		for (size_t i = begin; i < end; ++i) {
+			if (!IsXMLSpace(m_buf[i]))
+				throw std::string("XML error: Text outside the root element");
+		}
+		return;
+	}
+	m_text.clear();
+	for (size_t i = begin; i < end; ++i) {
+		if (m_buf[i] != '&') {
+			m_text += m_buf[i];
+			continue;
+		}
+		size_t semi = m_buf.find(';', i);
+		if (semi == std::string::npos || semi >= end)
+			throw std::string("XML error: Unterminated reference");
+		const char* ref = m_buf.data() + i + 1;
+		size_t ref_len = semi - i - 1;
+		if (ref_len == 2 && strncmp(ref, "lt", 2) == 0)
+			m_text += '<';
+		else if (ref_len == 2 && strncmp(ref, "gt", 2) == 0)
+			m_text += '>';
+		else if (ref_len == 3 && strncmp(ref, "amp", 3) == 0)
+			m_text += '&';
+		else if (ref_len == 4 && strncmp(ref, "quot", 4) == 0)
+			m_text += '"';
+		else if (ref_len == 4 && strncmp(ref, "apos", 4) == 0)
+			m_text += '\'';
+		else if (ref_len >= 2 && ref[0] == '#') {
+			char* num_end;
+			unsigned long cp = (ref[1] == 'x'
+			? strtoul(ref + 2, &num_end, 16) : strtoul(ref + 1, &num_end, 10));
+			if (num_end != m_buf.data() + semi || cp > 0x10ffff)
+				throw std::string("XML error: Bad character reference");
+			AppendUTF8(m_text, cp);
+		} else {
+			throw fmt("XML error: Unknown entity &%s;",
+			std::string(ref, ref_len).c_str());
+		}
+		i = semi;
+	}
+	m_xcb->OnText(m_text);
+}
+
+
+XMLRecordReader::XMLRecordReader(const std::string& record_path,
+const char* const* fields, size_t field_count)
+ : m_parser(this),
+ m_record_path(SplitPath(record_path)),
+ m_depth(0),
+ m_record_depth(0),
+ m_field_depth(0),
+ m_field(0),
+ m_values(field_count),
+ m_counts(field_count, 0),
+ m_records(0),
+ m_ok(false),
+ m_error_depth(0)
+{
+	for (size_t f = 0; f < field_count; ++f)
+		m_field_paths.push_back(SplitPath(fields[f]));
+}
+
+void XMLRecordReader::Feed(const char* data, size_t len) {
+	m_parser.Feed(data, len);
+}
+
+void XMLRecordReader::Finish() {
+	m_depth = 0;
+	m_record_depth = 0;
+	m_field_depth = 0;
+	m_error_depth = 0;
+	m_parser.Finish();
+}
+
+const std::string& XMLRecordReader::Value(size_t field, size_t n) const {
+	static const std::string none;
+	return (n < m_counts[field] ? m_values[field][n] : none);
+}
+
+std::vector< std::string > XMLRecordReader::SplitPath(
+const std::string& path) {
+	std::vector< std::string > names;
+	size_t begin = 0;
+	while (begin < path.length()) {
+		size_t slash = path.find('/', begin);
+		if (slash == std::string::npos)
+			slash = path.length();
+		names.push_back(path.substr(begin, slash - begin));
+		begin = slash + 1;
+	}
+	return names;
+}
+
+bool XMLRecordReader::MatchesFrom(size_t from,
+const std::vector< std::string >& path) const {
+	for (size_t i = 0; i < path.size(); ++i) {
+		if (m_stack[from + i] != path[i])
+			return false;
+	}
+	return true;
+}
+
+void XMLRecordReader::OnStartElement(const std::string& name) {
+	if (m_depth == 0) {
+		m_records = 0;
+		m_ok = false;
+		m_error_message.clear();
+	}
+	if (m_stack.size() <= m_depth)
+		m_stack.push_back(name);
+	else
+		m_stack[m_depth] = name;
+	++m_depth;
+	if (m_record_depth == 0) {
+		if (m_record_path.size() > 0 && m_depth == m_record_path.size() + 1
+		&& this->MatchesFrom(1, m_record_path)) {
+			m_record_depth = m_depth;
+			m_counts.assign(m_counts.size(), 0);
+		} else if (m_depth == 2 && name == "ok")
+			m_ok = true;
+		else if (m_depth >= 2 && m_error_depth == 0
+		&& m_error_message.length() <= 0 && name == "error-message"
+		&& m_stack[m_depth - 2] == "rpc-error")
+			m_error_depth = m_depth;
+		return;
+	}
+	if (m_field_depth > 0)
+		return;
+	for (size_t f = 0; f < m_field_paths.size(); ++f) {
+		if (m_depth == m_record_depth + m_field_paths[f].size()
+		&& this->MatchesFrom(m_record_depth, m_field_paths[f])) {
+			m_field = f;
+			m_field_depth = m_depth;
+			if (m_values[f].size() <= m_counts[f])
+				m_values[f].push_back(std::string());
+			else
+				m_values[f][m_counts[f]].clear();
+			break;
+		}
+	}
+}
+
+void XMLRecordReader::OnText(const std::string& text) {
+	if (m_field_depth > 0 && m_field_depth == m_depth)
+		m_values[m_field][m_counts[m_field]] += text;
+	else if (m_error_depth > 0 && m_error_depth == m_depth)
+		m_error_message += text;
+}
+
+void XMLRecordReader::OnEndElement(const std::string& name) {
+	if (m_field_depth == m_depth) {
+		std::string& value = m_values[m_field][m_counts[m_field]];
+		CondenseWhiteSpace(value);
+		if (value.length() > 0)
+			++m_counts[m_field];
+		m_field_depth = 0;
+	} else if (m_record_depth == m_depth) {
+		++m_records;
+		this->OnRecord();
+		m_record_depth = 0;
+	} else if (m_error_depth == m_depth) {
+		CondenseWhiteSpace(m_error_message);
+		m_error_depth = 0;
+	}
+	--m_depth;
+}
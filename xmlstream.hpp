@@ -0,0 +1,138 @@
+#ifndef XMLSTREAM_HPP_INC
+#define XMLSTREAM_HPP_INC
+
+
+#include <string>
+#include <vector>
+
+
+/* Appends text to out with the characters XML reserves escaped, fit for
+ * element text or a quoted attribute value.
+ */
+void XMLAppendEscaped(std::string& out, const std::string& text);
+
+/* What XMLStreamParser reports, in document order. Text comes with entities
+ * and CDATA decoded but otherwise as it was, and may be split over several
+ * calls.
+ */
+struct XMLStreamCallback {
+	virtual ~XMLStreamCallback() {}
+	virtual void OnStartElement(const std::string& name) = 0;
+	virtual void OnText(const std::string& text) = 0;
+	virtual void OnEndElement(const std::string& name) = 0;
+};
+
+/* An event-based XML parser that can be fed a document in pieces of any size
+ * as they arrive, so that nothing but the current tag (or run of text) is
+ * ever buffered. It knows enough XML for NETCONF replies: elements, text,
+ * entity and character references, CDATA, comments and processing
+ * instructions. Attributes and DOCTYPEs are skipped.
+ *
+ * Malformed input throws a std::string starting "XML error: ", as does a
+ * document that's unfinished when Finish() is called.
+ */
+class XMLStreamParser {
+public:
+	XMLStreamParser(XMLStreamCallback* xcb);
+
+	void Feed(const char* data, size_t len);
+	// Checks that the document was complete, and readies for another.
+	void Finish();
+
+private:
+	void Parse();
+	bool ParseMarkup();
+	void ParseTag(size_t begin, size_t end);
+	void DecodeText(size_t begin, size_t end);
+
+	XMLStreamCallback* m_xcb;
+	std::string m_buf;
+	// How much of m_buf has been parsed, and searched for the next token's end.
+	size_t m_pos;
+	size_t m_scan;
+	std::vector< std::string > m_open;
+	size_t m_depth;
+	bool m_seen_root;
+	std::string m_name;
+	std::string m_text;
+};
+
+/* Reads a document through XMLStreamParser as a series of records: every
+ * element at record_path (a '/'-separated path of element names below the
+ * root; empty for none) is one, and of it only the text of the elements at
+ * the given field paths (relative to the record) is kept. OnRecord() is
+ * called as each record's end tag is parsed, and the record is then
+ * forgotten, so however long the document, only one record is held at a
+ * time.
+ *
+ * Field text has its white space condensed, as TinyXML does. A field may
+ * occur any number of times per record; one whose text is empty doesn't
+ * count.
+ *
+ * Outside the records, it notes any <ok/> directly below the root and the
+ * first rpc-error's error-message, as found in NETCONF replies.
+ */
+class XMLRecordReader : private XMLStreamCallback {
+public:
+	XMLRecordReader(const std::string& record_path,
+	const char* const* fields, size_t field_count);
+	virtual ~XMLRecordReader() {}
+
+	void Feed(const char* data, size_t len);
+	// As XMLStreamParser::Finish(); the reader is then ready for another.
+	void Finish();
+
+	// Within OnRecord(): how many of a field there were, and their text.
+	size_t Count(size_t field) const {
+		return m_counts[field];
+	}
+	bool Has(size_t field) const {
+		return (m_counts[field] > 0);
+	}
+	// The n'th of a field, or an empty string if there's no such one.
+	const std::string& Value(size_t field, size_t n = 0) const;
+
+	// How many records the document has had so far.
+	size_t Records() const {
+		return m_records;
+	}
+	bool Ok() const {
+		return m_ok;
+	}
+	const std::string& ErrorMessage() const {
+		return m_error_message;
+	}
+
+protected:
+	virtual void OnRecord() = 0;
+
+private:
+	static std::vector< std::string > SplitPath(const std::string& path);
+
+	virtual void OnStartElement(const std::string& name);
+	virtual void OnText(const std::string& text);
+	virtual void OnEndElement(const std::string& name);
+	bool MatchesFrom(size_t from, const std::vector< std::string >& path) const;
+
+	XMLStreamParser m_parser;
+	std::vector< std::string > m_record_path;
+	std::vector< std::vector< std::string > > m_field_paths;
+	// The names of the elements now open, root first.
+	std::vector< std::string > m_stack;
+	size_t m_depth;
+	// How deep the current record and field are, if in one; 0 if not.
+	size_t m_record_depth;
+	size_t m_field_depth;
+	size_t m_field;
+	// Each field's values, of which the first m_counts are this record's.
+	std::vector< std::vector< std::string > > m_values;
+	std::vector< size_t > m_counts;
+	size_t m_records;
+	bool m_ok;
+	// How deep the error-message being read is, or 0.
+	size_t m_error_depth;
+	std::string m_error_message;
+};
+
+
+#endif